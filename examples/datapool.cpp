@@ -82,28 +82,34 @@ int main() {
   dataSliceFile = dp.createDataSlice("value", "internalValuesDim");
   std::cout << "Slice written to " << dataSliceFile << std::endl;
 
-  // Or you can request a slice to memory.
+  // Slices can span several dimensions
+  dataSliceFile =
+      dp.createDataSlice("value", {"dirDim", "internalValuesDim"});
+  std::cout << "2D slice written to " << dataSliceFile << std::endl;
+
+  // Or you can request a slice to memory. This reads the value across all
+  // directories for the current index of internalValuesDim.
   // By default this will write a file or read the file if already produced
   size_t readCount = 0;
 
   float slice[5];
   internalValuesDim->setCurrentIndex(0);
   std::cout << "Current file: " << dp.getCurrentFiles()[0] << std::endl;
-  dp.readDataSlice("value", "internalValuesDim", slice, 5);
+  dp.readDataSlice("value", "dirDim", slice, 5);
   for (size_t i = 0; i < 5; i++) {
     std::cout << slice[i] << " ";
   }
   std::cout << std::endl;
   internalValuesDim->setCurrentIndex(1);
   std::cout << "Current file: " << dp.getCurrentFiles()[0] << std::endl;
-  dp.readDataSlice("value", "internalValuesDim", slice, 5);
+  dp.readDataSlice("value", "dirDim", slice, 5);
   for (size_t i = 0; i < 5; i++) {
     std::cout << slice[i] << " ";
   }
   std::cout << std::endl;
   internalValuesDim->setCurrentIndex(2);
   std::cout << "Current file: " << dp.getCurrentFiles()[0] << std::endl;
-  dp.readDataSlice("value", "internalValuesDim", slice, 5);
+  dp.readDataSlice("value", "dirDim", slice, 5);
   for (size_t i = 0; i < 5; i++) {
     std::cout << slice[i] << " ";
   }
@@ -0,0 +1,59 @@
+#include "tinc/DataPool.hpp"
+
+#include <iostream>
+
+// Packs the data files produced by a parameter sweep into a single
+// consolidated file. DataPool reads slices from that file instead of the
+// data files in each run directory once it exists.
+//
+// Usage:
+//   datapool_consolidate [--id <data pool id>] <root path> <path template>
+//                        <data file> [dimension in file] [field ...]
+//
+// The consolidated file is named after the data pool id, so pass the id of
+// the data pool that will read it. The parameter space is read from
+// parameter_space.nc in the root path. The path template describes the run
+// directories, for example "run_%%dirDim%%". If no fields are given, all
+// numeric fields in the data files are consolidated.
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> args(argv + 1, argv + argc);
+  std::string id;
+  if (args.size() > 1 && args[0] == "--id") {
+    id = args[1];
+    args.erase(args.begin(), args.begin() + 2);
+  }
+  if (args.size() < 3) {
+    std::cout << "Usage: " << argv[0]
+              << " [--id <data pool id>] <root path> <path template> "
+                 "<data file> [dimension in file] [field ...]"
+              << std::endl;
+    return -1;
+  }
+
+  tinc::ParameterSpace ps;
+  ps.setRootPath(args[0]);
+  if (!ps.readFromNetCDF()) {
+    std::cerr << "ERROR reading parameter space from " << args[0]
+              << std::endl;
+    return -1;
+  }
+  ps.setCurrentPathTemplate(args[1]);
+
+  tinc::DataPool dp(id, ps);
+  dp.registerDataFile(args[2], args.size() > 3 ? args[3] : "");
+
+  std::vector<std::string> fields;
+  for (size_t i = 4; i < args.size(); i++) {
+    fields.push_back(args[i]);
+  }
+
+  std::cout << "Consolidating " << ps.runningPaths().size()
+            << " run directories" << std::endl;
+  if (!dp.consolidate(fields)) {
+    std::cerr << "ERROR consolidating data files" << std::endl;
+    return -1;
+  }
+  std::cout << "Wrote " << dp.getConsolidatedPath() << std::endl;
+  return 0;
+}
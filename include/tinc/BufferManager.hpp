@@ -33,76 +33,260 @@
  * authors: Andres Cabrera
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <vector>
 
 namespace tinc {
 
+enum BufferMode {
+  // Buffer access is protected by a mutex. Any number of readers and writers.
+  BUFFER_LOCKED = 0x00,
+  // Lock free triple buffer for one reader thread and one writer thread.
+  BUFFER_TRIPLE = 0x01
+};
+
+// What getWritable() does when readers hold all buffers
+enum BufferFullPolicy {
+  // Wait until a reader releases a buffer
+  BUFFER_FULL_WAIT = 0x00,
+  // Replace the least recently written buffer with a new one. Readers
+  // holding the old buffer keep it until they release it.
+  BUFFER_FULL_DROP_OLDEST = 0x01
+};
+
 /**
  * The BufferManager class
+ *
+ * In BUFFER_TRIPLE mode, three buffers are exchanged through an atomic index.
+ * get() is wait-free and getWritable() never blocks, so a render thread does
+ * not contend with a loader thread. Only one thread may read and only one
+ * thread may write. A buffer returned by get() is valid until the next call
+ * to get(), and a buffer returned by getWritable() until doneWriting().
+ *
+ * In BUFFER_LOCKED mode, writers that find all buffers in use wait until a
+ * reader releases one, or follow the policy set with setFullPolicy().
  */
 template <class DataType> class BufferManager {
 public:
   const int mSize;
 
-  BufferManager(uint16_t size = 2) : mSize(size) {
+  BufferManager(uint16_t size = 2, BufferMode mode = BUFFER_LOCKED)
+      : mSize(mode == BUFFER_TRIPLE ? 3 : size), mMode(mode) {
     assert(size > 1);
     for (uint16_t i = 0; i < mSize; i++) {
       mData.emplace_back(std::make_shared<DataType>());
     }
+    mWriteSequence.resize(mSize, 0);
   }
 
+  BufferMode getMode() { return mMode; }
+
   std::shared_ptr<DataType> get(bool markAsUsed = true) {
+    if (mMode == BUFFER_TRIPLE) {
+      if (swapFrontBuffer() && !markAsUsed) {
+        mNewData = true;
+      } else if (markAsUsed) {
+        mNewData = false;
+      }
+      return mData[mReadBuffer];
+    }
     std::unique_lock<std::mutex> lk(mDataLock);
     if (markAsUsed) {
       mNewData = false;
     }
-    return mData[mReadBuffer];
+    return readerHandle(mReadBuffer);
   }
 
-  std::shared_ptr<DataType> getWritable() {
-    std::unique_lock<std::mutex> lk(mDataLock);
-    // TODO add timeout?
-    while (mData[mWriteBuffer].use_count() > 1) {
-      mWriteBuffer++;
-      if (mWriteBuffer == mReadBuffer) {
-        mWriteBuffer++;
-      }
-      if (mWriteBuffer >= mSize) {
-        mWriteBuffer = 0;
-      }
-    }
-    return mData[mWriteBuffer];
+  /**
+   * @brief Get a buffer to write to
+   *
+   * Waits until a buffer is free, unless the BUFFER_FULL_DROP_OLDEST policy is
+   * set. Call doneWriting() when done.
+   */
+  std::shared_ptr<DataType> getWritable() { return acquireWritable(-1.0f); }
+
+  /**
+   * @brief Get a buffer to write to, waiting at most timeoutSec seconds
+   * @return nullptr if no buffer was released before the timeout
+   */
+  std::shared_ptr<DataType> getWritable(float timeoutSec) {
+    return acquireWritable(std::max(timeoutSec, 0.0f));
   }
 
+  /**
+   * @brief Get a buffer to write to without waiting
+   * @return nullptr if readers hold all buffers
+   */
+  std::shared_ptr<DataType> tryGetWritable() { return acquireWritable(0.0f); }
+
+  void setFullPolicy(BufferFullPolicy policy) { mFullPolicy = policy; }
+
   void doneWriting(std::shared_ptr<DataType> buffer) {
+    if (mMode == BUFFER_TRIPLE) {
+      assert(buffer == mData[mWriteBuffer]);
+      // Publish back buffer and take the buffer the reader is not using
+      mWriteBuffer = mMiddleBuffer.exchange(mWriteBuffer | TRIPLE_NEW_DATA,
+                                            std::memory_order_acq_rel) &
+                     TRIPLE_INDEX_MASK;
+      return;
+    }
     std::unique_lock<std::mutex> lk(mDataLock);
-    mReadBuffer = std::distance(mData.begin(),
-                                std::find(mData.begin(), mData.end(), buffer));
+    auto index = std::distance(mData.begin(),
+                               std::find(mData.begin(), mData.end(), buffer));
+    if (index == mSize) {
+      // Buffer was dropped while being written
+      return;
+    }
+    mReadBuffer = index;
+    mWriteSequence[mReadBuffer] = ++mWriteCount;
     mNewData = true;
   }
 
   std::shared_ptr<DataType> get(bool *isNew) {
+    if (mMode == BUFFER_TRIPLE) {
+      if (swapFrontBuffer() || mNewData) {
+        *isNew = true;
+        mNewData = false;
+      }
+      return mData[mReadBuffer];
+    }
     std::unique_lock<std::mutex> lk(mDataLock);
     if (mNewData) {
       *isNew = true;
       mNewData = false;
     }
-    return mData[mReadBuffer];
+    return readerHandle(mReadBuffer);
   }
 
-  bool newDataAvailable() { return mNewData; }
+  bool newDataAvailable() {
+    if (mMode == BUFFER_TRIPLE) {
+      return mNewData || (mMiddleBuffer.load(std::memory_order_acquire) &
+                          TRIPLE_NEW_DATA) != 0;
+    }
+    return mNewData;
+  }
 
 protected:
   std::vector<std::shared_ptr<DataType>> mData;
 
   std::mutex mDataLock;
-  bool mNewData{false};
+  std::atomic<bool> mNewData{false};
   uint16_t mReadBuffer{0};
   uint16_t mWriteBuffer{1};
 
 private:
+  // Shared with the buffers handed to readers, so they can signal release
+  // even after the BufferManager is gone
+  struct ReleaseSignal {
+    std::mutex lock;
+    std::condition_variable signal;
+    uint64_t releases{0};
+  };
+  std::shared_ptr<ReleaseSignal> mReleaseSignal{
+      std::make_shared<ReleaseSignal>()};
+  std::atomic<BufferFullPolicy> mFullPolicy{BUFFER_FULL_WAIT};
+  // Value of mWriteCount when each buffer was last written
+  std::vector<uint64_t> mWriteSequence;
+  uint64_t mWriteCount{0};
+
+  // Buffer for readers that notifies writers when its last copy is released
+  std::shared_ptr<DataType> readerHandle(uint16_t index) {
+    auto releaseSignal = mReleaseSignal;
+    auto buffer = mData[index];
+    return std::shared_ptr<DataType>(
+        buffer.get(), [releaseSignal, buffer](DataType *) mutable {
+          buffer.reset();
+          {
+            std::unique_lock<std::mutex> lk(releaseSignal->lock);
+            releaseSignal->releases++;
+          }
+          releaseSignal->signal.notify_all();
+        });
+  }
+
+  // Find a buffer not held by readers, other than the read buffer, and make
+  // it the write buffer. mDataLock must be held.
+  bool findFreeBuffer() {
+    for (int i = 0; i < mSize; i++) {
+      uint16_t index = (mWriteBuffer + i) % mSize;
+      if (index != mReadBuffer && mData[index].use_count() == 1) {
+        mWriteBuffer = index;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Negative timeout waits forever
+  std::shared_ptr<DataType> acquireWritable(float timeoutSec) {
+    if (mMode == BUFFER_TRIPLE) {
+      // The back buffer belongs to the writer until doneWriting()
+      return mData[mWriteBuffer];
+    }
+    auto deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<float>(std::max(timeoutSec, 0.0f)));
+    while (true) {
+      uint64_t releases;
+      {
+        std::unique_lock<std::mutex> lk(mReleaseSignal->lock);
+        releases = mReleaseSignal->releases;
+      }
+      {
+        std::unique_lock<std::mutex> lk(mDataLock);
+        if (findFreeBuffer()) {
+          return mData[mWriteBuffer];
+        }
+        if (mFullPolicy == BUFFER_FULL_DROP_OLDEST) {
+          uint16_t oldest = mReadBuffer == 0 ? 1 : 0;
+          for (uint16_t i = 0; i < mSize; i++) {
+            if (i != mReadBuffer &&
+                mWriteSequence[i] < mWriteSequence[oldest]) {
+              oldest = i;
+            }
+          }
+          mData[oldest] = std::make_shared<DataType>();
+          mWriteBuffer = oldest;
+          return mData[mWriteBuffer];
+        }
+      }
+      // A buffer released after releases was read wakes the wait
+      std::unique_lock<std::mutex> lk(mReleaseSignal->lock);
+      auto released = [&]() { return mReleaseSignal->releases != releases; };
+      if (timeoutSec < 0) {
+        mReleaseSignal->signal.wait(lk, released);
+      } else if (!mReleaseSignal->signal.wait_until(lk, deadline, released)) {
+        return nullptr;
+      }
+    }
+  }
+
+  static const uint16_t TRIPLE_INDEX_MASK = 0x03;
+  static const uint16_t TRIPLE_NEW_DATA = 0x04;
+
+  const BufferMode mMode;
+  // Buffer between reader and writer in BUFFER_TRIPLE mode, with
+  // TRIPLE_NEW_DATA set if the writer published it after the last swap
+  std::atomic<uint16_t> mMiddleBuffer{2};
+
+  // Take the middle buffer if it has new data. Returns true if swapped.
+  bool swapFrontBuffer() {
+    if ((mMiddleBuffer.load(std::memory_order_acquire) & TRIPLE_NEW_DATA) ==
+        0) {
+      return false;
+    }
+    mReadBuffer =
+        mMiddleBuffer.exchange(mReadBuffer, std::memory_order_acq_rel) &
+        TRIPLE_INDEX_MASK;
+    return true;
+  }
 };
 
 } // namespace tinc
@@ -7,11 +7,26 @@
 #include "tinc/DistributedPath.hpp"
 #include "tinc/VariantValue.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 #include <mutex>
 #include <cinttypes>
 
+// Largest read of a stored file served to remote nodes
+#define TINC_CACHE_MAX_READ_SIZE (1 << 18)
+
 namespace tinc {
 
 struct UserInfo {
@@ -27,6 +42,15 @@ struct SourceArgument {
   VariantValue value;
 };
 
+struct FileDependency {
+  DistributedPath file;
+  std::string modified; // Modification time of the file when hashed
+  uint64_t size{0};
+  std::string hash; // SHA-256 of file contents
+  uint64_t inode{0};
+  int64_t modifiedNs{0}; // Nanosecond modification time when hashed
+};
+
 struct SourceInfo {
   std::string type;
   std::string
@@ -36,23 +60,72 @@ struct SourceInfo {
   std::string hash;
   std::vector<SourceArgument> arguments;
   std::vector<SourceArgument> dependencies;
-  std::vector<DistributedPath> fileDependencies;
+  std::vector<FileDependency> fileDependencies;
 };
 
 struct CacheEntry {
   std::string timestampStart;
   std::string timestampEnd;
+  std::string timestampLastAccess;
   std::vector<std::string> filenames;
   UserInfo userInfo;
   SourceInfo sourceInfo;
   uint64_t cacheHits{0};
+  uint64_t size{0}; // Total size in bytes of the files in the cache directory
   bool stale{false};
+  std::string codec{"none"}; // Codec used to store the files in the cache
+  int compressionLevel{0};
+};
+
+/**
+ * @brief Counters accumulated by a CacheManager since creation or the last
+ * call to resetStatistics()
+ */
+struct CacheStatistics {
+  uint64_t lookups{0};
+  uint64_t hits{0};       // Includes remote hits
+  uint64_t remoteHits{0}; // Entries fetched from a remote cache
+  uint64_t misses{0};
+  uint64_t staleHits{0}; // Entries matched but found stale and skipped
+  uint64_t bytesRestored{0};
+  uint64_t bytesStored{0};     // Bytes written to the cache directory
+  double lookupTimeTotal{0.0}; // Seconds spent in findCache()
+  double lookupTimeMax{0.0};
+  double computeTimeSaved{0.0}; // Seconds, from hit entries' timestamps
+  // Current state of the cache, not affected by resetStatistics()
+  uint64_t entries{0};
+  uint64_t cacheSize{0}; // Bytes
 };
 
 class CacheManager {
 public:
+  /**
+   * @brief Determines which entry is removed first when the cache is over
+   * budget
+   *
+   * EVICTION_LRU removes the least recently accessed entry. EVICTION_LFU
+   * removes the entry with the least cache hits. EVICTION_COST removes the
+   * entry that is cheapest to recompute relative to the disk space it takes.
+   * Stale entries are always removed first.
+   */
+  typedef enum {
+    EVICTION_LRU = 0x00,
+    EVICTION_LFU = 0x01,
+    EVICTION_COST = 0x02
+  } EvictionPolicy;
+
+  /**
+   * @brief Codec used to store files in the cache directory
+   *
+   * CODEC_ZLIB stores files gzip compressed with a ".gz" suffix. Compression
+   * is only available when TINC is built with zlib.
+   */
+  typedef enum { CODEC_NONE = 0x00, CODEC_ZLIB = 0x01 } Codec;
+
   CacheManager(DistributedPath cachePath = DistributedPath("tinc_cache.json"));
 
+  ~CacheManager();
+
   /**
    * @brief append cache entry
    * @param the CacheEntry entry
@@ -63,17 +136,291 @@ public:
    * @brief Get all in memory entries
    * @return vector of CacheEntry objects
    */
-  std::vector<CacheEntry> entries() { return mEntries; };
+  std::vector<CacheEntry> entries() {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    return mEntries;
+  };
 
+  /**
+   * @brief Get number of in memory entries
+   */
+  size_t entryCount() {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    return mEntries.size();
+  }
+
+  /**
+   * @brief Find cached files for sourceInfo
+   * @param sourceInfo source information to match
+   * @param verifyHash verify source hash and file dependencies
+   * @return list of file names relative to cacheDirectory(). Empty if not
+   * found
+   *
+   * A successful lookup increments the hit count and updates the last access
+   * time for the entry. When verifyHash is true, entries whose source hash
+   * differs from sourceInfo.hash or whose file dependencies have changed on
+   * disk are marked stale and skipped. Stale entries are never returned.
+   */
   std::vector<std::string> findCache(const SourceInfo &sourceInfo,
                                      bool verifyHash = true);
+
+  /**
+   * @brief Find local cache entry for sourceInfo
+   * @param sourceInfo source information to match
+   * @param entry entry found
+   * @param verifyHash verify source hash and file dependencies
+   * @return true if found
+   *
+   * Unlike findCache(), the remote cache is not queried.
+   */
+  bool findEntry(const SourceInfo &sourceInfo, CacheEntry &entry,
+                 bool verifyHash = true);
+
+  /**
+   * @brief Set function to query a remote cache when lookups miss locally
+   * @param fetch function that returns cache file names for sourceInfo, after
+   * importing them with importEntry(), or an empty list if not found remotely.
+   *
+   * Pass an empty function to disable remote lookups. See
+   * TincClient::enableRemoteCache()
+   */
+  void setRemoteCache(
+      std::function<std::vector<std::string>(const SourceInfo &)> fetch);
+
+  /**
+   * @brief Read raw bytes of a file as stored in the cache directory
+   * @param cacheFilename file name relative to cacheDirectory()
+   * @param offset byte offset to start reading
+   * @param maxBytes maximum number of bytes to read. At most
+   * TINC_CACHE_MAX_READ_SIZE
+   * @param data bytes read. Fewer than maxBytes are returned at the end of
+   * the file
+   * @return false if the file is not in the cache or can't be read, or
+   * maxBytes is too large
+   *
+   * Bytes are returned as stored, i.e. compressed if the entry's codec
+   * compresses. Used to serve the cache to remote nodes.
+   */
+  bool readStoredFile(const std::string &cacheFilename, uint64_t offset,
+                      uint64_t maxBytes, std::string &data);
+
+  /**
+   * @brief Add an entry whose files are written by a callback
+   * @param entry entry to add. Files are stored using the entry's codec.
+   * @param writeFile function that writes the stored bytes for the file at
+   * index in entry.filenames
+   * @return true if all files were written and the entry added
+   *
+   * Used to import entries from remote caches.
+   */
+  bool importEntry(CacheEntry &entry,
+                   std::function<bool(size_t index, std::ostream &out)>
+                       writeFile);
+
+  /**
+   * @brief Store files in the cache directory for a new entry
+   * @param sourcePaths full paths to the files to store
+   * @param entry entry whose filenames are the names to store sourcePaths to
+   * @return true if all files were stored
+   *
+   * Files are stored using the current codec and compression level, and the
+   * codec, compression level and size of the entry are set accordingly. If a
+   * file fails to be stored, files already stored for the entry are removed.
+   * The entry must then be added with appendEntry().
+   */
+  bool storeFiles(const std::vector<std::string> &sourcePaths,
+                  CacheEntry &entry);
+
+  /**
+   * @brief Restore a file from the cache, decompressing if needed
+   * @param cacheFilename file name relative to cacheDirectory() as returned
+   * by findCache()
+   * @param destinationPath full path to write the file to
+   * @return true if restored successfully
+   */
+  bool restoreFile(const std::string &cacheFilename,
+                   const std::string &destinationPath);
+
+  /**
+   * @brief Set maximum bytes kept in memory for recently restored or stored
+   * files
+   * @param maxBytes maximum size of the memory tier. 0 disables it (default)
+   *
+   * Files restored with restoreFile() or stored with storeFiles() are kept in
+   * memory, so restoring them again does not read the cache directory, and
+   * consumers can get their contents through getFileBytes() and
+   * getCacheFileBytes().
+   */
+  void setMemoryTierSize(uint64_t maxBytes);
+
+  /**
+   * @brief Get number of bytes currently held in the memory tier
+   */
+  uint64_t memoryTierUsage();
+
+  /**
+   * @brief Restore files held in the memory tier without writing them
+   * @param enable true to skip writing restored files held in memory
+   *
+   * When enabled, restoreFile() only records the destination path for files
+   * whose contents are in the memory tier, and the contents are only
+   * available through getFileBytes(). This avoids touching the filesystem
+   * when scrubbing through cached results, but the file on disk is not
+   * updated, so it must only be used when all consumers of the restored
+   * files read them through getFileBytes(), like DiskBuffers that have this
+   * cache manager set. Disabled by default.
+   */
+  void setRestoreToMemory(bool enable);
+
+  /**
+   * @brief Get contents of a restored or stored file from the memory tier
+   * @param path full path a file was restored to or stored from
+   * @return contents of the file or nullptr if not in memory
+   *
+   * Files written to disk are checked to be unchanged since they were
+   * restored or stored, so only file metadata is queried. Files restored
+   * with setRestoreToMemory() enabled are served without querying the disk.
+   */
+  std::shared_ptr<const std::vector<char>>
+  getFileBytes(const std::string &path);
+
+  /**
+   * @brief Get contents of a cache file from the memory tier
+   * @param cacheFilename file name relative to cacheDirectory() as returned
+   * by findCache()
+   * @return contents of the file or nullptr if not in memory
+   */
+  std::shared_ptr<const std::vector<char>>
+  getCacheFileBytes(const std::string &cacheFilename);
+
+  /**
+   * @brief Compute SHA-256 hash of file contents
+   * @param path full path to file
+   * @return hex string of the hash. Empty if file can't be read.
+   *
+   * Hashes are remembered together with the file's inode, size and
+   * modification time, so unchanged files are not read again.
+   */
+  std::string fileHash(const std::string &path);
+
+  /**
+   * @brief Fill modification time, size and hash for a file dependency
+   * @param dependency dependency whose file member has been set
+   * @return false if the file does not exist
+   */
+  bool updateFileDependency(FileDependency &dependency);
+
+  /**
+   * @brief Quantize values of an argument when matching cache entries
+   * @param argumentId id of the argument, usually the parameter space
+   * dimension name
+   * @param step quantization step. 0 removes quantization.
+   *
+   * Floating point arguments are matched by their nearest multiple of step,
+   * so values that differ by rounding after going through float parameters,
+   * JSON or the network map to the same entry. Without quantization, float
+   * arguments are compared at float precision and double arguments exactly.
+   */
+  void setArgumentQuantization(const std::string &argumentId, double step);
+
+  /**
+   * @brief Get cache usage counters
+   *
+   * Compute time saved is estimated from the start and end timestamps of the
+   * entries returned by findCache(), so it has a resolution of one second.
+   */
+  CacheStatistics statistics();
+
+  void resetStatistics();
+
   /**
    * @brief Clear all cached files, and cache information.
    */
-  void clearCache() {
-    throw "Mot implemented yet.";
-    // TODO implement clear cache
-  }
+  void clearCache();
+
+  /**
+   * @brief Set maximum size in bytes for the files in the cache
+   * @param maxBytes maximum number of bytes. 0 means no limit.
+   *
+   * When the cache goes above this size, entries are evicted in the
+   * background according to the eviction policy.
+   */
+  void setMaxSize(uint64_t maxBytes);
+
+  /**
+   * @brief Get maximum size in bytes for the cache. 0 means no limit.
+   */
+  uint64_t maxSize() { return mMaxSize; }
+
+  /**
+   * @brief Set maximum number of entries in the cache
+   * @param maxEntries maximum number of entries. 0 means no limit.
+   */
+  void setMaxEntries(size_t maxEntries);
+
+  /**
+   * @brief Get maximum number of entries in the cache. 0 means no limit.
+   */
+  size_t maxEntries() { return mMaxEntries; }
+
+  /**
+   * @brief Set the policy used to choose entries to evict
+   */
+  void setEvictionPolicy(EvictionPolicy policy);
+
+  EvictionPolicy evictionPolicy() { return mEvictionPolicy; }
+
+  /**
+   * @brief Set codec and compression levels for new cache files
+   * @param codec codec for files stored after this call
+   * @param level compression level for new entries. Fast levels are preferred
+   * as files are compressed while the computation waits.
+   * @param coldLevel compression level for entries not accessed in coldAge()
+   * @return false if codec is not available in this build
+   *
+   * Cold entries are recompressed in the background, so existing uncompressed
+   * entries are also compressed once they become cold.
+   */
+  bool setCompression(Codec codec, int level = 1, int coldLevel = 9);
+
+  Codec compressionCodec() { return mCodec; }
+
+  /**
+   * @brief Set time without access after which entries are recompressed at
+   * the cold compression level.
+   */
+  void setColdAge(std::chrono::seconds age);
+
+  std::chrono::seconds coldAge() { return mColdAge; }
+
+  /**
+   * @brief Reconcile files in the cache directory with entries in the
+   * background
+   * @param interval time between collection passes. 0 disables (default)
+   * @param minAge files modified more recently than this are never removed
+   *
+   * Files not referenced by any entry, like partial files left by failed or
+   * interrupted writes, are removed. Entries whose files are missing are
+   * marked stale. Passes are done in small batches between other maintenance
+   * and resume where they left off. Only enable if the cache directory is
+   * used exclusively for the cache.
+   */
+  void setGarbageCollection(
+      std::chrono::seconds interval,
+      std::chrono::seconds minAge = std::chrono::seconds(600));
+
+  /**
+   * @brief Complete a garbage collection pass now
+   * @return number of files removed plus number of entries marked stale
+   *
+   * If a background pass is in progress, it is continued.
+   */
+  size_t collectGarbage();
+
+  /**
+   * @brief Get current size in bytes of all files in the cache
+   */
+  uint64_t cacheSize();
 
   /**
    * @brief Get full cache path
@@ -91,7 +438,11 @@ public:
   /**
    * @brief Write the current in memory cache to disk
    *
-   * This will overwrite the cache metadata file on disk
+   * Several processes can share a cache directory. Writes take an advisory
+   * lock on the metadata file and merge entries written by other processes,
+   * so no entries are lost. Changes since the last write are appended to a
+   * journal next to the metadata file, which is merged into the metadata
+   * file once it holds as many records as there are entries.
    */
   void writeToDisk();
 
@@ -101,12 +452,218 @@ public:
    */
   std::string dump();
 
+  /**
+   * @brief Serialize entry in the format used in cache metadata
+   */
+  nlohmann::json entryToJson(const CacheEntry &entry);
+
+  CacheEntry entryFromJson(const nlohmann::json &entry);
+
+  /**
+   * @brief Serialize source information in the format used in cache metadata
+   *
+   * This is the canonical key format used when querying caches remotely.
+   */
+  static nlohmann::json sourceInfoToJson(const SourceInfo &sourceInfo);
+
+  static SourceInfo sourceInfoFromJson(const nlohmann::json &json);
+
+  /**
+   * @brief Print diagnostics, like entries found stale, to std::cerr
+   */
+  void setVerbose(bool v) { mVerbose = v; }
+
 protected:
   DistributedPath mCachePath;
   std::mutex mCacheLock;
 
   // In memory cache
   std::vector<CacheEntry> mEntries;
+  uint64_t mCurrentSize{0};
+  bool mMetadataDirty{false};
+  // Entries added or changed since the last write, by entryFilesKey()
+  std::unordered_set<std::string> mChangedEntries;
+  // Entries removed since the last write, identified by file names and end
+  // timestamp, so they are not merged back from disk.
+  std::vector<std::pair<std::vector<std::string>, std::string>>
+      mRemovedEntries;
+  // End timestamp by entryFilesKey() of entries in the metadata file and
+  // journal when last read or written
+  std::unordered_map<std::string, std::string> mSyncedEntries;
+  // Modification time of metadata file when last read or written
+  int64_t mMetadataModifiedNs{0};
+  // Bytes and records of the journal read or written since the metadata file
+  // was last replaced
+  uint64_t mJournalOffset{0};
+  size_t mJournalRecords{0};
+
+  std::function<std::vector<std::string>(const SourceInfo &)> mRemoteCache;
+
+  CacheStatistics mStatistics;
+  std::mutex mStatisticsLock;
+
+  // Index from entryKey() to positions in mEntries. Rebuilt on lookup after
+  // entries are removed, replaced or reordered.
+  std::unordered_map<std::string, std::vector<size_t>> mEntryIndex;
+  bool mEntryIndexValid{false};
+  std::map<std::string, double> mArgumentQuantization;
+
+  // Canonical key for source and arguments. Empty if arguments can't be
+  // matched. Call with mCacheLock held.
+  std::string entryKey(const SourceInfo &sourceInfo);
+  // Positions of entries matching key. Call with mCacheLock held.
+  const std::vector<size_t> &entryIndexLookup(const std::string &key);
+
+  // Budget
+  uint64_t mMaxSize{0};
+  size_t mMaxEntries{0};
+  EvictionPolicy mEvictionPolicy{EVICTION_LRU};
+
+  // Compression
+  Codec mCodec{CODEC_NONE};
+  int mCompressionLevel{1};
+  int mColdCompressionLevel{9};
+  std::chrono::seconds mColdAge{24 * 60 * 60};
+
+  // Hashes for fileHash() keyed by path
+  struct FileHashInfo {
+    uint64_t inode{0};
+    uint64_t size{0};
+    int64_t modifiedNs{0};
+    std::string hash;
+  };
+  std::map<std::string, FileHashInfo> mHashCache;
+  std::mutex mHashLock;
+
+  // Memory tier. Most recently used files are at the front of the list.
+  struct MemoryTierItem {
+    std::string cacheFilename;
+    std::shared_ptr<const std::vector<char>> bytes;
+  };
+  struct MemoryTierPath {
+    std::string cacheFilename;
+    uint64_t size;
+    int64_t modifiedNs;
+    // Set for paths restored to memory only. These keep their contents
+    // alive, as the file on disk does not hold them.
+    std::shared_ptr<const std::vector<char>> bytes;
+  };
+  std::list<MemoryTierItem> mMemoryTier;
+  std::map<std::string, std::list<MemoryTierItem>::iterator> mMemoryTierIndex;
+  std::map<std::string, MemoryTierPath> mMemoryTierPaths;
+  uint64_t mMemoryTierSize{0};
+  uint64_t mMemoryTierMaxSize{0};
+  bool mRestoreToMemory{false};
+  std::mutex mMemoryTierLock;
+
+  std::shared_ptr<const std::vector<char>>
+  memoryTierFind(const std::string &cacheFilename);
+  // Read file at path into memory tier as contents of cacheFilename
+  void memoryTierInsert(const std::string &cacheFilename,
+                        const std::string &path);
+  void memoryTierAddPath(const std::string &path,
+                         const std::string &cacheFilename);
+  bool memoryTierPathValid(const std::string &path,
+                           const std::string &cacheFilename);
+  // Must be called with mMemoryTierLock held
+  void memoryTierRemove(const std::string &cacheFilename);
+  // Must be called with mMemoryTierLock held
+  void memoryTierTrim();
+
+  // Background maintenance. Eviction is done a few entries at a time so that
+  // lookups are not blocked for long.
+  std::unique_ptr<std::thread> mMaintenanceThread;
+  std::mutex mMaintenanceLock;
+  std::condition_variable mMaintenanceSignal;
+  std::atomic<bool> mMaintenanceRunning{false};
+  bool mMaintenanceRequested{false};
+  std::chrono::milliseconds mMaintenanceInterval{1000};
+  size_t mEvictionBatchSize{8};
+
+  void startMaintenance();
+  void stopMaintenance();
+  void notifyMaintenance();
+
+  // Evict up to mEvictionBatchSize entries. Returns true if the cache is still
+  // over budget.
+  bool evictionStep();
+
+  // Check that source hash and file dependencies recorded in entry still
+  // match. Reads files, so must not be called with mCacheLock held
+  bool dependenciesValid(const SourceInfo &entrySource,
+                         const SourceInfo &sourceInfo);
+
+  // Recompress one cold entry. Returns true if an entry was recompressed.
+  bool recompressionStep();
+
+  // Garbage collection state. A pass lists the cache directory and the
+  // entries, then checks mGarbageBatchSize files or entries per step.
+  std::mutex mGarbageLock;
+  std::chrono::seconds mGarbageInterval{0};
+  std::chrono::seconds mGarbageMinAge{600};
+  std::chrono::steady_clock::time_point mGarbageLastPass;
+  bool mGarbagePassActive{false};
+  std::vector<std::string> mGarbageFiles;
+  std::set<std::string> mGarbageReferenced;
+  // Entries are identified by their files and end timestamp, as mEntries
+  // can change between steps.
+  struct GarbageEntry {
+    std::vector<std::string> filenames;
+    std::string timestampEnd;
+    std::string codec;
+  };
+  std::vector<GarbageEntry> mGarbageEntries;
+  size_t mGarbageFileCursor{0};
+  size_t mGarbageEntryCursor{0};
+  size_t mGarbageBatchSize{64};
+
+  // Process one batch of the current pass, starting a pass if none is
+  // active. Returns false when the pass is complete. Adds number of files
+  // removed and entries marked stale to collected.
+  bool garbageCollectionStep(size_t &collected);
+  bool garbageCollectionDue();
+
+  // Must be called with mCacheLock held
+  bool overBudget();
+  // Must be called with mCacheLock held
+  size_t selectEvictionCandidate();
+  // Must be called with mCacheLock held
+  void writeEntriesToDisk();
+  // Replace metadata file with all entries and empty the journal. Must be
+  // called with mCacheLock and the metadata file lock held
+  void writeMetadataFile();
+  // Append changes since the last write to the journal. Must be called with
+  // mCacheLock and the metadata file lock held
+  void appendJournal();
+  // Merge changes written by other processes since the last read or write.
+  // Returns false if there is no metadata file. Must be called with
+  // mCacheLock held
+  bool syncFromDisk();
+  // Must be called with mCacheLock held
+  void mergeEntries(const std::vector<CacheEntry> &diskEntries);
+  // Merge entries from journal records. Must be called with mCacheLock held
+  void mergeJournalRecords(const std::vector<nlohmann::json> &records);
+  // Merge diskEntry into the entry with the same files, or add it. positions
+  // maps entryFilesKey() to positions in mEntries.
+  void mergeEntry(const CacheEntry &diskEntry,
+                  std::unordered_map<std::string, size_t> &positions);
+  // Record that entry must be written. Must be called with mCacheLock held
+  void markChanged(const CacheEntry &entry);
+  // Read metadata file and apply the journal. journalOffset and
+  // journalRecords are set to the journal bytes and records read.
+  bool readEntriesFromDisk(std::vector<CacheEntry> &entries,
+                           uint64_t &journalOffset, size_t &journalRecords);
+  nlohmann::json metadataJson();
+  std::string journalPath();
+  bool parseEntries(nlohmann::json &j, std::vector<CacheEntry> &entries);
+  int64_t metadataModifiedNs();
+  // Computes size of cached files for entry by querying the filesystem
+  uint64_t computeEntrySize(const CacheEntry &entry);
+  // Full path to the file on disk for a file name in entry, including
+  // codec suffix
+  std::string cacheFilePath(const std::string &filename,
+                            const std::string &codec);
+  void removeEntryFiles(const CacheEntry &entry);
 
   // Function to add validators for special types like date-time
   static void tincSchemaFormatChecker(const std::string &format,
@@ -114,6 +671,9 @@ protected:
 
   nlohmann::json_schema::json_validator mValidator{nullptr,
                                                    tincSchemaFormatChecker};
+
+  // Read from lookup and maintenance threads
+  std::atomic<bool> mVerbose{false};
 };
 }
 
@@ -0,0 +1,228 @@
+#ifndef DATAFILEREADER_HPP
+#define DATAFILEREADER_HPP
+
+/*
+ * Copyright 2021 AlloSphere Research Group
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ *        THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * authors: Andres Cabrera
+*/
+
+#include <cinttypes>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace tinc {
+
+/**
+ * @brief Values of a field read from a data file
+ *
+ * Values are accessed as floats regardless of how they are stored.
+ */
+class DataField {
+public:
+  virtual ~DataField() {}
+
+  /**
+   * @brief Number of values in the field
+   */
+  virtual size_t size() const = 0;
+
+  /**
+   * @brief Get value at index. index must be less than size()
+   */
+  virtual float at(size_t index) const = 0;
+
+  /**
+   * @brief Copy count values starting at start to data
+   * @return false if the range is outside the field
+   */
+  virtual bool read(float *data, size_t start, size_t count) const;
+};
+
+/**
+ * @brief Field whose values are held in memory
+ */
+class DataFieldVector : public DataField {
+public:
+  DataFieldVector() {}
+  DataFieldVector(std::vector<float> values) : mValues(std::move(values)) {}
+
+  size_t size() const override { return mValues.size(); }
+  float at(size_t index) const override { return mValues[index]; }
+  bool read(float *data, size_t start, size_t count) const override;
+
+  std::vector<float> &values() { return mValues; }
+
+private:
+  std::vector<float> mValues;
+};
+
+typedef std::map<std::string, std::shared_ptr<const DataField>> DataFieldMap;
+
+/**
+ * @brief Base class for readers of data files used by DataPool
+ *
+ * Readers are registered with DataPool::registerFileReader() for file
+ * extensions or for the first bytes of the file.
+ */
+class DataFileReader {
+public:
+  virtual ~DataFileReader() {}
+
+  /**
+   * @brief Read field from file at path
+   * @param path path to the file
+   * @param field name of the field requested
+   * @param fields add the field read here. Other fields can be added too.
+   * @return false if the file can't be read
+   *
+   * This function may be called concurrently for different files.
+   */
+  virtual bool readFields(const std::string &path, const std::string &field,
+                          DataFieldMap &fields) = 0;
+
+  /**
+   * @brief Return true if readFields() adds all the fields in the file
+   *
+   * When true, fields not found after reading the file once are not
+   * requested again until the file changes.
+   */
+  virtual bool readsAllFields() { return false; }
+};
+
+/**
+ * @brief Reads numeric values and arrays of numbers in a JSON object
+ */
+class JsonFileReader : public DataFileReader {
+public:
+  bool readFields(const std::string &path, const std::string &field,
+                  DataFieldMap &fields) override;
+  bool readsAllFields() override { return true; }
+};
+
+/**
+ * @brief Reads columns in a CSV file
+ *
+ * The first line must contain the column names. Columns with values that are
+ * not numbers are skipped.
+ */
+class CsvFileReader : public DataFileReader {
+public:
+  CsvFileReader(char delimiter = ',') : mDelimiter(delimiter) {}
+
+  bool readFields(const std::string &path, const std::string &field,
+                  DataFieldMap &fields) override;
+  bool readsAllFields() override { return true; }
+
+private:
+  char mDelimiter;
+};
+
+/**
+ * @brief Reads a variable from a NetCDF file
+ *
+ * Only the requested variable is read. Multidimensional variables are
+ * flattened.
+ */
+class NetCDFFileReader : public DataFileReader {
+public:
+  bool readFields(const std::string &path, const std::string &field,
+                  DataFieldMap &fields) override;
+
+  /**
+   * @brief Lock to hold while calling the NetCDF library
+   *
+   * The NetCDF library is not thread safe, and data pools use it from
+   * several threads.
+   */
+  static std::mutex &libraryLock();
+};
+
+/**
+ * @brief Reads raw binary arrays by memory mapping the file
+ *
+ * Values are read from the mapping as they are accessed instead of loading
+ * the file, so slices only touch the pages they need. By default any field
+ * name maps to the whole file after the header as an array of the default
+ * type. Use addField() to describe interleaved records.
+ */
+class BinaryFileReader : public DataFileReader {
+public:
+  typedef enum {
+    FLOAT32 = 0x00,
+    FLOAT64 = 0x01,
+    INT8 = 0x02,
+    UINT8 = 0x03,
+    INT16 = 0x04,
+    UINT16 = 0x05,
+    INT32 = 0x06,
+    UINT32 = 0x07,
+    INT64 = 0x08,
+    UINT64 = 0x09
+  } DataType;
+
+  BinaryFileReader(DataType type = FLOAT32, size_t headerSize = 0)
+      : mDefaultType(type), mHeaderSize(headerSize) {}
+
+  /**
+   * @brief Describe field in the file
+   * @param name name of the field
+   * @param type type of the values
+   * @param offset offset in bytes of the first value after the header
+   * @param stride bytes between consecutive values. 0 for packed values.
+   *
+   * Once fields are added, only those fields can be read.
+   */
+  void addField(std::string name, DataType type, size_t offset = 0,
+                size_t stride = 0);
+
+  bool readFields(const std::string &path, const std::string &field,
+                  DataFieldMap &fields) override;
+  bool readsAllFields() override { return mFields.size() > 0; }
+
+  static size_t typeSize(DataType type);
+
+private:
+  struct FieldLayout {
+    DataType type;
+    size_t offset;
+    size_t stride;
+  };
+
+  DataType mDefaultType;
+  size_t mHeaderSize;
+  std::map<std::string, FieldLayout> mFields;
+};
+
+} // namespace tinc
+
+#endif // DATAFILEREADER_HPP
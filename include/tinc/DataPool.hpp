@@ -33,7 +33,20 @@
  * authors: Andres Cabrera
 */
 
+#include "tinc/DataFileReader.hpp"
 #include "tinc/ParameterSpace.hpp"
+#include "tinc/ThreadPool.hpp"
+
+#include <cinttypes>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Default number of live slices kept in memory
+#define TINC_DATAPOOL_MAX_LIVE_SLICES 32
+// Default size in bytes of the data files whose fields are kept in memory
+#define TINC_DATAPOOL_MAX_PARSED_FILE_BYTES (256 * 1024 * 1024)
 
 namespace tinc {
 /**
@@ -44,9 +57,42 @@ namespace tinc {
  * data pool are found. This class is useful to manage data files that are the
  * result of parameter sweeps, generating the same type of file in different
  * directories, where each directory represents a sample of the parameter space.
+ * The directory for each sample is given by the parameter space's
+ * generateRelativeRunPath, so replace that function when the path template is
+ * not adequate.
  */
 class DataPool : public IdObject {
 public:
+  /**
+   * @brief Slice values in memory together with their shape
+   *
+   * values are laid out with the last dimension varying fastest.
+   */
+  struct SliceData {
+    std::vector<std::string> dimensions;
+    std::vector<size_t> shape;
+    std::vector<float> values;
+  };
+
+  /**
+   * @brief Summary statistics of the values in a slice
+   *
+   * NaN values, i.e. values not found in the data files, are counted in
+   * missing and excluded from the rest of the statistics. The histogram has
+   * equal width bins from histogramMin to histogramMax. Values outside the
+   * range are not counted.
+   */
+  struct SliceReduction {
+    uint64_t count{0};
+    uint64_t missing{0};
+    float min{0.0f};
+    float max{0.0f};
+    double mean{0.0};
+    float histogramMin{0.0f};
+    float histogramMax{0.0f};
+    std::vector<uint64_t> histogram;
+  };
+
   DataPool(std::string id, ParameterSpace &ps,
            std::string sliceCacheDir = std::string());
 
@@ -60,6 +106,11 @@ public:
    */
   void registerDataFile(std::string filename, std::string dimensionInFile) {
     mDataFilenames[filename] = dimensionInFile;
+    {
+      std::unique_lock<std::mutex> lk(mSliceIndexLock);
+      mSliceIndex.clear();
+    }
+    clearLiveSlices();
   }
 
   /**
@@ -68,6 +119,28 @@ public:
    */
   ParameterSpace &getParameterSpace() { return *mParameterSpace; }
 
+  /**
+   * @brief Read a different parameter space in the current thread
+   *
+   * While an instance of this class exists, functions of the data pool called
+   * from the thread that created it read dimensions, current values and paths
+   * from ps instead of the data pool's parameter space. Use it with
+   * ParameterSpace::snapshot() to serve a request from the values it was made
+   * with while the parameter space changes in other threads.
+   */
+  class ScopedParameterSpace {
+  public:
+    ScopedParameterSpace(DataPool &pool, ParameterSpace &ps);
+    ~ScopedParameterSpace();
+
+    ScopedParameterSpace(const ScopedParameterSpace &) = delete;
+    ScopedParameterSpace &operator=(const ScopedParameterSpace &) = delete;
+
+  private:
+    const DataPool *mPreviousPool;
+    ParameterSpace *mPreviousSpace;
+  };
+
   /**
    * @brief Extract a slice of data
    * @param field name of the field to extract
@@ -75,9 +148,15 @@ public:
    * @return filename of the extracted slice
    *
    * The slice will be created as a NetCDF4 file with a single variable called
-   * "data" that spans a dimension "values". The result will be a one
-   * dimensional slice containing the values of the "field" across all values
-   * for "sliceDimension" that must be registered in the parameter space.
+   * "data" that spans a dimension named after "sliceDimension". The result
+   * will be a one dimensional slice containing the values of the "field"
+   * across all values for "sliceDimension" that must be registered in the
+   * parameter space.
+   *
+   * The slice file records where its data came from in global attributes. If
+   * a slice file for the same field, slice dimensions and fixed indeces
+   * exists and its source files have not been modified, it is reused instead
+   * of reading the source files again.
    */
   std::string createDataSlice(std::string field, std::string sliceDimension);
 
@@ -88,12 +167,32 @@ public:
    * @return filename of the extracted slice
    *
    * The output is a multidimensional slice of the data for the "field" values.
-   * The number of dimensions of the result is the size of sliceDimensions
+   * The number of dimensions of the result is the size of sliceDimensions.
+   * The NetCDF4 file contains a variable "data" with a dimension for each
+   * slice dimension, in the order given, and a coordinate variable for each
+   * dimension with its values. Dimensions not in sliceDimensions are fixed at
+   * their current index. Values not found in the data files are NaN.
+   *
+   * Files are read in parallel using the data pool's thread pool.
    */
-  // FIXME implement multidimensional slicing
   std::string createDataSlice(std::string field,
                               std::vector<std::string> sliceDimensions);
 
+  /**
+   * @brief Extract slices of several fields in one pass over the data files
+   * @param fields names of the fields to extract
+   * @param sliceDimensions dimensions that can change across the slice
+   * @return filename of the extracted slice. Empty if values are missing
+   * for any field.
+   *
+   * Each data file is read and parsed once for all fields. The NetCDF4 file
+   * has one variable per field, named after it, laid out like the "data"
+   * variable written by createDataSlice(). Batched slices are always
+   * gathered from the data files and don't use live slices.
+   */
+  std::string createDataSlices(std::vector<std::string> fields,
+                               std::vector<std::string> sliceDimensions);
+
   /**
    * @brief get list of full path to current files in datapool
    * @return list of files
@@ -103,16 +202,147 @@ public:
   std::vector<std::string> getCurrentFiles();
 
   /**
-   * @brief readDataSlice
-   * @param field
-   * @param sliceDimension
-   * @param data
-   * @param maxLen
-   * @return number of elements written to data pointer
+   * @brief Read a slice of data into memory
+   * @param field name of the field to extract
+   * @param sliceDimension dimension that can change across the slice
+   * @param data buffer of floats to write the slice to
+   * @param maxLen number of floats data can hold
+   * @return number of elements written to data pointer. 0 if the slice does
+   * not fit in data.
+   *
+   * The slice is gathered directly from the data files, without writing and
+   * reading back a slice file.
    */
   size_t readDataSlice(std::string field, std::string sliceDimension,
                        void *data, size_t maxLen);
 
+  /**
+   * @brief Read a multidimensional slice of data into memory
+   * @param field name of the field to extract
+   * @param sliceDimensions dimensions that can change across the slice
+   * @param data buffer to write the slice to. Use sliceSize() to get the size
+   * needed.
+   * @param maxLen number of floats data can hold
+   * @return number of elements written to data pointer. 0 if the slice does
+   * not fit in data.
+   *
+   * Layout is the same as the "data" variable written by createDataSlice().
+   */
+  size_t readDataSlice(std::string field,
+                       std::vector<std::string> sliceDimensions, float *data,
+                       size_t maxLen);
+
+  /**
+   * @brief Read a multidimensional slice of data into a new buffer
+   * @param field name of the field to extract
+   * @param sliceDimensions dimensions that can change across the slice
+   * @param slice values and shape of the slice
+   * @return false if the slice can't be created. Missing values are NaN.
+   */
+  bool readDataSlice(std::string field,
+                     std::vector<std::string> sliceDimensions,
+                     SliceData &slice);
+
+  /**
+   * @brief Read slices of several fields in one pass over the data files
+   * @param fields names of the fields to extract
+   * @param sliceDimensions dimensions that can change across the slice
+   * @param slices one slice per field, in the order of fields
+   * @return false if the slices can't be created or values are missing.
+   * Missing values are NaN.
+   *
+   * With live slices, each field's slice is read with readDataSlice().
+   */
+  bool readDataSlices(std::vector<std::string> fields,
+                      std::vector<std::string> sliceDimensions,
+                      std::vector<SliceData> &slices);
+
+  /**
+   * @brief Compute statistics of a slice without keeping its values
+   * @param field name of the field to reduce
+   * @param sliceDimensions dimensions that can change across the slice
+   * @param reduction minimum, maximum, mean and histogram of the slice
+   * @param histogramBins number of histogram bins. 0 for no histogram.
+   * @param histogramMin lower bound of the histogram
+   * @param histogramMax upper bound of the histogram. If equal to
+   * histogramMin, the range of the values is used.
+   * @return false if the slice can't be created
+   *
+   * The slice is gathered in memory and reduced in parallel using the data
+   * pool's thread pool.
+   */
+  bool reduceDataSlice(std::string field,
+                       std::vector<std::string> sliceDimensions,
+                       SliceReduction &reduction, size_t histogramBins = 0,
+                       float histogramMin = 0.0f, float histogramMax = 0.0f);
+
+  /**
+   * @brief Get number of values in a slice across sliceDimensions
+   * @return 0 if a dimension is not in the parameter space
+   */
+  size_t sliceSize(const std::vector<std::string> &sliceDimensions);
+
+  /**
+   * @brief Also write slice file when reading slices to memory
+   *
+   * Off by default. When enabled, readDataSlice() writes the slice file that
+   * createDataSlice() would produce, unless it is current.
+   */
+  void setWriteSliceOnRead(bool write) { mWriteSliceOnRead = write; }
+
+  /**
+   * @brief Pack data files for all points in the parameter space in one file
+   * @param fields fields to store. If empty, all fields in the first data
+   * files found are stored. NetCDF data files need fields listed.
+   * @return false if the file could not be written
+   *
+   * The consolidated file is a NetCDF4 file at getConsolidatedPath() with a
+   * chunked variable for each field. Its dimensions are the parameter space
+   * dimensions that determine the run directories and the dimensions that
+   * index values within the data files. Values not found are NaN.
+   *
+   * Once the file exists and matches the registered data files and the
+   * parameter space, slices are read from it instead of the data files. The
+   * file records the modification time of the data files in each run
+   * directory, and slices spanning directories with newer data files are
+   * read from the data files. Run consolidate() again when data files
+   * change, so slices are read from the consolidated file again.
+   */
+  bool consolidate(std::vector<std::string> fields = {});
+
+  /**
+   * @brief Path to the consolidated file written by consolidate()
+   *
+   * The file is placed in the parameter space root path and named after the
+   * data pool id, or "datapool" if the data pool has no id.
+   */
+  std::string getConsolidatedPath();
+
+  /**
+   * @brief Keep slices in memory and update them incrementally
+   *
+   * Off by default. When enabled, slices are kept in memory after they are
+   * created or read. Requesting the same slice again only checks the
+   * modification time of the data files, and re-reads the run directories
+   * whose files changed or appeared. Only the values from those directories
+   * are rewritten in the slice file. This is useful to watch results fill in
+   * during a sweep.
+   *
+   * A slice is kept for each field, slice dimensions and fixed indeces
+   * requested, until clearLiveSlices() is called or it is the least recently
+   * used beyond the limit set with setMaxLiveSlices().
+   */
+  void setLiveSlices(bool live);
+
+  void clearLiveSlices();
+
+  /**
+   * @brief Set number of live slices kept in memory
+   * @param count maximum number of slices. Least recently used slices are
+   * dropped first.
+   */
+  void setMaxLiveSlices(size_t count);
+
   /**
    * @brief getCacheDirectory
    * @return cache directory
@@ -122,12 +352,48 @@ public:
   void setCacheDirectory(std::string cacheDirectory);
 
   /**
-   *  Replace this function when the parameter space runningPaths() function is
-   * not adequate.
+   * @brief Set thread pool used to read data files when slicing
+   *
+   * By default each data pool has its own pool with a thread per hardware
+   * thread.
    */
-  std::function<std::vector<std::string>()> getAllPaths = [&]() {
-    return mParameterSpace->runningPaths();
-  };
+  void setThreadPool(std::shared_ptr<ThreadPool> threadPool) {
+    mThreadPool = threadPool;
+  }
+
+  /**
+   * @brief Register reader for a type of data file
+   * @param type name of the file type
+   * @param reader reader for the files
+   * @param extensions file extensions, including the dot, read with reader
+   * @param magic bytes at the start of files read with reader
+   *
+   * Files are matched by extension first and then by their first bytes.
+   * Files that don't match are read as JSON. Registering a type again
+   * replaces its reader. Readers for "json" (.json), "csv" (.csv), "netcdf"
+   * (.nc) and "binary" (.bin, .raw, float32 values) are registered by
+   * default.
+   */
+  void registerFileReader(std::string type,
+                          std::shared_ptr<DataFileReader> reader,
+                          std::vector<std::string> extensions = {},
+                          std::vector<std::string> magic = {});
+
+  /**
+   * @brief Discard fields kept in memory from parsed data files
+   *
+   * Data files are parsed once and their fields kept in memory until the
+   * file is modified, so slicing reads each file at most once while it is
+   * unchanged. Binary files stay mapped while they are in this cache.
+   */
+  void clearParsedFileCache();
+
+  /**
+   * @brief Set size of the data files whose fields are kept in memory
+   * @param maxBytes maximum total size on disk of the files. Least recently
+   * used files are dropped first. Larger files are not kept.
+   */
+  void setMaxParsedFileBytes(uint64_t maxBytes);
 
 protected:
   bool getFieldFromFile(std::string field, std::string file,
@@ -135,12 +401,203 @@ protected:
   bool getFieldFromFile(std::string field, std::string file, void *data,
                         size_t length);
 
+  // Type of file as registered in registerFileReader(). "json" if no reader
+  // matches the extension or the start of the file.
   std::string getFileType(std::string file);
 
+  // Fields read from a data file
+  struct ParsedFile {
+    int64_t modified{0};
+    uint64_t size{0};
+    DataFieldMap fields;
+    // All fields in the file have been read
+    bool complete{false};
+    std::list<std::string>::iterator usage;
+  };
+
+  // Get values for field in file, reading the file only if the field is not
+  // in the parsed file cache or the file has been modified. nullptr if file
+  // or field can't be read.
+  std::shared_ptr<const DataField> getFieldColumn(const std::string &field,
+                                                  const std::string &file);
+  // Drop least recently used parsed files beyond mMaxParsedFileBytes. Call
+  // with mParsedFilesLock held
+  void trimParsedFiles();
+
+  void registerDefaultFileReaders();
+  // Reader for file according to its type. nullptr if none registered.
+  std::shared_ptr<DataFileReader> getFileReader(const std::string &file);
+
+  // Where the data in a slice file came from
+  struct SliceProvenance {
+    std::string field;
+    std::vector<std::string> sliceDimensions;
+    // Sizes of the slice dimensions
+    std::vector<size_t> shape;
+    // Current indeces for dimensions the slice data depends on
+    std::map<std::string, size_t> fixedIndeces;
+    // Modification time in nanoseconds of the source files probed. 0 for
+    // files that did not exist, so that they are detected when they appear.
+    std::map<std::string, int64_t> sourceModified;
+  };
+
+  // Slice file name for field and sliceDimensions at the current indeces.
+  // Fills provenance with field, slice dimensions, shape and fixed indeces.
+  std::string sliceFilename(const std::string &field,
+                            const std::vector<std::string> &sliceDimensions,
+                            SliceProvenance &provenance);
+  // Gather values for slice at provenance's fixed indeces, and add the source
+  // files read to provenance. values must hold sliceSize() floats. Returns
+  // false if values were missing. sliceDimensions must be valid.
+  bool gatherSlice(const std::string &field,
+                   const std::vector<std::string> &sliceDimensions,
+                   float *values, SliceProvenance &provenance);
+  // Gather values for several fields reading each data file once. values
+  // holds a buffer of sliceSize() floats per field.
+  bool gatherSlices(const std::vector<std::string> &fields,
+                    const std::vector<std::string> &sliceDimensions,
+                    const std::vector<float *> &values,
+                    SliceProvenance &provenance);
+  // Field name used in slice file names and provenance for several fields
+  std::string joinSliceFields(const std::vector<std::string> &fields);
+  bool writeSliceFile(const std::string &filename,
+                      const std::vector<std::string> &sliceDimensions,
+                      const std::vector<float> &values,
+                      const SliceProvenance &provenance);
+  // Write a variable for each name in variables with the values at the same
+  // position in values
+  bool writeSliceFile(const std::string &filename,
+                      const std::vector<std::string> &sliceDimensions,
+                      const std::vector<std::string> &variables,
+                      const std::vector<const float *> &values,
+                      const SliceProvenance &provenance);
+
+  // Set indeces for the slice dimensions of cell in a flattened slice
+  void sliceCellIndeces(size_t cell,
+                        const std::vector<std::string> &sliceDimensions,
+                        const std::vector<size_t> &shape,
+                        std::map<std::string, size_t> &indeces);
+  // Parameter space read by this thread. See ScopedParameterSpace
+  ParameterSpace &parameterSpace();
+  // Run directory for indeces in ps, including the root path
+  std::string cellDirectory(ParameterSpace &ps,
+                            const std::map<std::string, size_t> &indeces);
+  // Read value of field at indeces from the data files in directory. Fields
+  // read are kept in columns, and the modification times of the files
+  // probed in sourceModified. Returns false if not found.
+  bool readCellValue(
+      const std::string &field, const std::string &directory,
+      const std::map<std::string, size_t> &indeces,
+      std::map<std::string, std::shared_ptr<const DataField>> &columns,
+      std::map<std::string, int64_t> &sourceModified, float &value);
+
+  // Dimensions of the consolidated file: dimensions that affect run
+  // directories and dimensions in data files, in parameter space order
+  std::vector<std::string> consolidatedDimensions();
+
+  // Filesystem dimensions among dimensions, which select run directories
+  std::vector<std::string>
+  directoryDimensions(const std::vector<std::string> &dimensions);
+  // Newest modification time of the data files in directory. 0 if none exist
+  int64_t dataFilesModified(const std::string &directory);
+
+  struct ConsolidatedInfo {
+    int64_t modified{0};
+    std::vector<std::string> dimensions;
+    std::vector<size_t> shape;
+    std::string dataFiles;
+    // Newest data file modification time of each run directory when it was
+    // consolidated, indexed by directoryDimensions(dimensions)
+    std::vector<int64_t> sourceModified;
+  };
+  // Check that the consolidated file exists and matches the data files and
+  // parameter space
+  bool getConsolidatedInfo(ConsolidatedInfo &info);
+  // Gather slice from consolidated file. Returns false if the file can't be
+  // used or data files in the slice changed after they were consolidated.
+  // complete is false if values are missing.
+  bool gatherConsolidatedSlice(const std::string &field,
+                               const std::vector<std::string> &sliceDimensions,
+                               float *values, SliceProvenance &provenance,
+                               bool &complete);
+
+  // Slice kept in memory with the state of the files it was read from
+  struct LiveSlice {
+    std::mutex lock;
+    SliceProvenance provenance;
+    std::vector<float> values;
+    // Cells read from each run directory
+    std::map<std::string, std::vector<size_t>> directoryCells;
+    // Modification time of data files when they were last read. 0 if missing
+    std::map<std::string, int64_t> fileModified;
+    // Slice file holds values
+    bool fileWritten{false};
+  };
+
+  std::shared_ptr<LiveSlice> getLiveSlice(const std::string &filename);
+  // Update values in live slice from directories whose data files changed.
+  // The first update reads all the slice. live must be locked.
+  void updateLiveSlice(LiveSlice &live,
+                       const std::vector<std::string> &sliceDimensions,
+                       const SliceProvenance &provenance,
+                       std::vector<size_t> &changedCells);
+  // Rewrite changed cells and provenance in existing slice file
+  bool writeSliceCells(const std::string &filename,
+                       const std::vector<std::string> &sliceDimensions,
+                       const std::vector<float> &values,
+                       const std::vector<size_t> &cells,
+                       const SliceProvenance &provenance);
+
+  // Check if slice file was produced from provenance's field and indeces and
+  // its source files are unchanged. Uses the index first, then the
+  // attributes in the file.
+  bool sliceIsCurrent(const std::string &filename,
+                      const SliceProvenance &provenance);
+  bool readSliceProvenance(const std::string &path,
+                           SliceProvenance &provenance);
+  // Write provenance as global attributes to NetCDF file in define mode
+  bool writeSliceProvenance(int ncid, const SliceProvenance &provenance);
+
 private:
   ParameterSpace *mParameterSpace;
   std::string mSliceCacheDirectory;
   std::map<std::string, std::string> mDataFilenames;
+
+  // Provenance of slice files written, by slice file name
+  std::map<std::string, SliceProvenance> mSliceIndex;
+  std::mutex mSliceIndexLock;
+
+  std::map<std::string, ParsedFile> mParsedFiles;
+  // Parsed file paths, most recently used first
+  std::list<std::string> mParsedFileUsage;
+  uint64_t mParsedFileBytes{0};
+  uint64_t mMaxParsedFileBytes{TINC_DATAPOOL_MAX_PARSED_FILE_BYTES};
+  std::mutex mParsedFilesLock;
+
+  std::map<std::string, std::shared_ptr<DataFileReader>> mFileReaders;
+  // File type by extension
+  std::map<std::string, std::string> mFileExtensions;
+  // File type by bytes at the start of the file
+  std::vector<std::pair<std::string, std::string>> mFileMagic;
+  std::mutex mFileReadersLock;
+
+  ConsolidatedInfo mConsolidatedInfo;
+  std::mutex mConsolidatedInfoLock;
+
+  struct LiveSliceEntry {
+    std::shared_ptr<LiveSlice> slice;
+    std::list<std::string>::iterator usage;
+  };
+  // Live slices by slice file name
+  std::map<std::string, LiveSliceEntry> mLiveSlices;
+  // Slice file names, most recently used first
+  std::list<std::string> mLiveSliceUsage;
+  size_t mMaxLiveSlices{TINC_DATAPOOL_MAX_LIVE_SLICES};
+  std::mutex mLiveSlicesLock;
+  bool mUseLiveSlices{false};
+
+  std::shared_ptr<ThreadPool> mThreadPool;
+  bool mWriteSliceOnRead{false};
 };
 }
 
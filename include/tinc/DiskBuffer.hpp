@@ -34,6 +34,7 @@
 */
 
 #include <fstream>
+#include <map>
 #include <string>
 #include <cstring>
 #include <errno.h>
@@ -43,15 +44,35 @@
 #include "al/ui/al_ParameterServer.hpp"
 
 #include "tinc/BufferManager.hpp"
+#include "tinc/CacheManager.hpp"
 #include "tinc/DiskBufferAbstract.hpp"
 
 namespace tinc {
 
+/**
+ * @brief Read only stream buffer over memory owned elsewhere
+ */
+class MemoryStreamBuffer : public std::streambuf {
+public:
+  MemoryStreamBuffer(const char *data, size_t size) {
+    char *begin = const_cast<char *>(data);
+    setg(begin, begin, begin + size);
+  }
+};
+
 template <class DataType>
 class DiskBuffer : public BufferManager<DataType>, public DiskBufferAbstract {
 public:
   DiskBuffer(std::string id = "", std::string fileName = "",
-             std::string path = "", uint16_t size = 2);
+             std::string path = "", uint16_t size = 2,
+             BufferMode mode = BUFFER_LOCKED);
+
+  ~DiskBuffer() {
+    // Subclasses call shutdown() in their destructors. This covers
+    // subclasses that don't.
+    shutdown();
+  }
+
   /**
    * @brief updateData
    * @param filename
@@ -66,21 +87,57 @@ public:
     mUpdateCallbacks.push_back(cb);
   }
 
+  /**
+   * @brief Load files in the background so updating to them is instant
+   * @param filenames file names that are likely to be used next, for
+   * example for the next values of a parameter
+   *
+   * Files are loaded on the I/O thread pool into buffers outside the ones
+   * readers use. When updateData() is called for a prefetched file that has
+   * not changed since, the loaded data is swapped in without reading the
+   * file. Prefetched files not in filenames are released. Subclasses that
+   * override updateData() don't use prefetched data.
+   */
+  void prefetch(std::vector<std::string> filenames);
+
 protected:
-  virtual bool parseFile(std::ifstream &file,
+  virtual bool parseFile(std::istream &file,
                          std::shared_ptr<DataType> newData) = 0;
 
+  /**
+   * @brief Read file at path into newData
+   *
+   * Parses the file with parseFile(), from the cache manager's memory tier
+   * when available. Override to load files that can't be parsed from a
+   * stream.
+   */
+  virtual bool loadFile(const std::string &path,
+                        std::shared_ptr<DataType> newData);
+
   std::vector<std::function<void(bool)>> mUpdateCallbacks;
 
   // Make this function private as users should not have a way to make the
   // buffer writable. Data writing should be done by writing to the file.
   using BufferManager<DataType>::getWritable;
+  using BufferManager<DataType>::tryGetWritable;
+
+private:
+  struct Prefetched {
+    std::shared_ptr<DataType> data;
+    int64_t modified{0};
+  };
+  // Take data prefetched for path if the file has not changed
+  std::shared_ptr<DataType> takePrefetched(const std::string &path);
+
+  std::mutex mPrefetchLock;
+  std::map<std::string, std::shared_ptr<Prefetched>> mPrefetched;
 };
 
 template <class DataType>
 DiskBuffer<DataType>::DiskBuffer(std::string id, std::string fileName,
-                                 std::string path, uint16_t size)
-    : BufferManager<DataType>(size) {
+                                 std::string path, uint16_t size,
+                                 BufferMode mode)
+    : BufferManager<DataType>(size, mode) {
   mId = id;
   // TODO there should be a check through a singleton to make sure names are
   // unique
@@ -94,24 +151,104 @@ DiskBuffer<DataType>::DiskBuffer(std::string id, std::string fileName,
 
 template <class DataType>
 bool DiskBuffer<DataType>::updateData(std::string filename) {
+  std::unique_lock<std::mutex> lk(mUpdateLock);
   if (filename.size() > 0) {
     m_fileName = filename;
   }
-  std::ifstream file(m_path + m_fileName);
   bool ret = false;
-  if (file.good()) {
-    auto buffer = getWritable();
-    ret = parseFile(file, buffer);
-    BufferManager<DataType>::doneWriting(buffer);
+  auto path = m_path + m_fileName;
+  auto prefetched = takePrefetched(path);
+  auto timeout = writableTimeout();
+  auto buffer = timeout < 0.0f ? getWritable() : getWritable(timeout);
+  if (!buffer) {
+    std::cerr << "ERROR: No free buffer to load " << path << std::endl;
+  } else if (prefetched) {
+    std::swap(*buffer, *prefetched);
+    ret = true;
   } else {
-    std::cerr << "Error code: " << std::strerror(errno);
+    ret = loadFile(path, buffer);
   }
+  if (ret) {
+    BufferManager<DataType>::doneWriting(buffer);
+  }
+  // Callbacks may update the buffer again
+  lk.unlock();
   for (auto cb : mUpdateCallbacks) {
     cb(ret);
   }
   return ret;
 }
 
+template <class DataType>
+bool DiskBuffer<DataType>::loadFile(const std::string &path,
+                                    std::shared_ptr<DataType> newData) {
+  std::shared_ptr<const std::vector<char>> bytes;
+  if (mCacheManager) {
+    bytes = mCacheManager->getFileBytes(path);
+  }
+  if (bytes) {
+    MemoryStreamBuffer streamBuffer(bytes->data(), bytes->size());
+    std::istream stream(&streamBuffer);
+    return parseFile(stream, newData);
+  }
+  std::ifstream file(path);
+  if (!file.good()) {
+    std::cerr << "Error code: " << std::strerror(errno) << std::endl;
+    return false;
+  }
+  return parseFile(file, newData);
+}
+
+template <class DataType>
+void DiskBuffer<DataType>::prefetch(std::vector<std::string> filenames) {
+  auto directory = getPath();
+  std::unique_lock<std::mutex> lk(mPrefetchLock);
+  std::map<std::string, std::shared_ptr<Prefetched>> prefetched;
+  for (const auto &filename : filenames) {
+    auto path = directory + filename;
+    auto it = mPrefetched.find(path);
+    if (it != mPrefetched.end()) {
+      prefetched[path] = it->second;
+      continue;
+    }
+    auto entry = std::make_shared<Prefetched>();
+    prefetched[path] = entry;
+    runAsync([this, path, entry]() {
+      auto modified = fileModified(path);
+      auto data = std::make_shared<DataType>();
+      if (modified == 0 || !loadFile(path, data)) {
+        return;
+      }
+      std::unique_lock<std::mutex> lk(mPrefetchLock);
+      entry->data = data;
+      entry->modified = modified;
+    });
+  }
+  mPrefetched.swap(prefetched);
+}
+
+template <class DataType>
+std::shared_ptr<DataType>
+DiskBuffer<DataType>::takePrefetched(const std::string &path) {
+  std::unique_lock<std::mutex> lk(mPrefetchLock);
+  auto it = mPrefetched.find(path);
+  // Files still loading are read again by the caller
+  if (it == mPrefetched.end() || !it->second->data) {
+    return nullptr;
+  }
+  auto entry = it->second;
+  mPrefetched.erase(it);
+  if (entry->modified != fileModified(path)) {
+    return nullptr;
+  }
+  // Files restored to the cache manager's memory can change without
+  // changing the file on disk, so the memory tier takes precedence.
+  if (mCacheManager && mCacheManager->getFileBytes(path)) {
+    return nullptr;
+  }
+  return entry->data;
+}
+
 } // namespace tinc
 
 #endif // DISKBUFFER_HPP
@@ -36,27 +36,114 @@
 #include "tinc/IdObject.hpp"
 #include "al/ui/al_Parameter.hpp"
 
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 
 namespace tinc {
 
+class CacheManager;
+class FileWatcher;
+class ThreadPool;
+
 /**
  * @brief Base pure virtual class that defines the DiskBuffer interface
  */
 class DiskBufferAbstract : public IdObject {
 public:
-  // Careful, this is not thread safe. Needs to be called synchronously to any
-  // process functions
-  std::string getCurrentFileName() { return m_fileName; }
+  std::string getCurrentFileName() {
+    std::unique_lock<std::mutex> lk(mUpdateLock);
+    return m_fileName;
+  }
 
   virtual bool updateData(std::string filename) = 0;
 
-  std::string getBaseFileName() { return m_fileName; }
+  std::string getBaseFileName() { return getCurrentFileName(); }
+
+  void setPath(std::string path) {
+    std::unique_lock<std::mutex> lk(mUpdateLock);
+    m_path = path;
+  }
+  std::string getPath() {
+    std::unique_lock<std::mutex> lk(mUpdateLock);
+    return m_path;
+  }
+
+  /**
+   * @brief Read file contents from the cache manager's memory tier when
+   * available
+   *
+   * When files are restored from or stored in the cache, their contents can
+   * be parsed from memory instead of being read from disk.
+   */
+  void setCacheManager(std::shared_ptr<CacheManager> cacheManager) {
+    mCacheManager = cacheManager;
+  }
+
+  /**
+   * @brief Update data on the shared I/O thread pool
+   * @param filename new file name. Current file name if empty.
+   *
+   * Returns immediately. The callbacks registered for the buffer are called
+   * on the I/O thread when the update is done. The update fails if readers
+   * hold all buffers for more than a second. If more updates are requested
+   * while one is running, only the last one is done after it.
+   */
+  void updateDataAsync(std::string filename = "");
+
+  /**
+   * @brief Wait until asynchronous updates and prefetches are done
+   */
+  void waitForAsyncTasks();
 
-  void setPath(std::string path) { m_path = path; }
-  std::string getPath() { return m_path; }
+  /**
+   * @brief Thread pool shared by all disk buffers for asynchronous loading
+   */
+  static ThreadPool &ioThreadPool();
+
+  /**
+   * @brief Reload data when the file is written by other processes
+   * @param fileWatcher watcher that reports written files. nullptr stops
+   * watching.
+   *
+   * updateData() is called on the watcher's loader thread, and fails like
+   * updateDataAsync() when no buffer is free. Call again after changing the
+   * path or file name.
+   */
+  void setFileWatcher(std::shared_ptr<FileWatcher> fileWatcher);
 
 protected:
+  // Stop watching the file and wait for asynchronous tasks. Must be called
+  // in the destructor of the most derived class, so the watcher and the I/O
+  // threads don't use a partly destroyed object.
+  void shutdown();
+  void stopWatchingFile();
+  // Run task on the I/O thread pool. waitForAsyncTasks() waits for it.
+  void runAsync(std::function<void()> task);
+  // Seconds updateData() waits for a free buffer. Negative to wait until
+  // one is released. Updates from the I/O threads and the file watcher
+  // give up after a while, so readers holding all buffers can't stall them.
+  static float writableTimeout();
+  // Modification time of file in nanoseconds. 0 if it does not exist.
+  static int64_t fileModified(const std::string &path);
+
+  std::shared_ptr<CacheManager> mCacheManager;
+  std::shared_ptr<FileWatcher> mFileWatcher;
+  uint64_t mFileWatchId{0};
+
+  std::mutex mAsyncLock;
+  std::condition_variable mAsyncSignal;
+  size_t mAsyncTasks{0};
+  bool mAsyncUpdateRunning{false};
+  bool mAsyncUpdateQueued{false};
+  std::string mAsyncUpdateFilename;
+
+  // Held by updateData() while the buffer is written, as updates can come
+  // from the caller, the I/O threads and the file watcher. Guards m_fileName
+  // and m_path.
+  std::mutex mUpdateLock;
   std::string m_fileName;
   std::string m_path;
   std::shared_ptr<al::ParameterString> m_trigger;
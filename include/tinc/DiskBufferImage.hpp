@@ -42,26 +42,11 @@ namespace tinc {
 class ImageDiskBuffer : public DiskBuffer<al::Image> {
 public:
   ImageDiskBuffer(std::string id, std::string fileName = "",
-                  std::string path = "", uint16_t size = 2)
-      : DiskBuffer<al::Image>(id, fileName, path, size) {}
+                  std::string path = "", uint16_t size = 2,
+                  BufferMode mode = BUFFER_LOCKED)
+      : DiskBuffer<al::Image>(id, fileName, path, size, mode) {}
 
-  bool updateData(std::string filename = "") override {
-    if (filename.size() > 0) {
-      m_fileName = filename;
-    }
-    auto buffer = getWritable();
-    bool ret = false;
-    if (buffer->load(m_path + m_fileName)) {
-      BufferManager<al::Image>::doneWriting(buffer);
-      ret = true;
-    } else {
-      std::cerr << "Error reading Image: " << m_path + m_fileName << std::endl;
-    }
-    for (auto cb : mUpdateCallbacks) {
-      cb(ret);
-    }
-    return ret;
-  }
+  ~ImageDiskBuffer() { shutdown(); }
 
   bool writePixels(unsigned char *newData, int width, int height,
                    std::string filename = "") {
@@ -75,11 +60,20 @@ public:
   };
 
 protected:
-  bool parseFile(std::ifstream &file,
+  bool parseFile(std::istream &file,
                  std::shared_ptr<al::Image> newData) override {
     // TODO implement
     return true;
   }
+
+  bool loadFile(const std::string &path,
+                std::shared_ptr<al::Image> newData) override {
+    if (!newData->load(path)) {
+      std::cerr << "Error reading Image: " << path << std::endl;
+      return false;
+    }
+    return true;
+  }
 };
 
 } // namespace tinc
@@ -42,8 +42,11 @@ namespace tinc {
 class DiskBufferJson : public DiskBuffer<nlohmann::json> {
 public:
   DiskBufferJson(std::string id = "", std::string fileName = "",
-                 std::string path = "", uint16_t size = 2)
-      : DiskBuffer<nlohmann::json>(id, fileName, path, size) {}
+                 std::string path = "", uint16_t size = 2,
+                 BufferMode mode = BUFFER_LOCKED)
+      : DiskBuffer<nlohmann::json>(id, fileName, path, size, mode) {}
+
+  ~DiskBufferJson() { shutdown(); }
 
   bool writeJson(nlohmann::json &newData, std::string filename = "") {
     // output to json file on disk
@@ -68,7 +71,7 @@ public:
   }
 
 protected:
-  bool parseFile(std::ifstream &file,
+  bool parseFile(std::istream &file,
                  std::shared_ptr<nlohmann::json> newData) override {
 
     try {
@@ -0,0 +1,186 @@
+#ifndef DISKBUFFERMAPPED_HPP
+#define DISKBUFFERMAPPED_HPP
+
+/*
+ * Copyright 2021 AlloSphere Research Group
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ *        THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * authors: Andres Cabrera
+*/
+
+#include "tinc/DataFileReader.hpp"
+#include "tinc/DiskBuffer.hpp"
+#include "tinc/MappedFile.hpp"
+
+#include <vector>
+
+namespace tinc {
+
+/**
+ * @brief Typed read only view of contiguous values
+ */
+template <typename T> struct ArraySpan {
+  const T *data{nullptr};
+  size_t size{0};
+
+  const T *begin() const { return data; }
+  const T *end() const { return data + size; }
+  const T &operator[](size_t index) const { return data[index]; }
+  bool empty() const { return size == 0; }
+};
+
+template <typename T> struct MappedArrayType;
+
+/**
+ * @brief Array of values read in place from a memory mapped file
+ *
+ * The file starts with a header:
+ *  - 4 bytes: "TNCA"
+ *  - 1 byte: format version (1)
+ *  - 1 byte: data type, a BinaryFileReader::DataType
+ *  - 2 bytes: number of dimensions (uint16)
+ *  - 8 bytes per dimension: size of the dimension (uint64)
+ *
+ * The values follow the header with the last dimension varying fastest.
+ * Header and values are in native byte order.
+ */
+class MappedArray {
+public:
+  static const size_t HEADER_PREFIX_SIZE = 8;
+  static const uint8_t FORMAT_VERSION = 1;
+
+  BinaryFileReader::DataType dataType() const { return mType; }
+  const std::vector<size_t> &shape() const { return mShape; }
+  // Number of values in the array
+  size_t count() const { return mCount; }
+  const void *data() const { return mData; }
+
+  /**
+   * @brief Get values as T
+   * @return an empty span if T does not match dataType()
+   */
+  template <typename T> ArraySpan<T> span() const {
+    ArraySpan<T> values;
+    if (mData && MappedArrayType<T>::type == mType) {
+      values.data = static_cast<const T *>(mData);
+      values.size = mCount;
+    }
+    return values;
+  }
+
+  /**
+   * @brief Use the array in a mapped file
+   * @return false if the header is invalid or the file is too short
+   */
+  bool setFile(std::shared_ptr<MappedFile> file);
+
+  /**
+   * @brief Write array file that can be mapped by setFile()
+   *
+   * The file is written next to path and then renamed, so existing mappings
+   * of the previous file stay valid.
+   */
+  static bool writeFile(const std::string &path, const void *data,
+                        BinaryFileReader::DataType type,
+                        const std::vector<size_t> &shape);
+
+private:
+  std::shared_ptr<MappedFile> mFile;
+  BinaryFileReader::DataType mType{BinaryFileReader::FLOAT32};
+  std::vector<size_t> mShape;
+  size_t mCount{0};
+  const void *mData{nullptr};
+};
+
+template <> struct MappedArrayType<float> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::FLOAT32;
+};
+template <> struct MappedArrayType<double> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::FLOAT64;
+};
+template <> struct MappedArrayType<int8_t> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::INT8;
+};
+template <> struct MappedArrayType<uint8_t> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::UINT8;
+};
+template <> struct MappedArrayType<int16_t> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::INT16;
+};
+template <> struct MappedArrayType<uint16_t> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::UINT16;
+};
+template <> struct MappedArrayType<int32_t> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::INT32;
+};
+template <> struct MappedArrayType<uint32_t> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::UINT32;
+};
+template <> struct MappedArrayType<int64_t> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::INT64;
+};
+template <> struct MappedArrayType<uint64_t> {
+  static const BinaryFileReader::DataType type = BinaryFileReader::UINT64;
+};
+
+/**
+ * @brief DiskBuffer that maps binary array files instead of reading them
+ *
+ * Values are not copied into memory. Each buffer holds the mapping of the
+ * file it was updated from, so updating the buffer swaps mappings and a
+ * mapping is released when no reader holds its buffer.
+ */
+class DiskBufferMapped : public DiskBuffer<MappedArray> {
+public:
+  DiskBufferMapped(std::string id = "", std::string fileName = "",
+                   std::string path = "", uint16_t size = 2,
+                   BufferMode mode = BUFFER_LOCKED)
+      : DiskBuffer<MappedArray>(id, fileName, path, size, mode) {}
+
+  ~DiskBufferMapped() { shutdown(); }
+
+  /**
+   * @brief Write array to file and update the buffer from it
+   * @param data values, with the last dimension varying fastest
+   * @param type type of the values
+   * @param shape size of each dimension
+   * @param filename file name. Current file name if empty.
+   */
+  bool writeArray(const void *data, BinaryFileReader::DataType type,
+                  std::vector<size_t> shape, std::string filename = "");
+
+protected:
+  bool parseFile(std::istream &file,
+                 std::shared_ptr<MappedArray> newData) override;
+  bool loadFile(const std::string &path,
+                std::shared_ptr<MappedArray> newData) override;
+};
+
+} // namespace tinc
+
+#endif // DISKBUFFERMAPPED_HPP
@@ -33,10 +33,12 @@
  * authors: Andres Cabrera
 */
 
+#include "tinc/DataFileReader.hpp"
 #include "tinc/DiskBuffer.hpp"
 
 #ifdef TINC_HAS_NETCDF
 #include <netcdf.h>
+#include <netcdf_mem.h>
 #endif
 
 namespace tinc {
@@ -67,8 +69,9 @@ struct NC_Dimension {
 class DiskBufferNetCDFDouble : public DiskBuffer<std::vector<double>> {
 public:
   DiskBufferNetCDFDouble(std::string id, std::string fileName = "",
-                         std::string path = "", uint16_t size = 2)
-      : DiskBuffer<std::vector<double>>(id, fileName, path, size) {
+                         std::string path = "", uint16_t size = 2,
+                         BufferMode mode = BUFFER_LOCKED)
+      : DiskBuffer<std::vector<double>>(id, fileName, path, size, mode) {
 #ifndef TINC_HAS_NETCDF
     std::cerr << "ERROR: DiskBufferNetCDFDouble built wihtout NetCDF support"
               << std::endl;
@@ -76,61 +79,83 @@ public:
 #endif
   }
 
+  ~DiskBufferNetCDFDouble() { shutdown(); }
+
   bool updateData(std::string filename) {
+    std::unique_lock<std::mutex> lk(mUpdateLock);
     if (filename.size() > 0) {
       m_fileName = filename;
     }
     bool ret = false;
-    auto buffer = getWritable();
-
-    int ncid, retval;
-
-#ifdef TINC_HAS_NETCDF
-    int *nattsp = nullptr;
-    /* Open the file. NC_NOWRITE tells netCDF we want read-only access
-     * to the file.*/
-    if ((retval = nc_open(filename.c_str(), NC_NOWRITE, &ncid))) {
-      goto done;
-    }
-    int varid;
-    if ((retval = nc_inq_varid(ncid, "data", &varid))) {
-      goto done;
-    }
-
-    nc_type xtypep;
-    char name[32];
-    int ndimsp;
-    int dimidsp[32];
-    if ((retval = nc_inq_var(ncid, varid, name, &xtypep, &ndimsp, dimidsp,
-                             nattsp))) {
+    auto timeout = writableTimeout();
+    auto buffer = timeout < 0.0f ? getWritable() : getWritable(timeout);
+    if (!buffer) {
+      std::cerr << "ERROR: No free buffer to load " << m_path + m_fileName
+                << std::endl;
       goto done;
     }
 
-    size_t lenp;
-    if ((retval = nc_inq_dimlen(ncid, dimidsp[0], &lenp))) {
-      goto done;
-    }
-    buffer->resize(lenp);
+    int ncid, retval;
 
-    /* Read the data. */
-    if ((retval = nc_get_var_double(ncid, varid, buffer->data()))) {
-      goto done;
+#ifdef TINC_HAS_NETCDF
+    {
+      int *nattsp = nullptr;
+      int varid;
+      nc_type xtypep;
+      char name[NC_MAX_NAME + 1];
+      int ndimsp;
+      int dimidsp[NC_MAX_VAR_DIMS];
+      size_t lenp;
+      std::shared_ptr<const std::vector<char>> bytes;
+      if (mCacheManager) {
+        bytes = mCacheManager->getFileBytes(m_path + m_fileName);
+      }
+      // The NetCDF library is not thread safe
+      std::unique_lock<std::mutex> ncLock(NetCDFFileReader::libraryLock());
+      /* Open the file. NC_NOWRITE tells netCDF we want read-only access
+       * to the file.*/
+      if (bytes) {
+        // Parse directly from the cache's memory tier
+        if ((retval = nc_open_mem(m_fileName.c_str(), NC_NOWRITE,
+                                  bytes->size(),
+                                  const_cast<char *>(bytes->data()), &ncid))) {
+          goto done;
+        }
+      } else if ((retval = nc_open((m_path + m_fileName).c_str(), NC_NOWRITE,
+                                   &ncid))) {
+        goto done;
+      }
+      if ((retval = nc_inq_varid(ncid, "data", &varid))) {
+        goto close;
+      }
+      if ((retval = nc_inq_var(ncid, varid, name, &xtypep, &ndimsp, dimidsp,
+                               nattsp)) ||
+          ndimsp < 1) {
+        goto close;
+      }
+      if ((retval = nc_inq_dimlen(ncid, dimidsp[0], &lenp))) {
+        goto close;
+      }
+      buffer->resize(lenp);
+
+      /* Read the data. */
+      if ((retval = nc_get_var_double(ncid, varid, buffer->data()))) {
+        goto close;
+      }
+      ret = true;
+
+    close:
+      /* Close the file, freeing all resources. */
+      if ((retval = nc_close(ncid))) {
+        ret = false;
+      }
     }
-
-    //    /* Check the data. */
-    //    for (x = 0; x < NX; x++)
-    //      for (y = 0; y < NY; y++)
-    //        if (data_in[x][y] != x * NY + y)
-    //          return ERRCODE;
-
-    /* Close the file, freeing all resources. */
-    if ((retval = nc_close(ncid))) {
-      goto done;
+    if (ret) {
+      BufferManager<std::vector<double>>::doneWriting(buffer);
     }
-    ret = true;
-    BufferManager<std::vector<double>>::doneWriting(buffer);
 #endif
   done:
+    lk.unlock();
     for (auto cb : mUpdateCallbacks) {
       cb(ret);
     }
@@ -138,7 +163,7 @@ public:
   }
 
 protected:
-  virtual bool parseFile(std::ifstream &file,
+  virtual bool parseFile(std::istream &file,
                          std::shared_ptr<std::vector<double>> newData) {
 
     return true;
@@ -0,0 +1,122 @@
+#ifndef FILEWATCHER_HPP
+#define FILEWATCHER_HPP
+
+/*
+ * Copyright 2021 AlloSphere Research Group
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ *        THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * authors: Andres Cabrera
+*/
+
+#include "tinc/ThreadPool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace tinc {
+
+/**
+ * @brief Service that notifies when files in a directory have been written
+ *
+ * Uses inotify, so it is only available on Linux. A file is reported once
+ * writers have closed it or moved it into the directory and no further
+ * events arrived for the debounce time. Callbacks run on a loader thread
+ * owned by the watcher, one at a time, so they can do slow work like
+ * reloading files without delaying other events.
+ */
+class FileWatcher {
+public:
+  /**
+   * @param debounceTime seconds to wait for more events before reporting a
+   * file
+   */
+  FileWatcher(float debounceTime = 0.05f);
+  ~FileWatcher();
+
+  FileWatcher(const FileWatcher &) = delete;
+  FileWatcher &operator=(const FileWatcher &) = delete;
+
+  /**
+   * @brief Call callback when a file in directory has been written
+   * @param directory directory to watch. Current directory if empty.
+   * @param callback function called with the name of the file written
+   * @return id to pass to unwatch(). 0 on error.
+   */
+  uint64_t watch(std::string directory,
+                 std::function<void(const std::string &)> callback);
+
+  /**
+   * @brief Stop calling the callback for id
+   *
+   * Waits for a running callback for id to finish, so it must not be called
+   * from the callback.
+   */
+  void unwatch(uint64_t id);
+
+  void setDebounceTime(float seconds) { mDebounceTime = seconds; }
+
+private:
+  struct Subscription {
+    std::mutex lock;
+    bool active{true};
+    int watchDescriptor{-1};
+    std::function<void(const std::string &)> callback;
+  };
+
+  void watcherThread();
+  // Queue callbacks for files whose last event is older than the debounce
+  // time. mLock must be held.
+  void dispatchPending();
+
+  int mInotifyFd{-1};
+  std::unique_ptr<std::thread> mThread;
+  std::atomic<bool> mRunning{false};
+  std::atomic<float> mDebounceTime;
+
+  std::mutex mLock;
+  uint64_t mNextId{1};
+  std::map<uint64_t, std::shared_ptr<Subscription>> mSubscriptions;
+  // Number of subscriptions for each inotify watch descriptor
+  std::map<int, size_t> mWatchCount;
+  // Time of last event for watch descriptor and file name
+  std::map<std::pair<int, std::string>,
+           std::chrono::steady_clock::time_point>
+      mPending;
+
+  ThreadPool mLoader{1};
+};
+
+} // namespace tinc
+
+#endif // FILEWATCHER_HPP
@@ -110,6 +110,16 @@ public:
    */
   std::vector<std::shared_ptr<ParameterSpaceDimension>> getDimensions();
 
+  /**
+   * @brief Copy dimensions, current values and paths to a new parameter space
+   * @return the copy
+   *
+   * The copy does not follow later changes to this parameter space, so it
+   * can be read from other threads while this one changes. Callbacks are not
+   * copied.
+   */
+  std::shared_ptr<ParameterSpace> snapshot();
+
   /**
    * @brief Returns all the paths that are used by the whole parameter space
    */
@@ -332,6 +342,14 @@ public:
    */
   void enableCache(std::string cachePath);
 
+  /**
+   * @brief Get the cache manager for the parameter space
+   * @return the cache manager or nullptr if caching has not been enabled
+   *
+   * Use the cache manager to set cache budget and eviction policy.
+   */
+  std::shared_ptr<CacheManager> getCacheManager() { return mCacheManager; }
+
   /**
    * @brief callback when the value in any particular dimension changes.
    *
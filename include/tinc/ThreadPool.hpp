@@ -0,0 +1,93 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+/*
+ * Copyright 2021 AlloSphere Research Group
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ *        THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * authors: Andres Cabrera
+*/
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tinc {
+
+/**
+ * @brief Fixed set of worker threads that run queued tasks
+ */
+class ThreadPool {
+public:
+  /**
+   * @param threadCount number of worker threads. 0 uses the number of
+   * hardware threads.
+   */
+  ThreadPool(size_t threadCount = 0);
+
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /**
+   * @brief Queue task to run on a worker thread
+   */
+  void push(std::function<void()> task);
+
+  /**
+   * @brief Run function over a range split in chunks across worker threads
+   * @param count size of the range
+   * @param func function called with the begin and end of each chunk
+   * @param chunkSize number of elements per chunk. 0 splits the range evenly
+   * across threads.
+   *
+   * Blocks until all chunks are done. The calling thread also processes
+   * chunks, so this can be called from a task running in the pool.
+   */
+  void parallelFor(size_t count, std::function<void(size_t, size_t)> func,
+                   size_t chunkSize = 0);
+
+  size_t threadCount() { return mThreads.size(); }
+
+private:
+  std::vector<std::thread> mThreads;
+  std::deque<std::function<void()>> mTasks;
+  std::mutex mTasksLock;
+  std::condition_variable mTasksSignal;
+  bool mRunning{true};
+};
+
+} // namespace tinc
+
+#endif // THREADPOOL_HPP
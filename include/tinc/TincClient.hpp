@@ -33,7 +33,11 @@
  * authors: Andres Cabrera, Kon Hyong Kim
  */
 
+#include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <set>
+#include <thread>
 
 #include "al/io/al_Socket.hpp"
 #include "al/protocol/al_CommandConnection.hpp"
@@ -51,6 +55,8 @@ class TincClient : public al::CommandClient, public TincProtocol {
 public:
   TincClient();
 
+  ~TincClient();
+
   void stop() override;
 
   bool processIncomingMessage(al::Message &message, al::Socket *src) override;
@@ -89,12 +95,125 @@ public:
   void setVerbose(bool verbose);
   bool verbose() { return TincProtocol::mVerbose; }
 
+  /**
+   * @brief Use the server's cache as a second level for a local cache
+   * @param ps parameter space with cache enabled. The server must have a
+   * parameter space registered with the same id.
+   *
+   * When a cache lookup misses locally, the server's cache is queried and
+   * the cached files are copied over the connection into the local cache.
+   */
+  void enableRemoteCache(ParameterSpace &ps);
+
+  void disableRemoteCache(ParameterSpace &ps);
+
+  /**
+   * @brief Fetch cache entry from server into local cache
+   * @param parameterSpaceId id of parameter space on the server
+   * @param sourceInfo source information to query
+   * @param cacheManager local cache to import the entry into
+   * @return cache file names in local cache. Empty if not found in server.
+   */
+  std::vector<std::string> fetchRemoteCache(std::string parameterSpaceId,
+                                            const SourceInfo &sourceInfo,
+                                            CacheManager &cacheManager);
+
+  /**
+   * @brief Get last cache statistics received from the server
+   * @param parameterSpaceId id of the parameter space on the server
+   * @param stats statistics received
+   * @return false if no statistics have been received for the parameter space
+   *
+   * The server sends statistics when TincServer::setCacheStatusInterval() is
+   * set.
+   */
+  bool serverCacheStatistics(std::string parameterSpaceId,
+                             CacheStatistics &stats);
+
+  /**
+   * @brief Read a data pool slice from the server into memory
+   * @param dataPoolId id of the data pool on the server
+   * @param field name of the field to extract
+   * @param sliceDimensions dimensions that can change across the slice
+   * @param slice values and shape of the slice
+   * @param chunkSize maximum bytes of slice data per message. 0 uses the
+   * server default.
+   * @return false on error or timeout
+   *
+   * The slice values are sent over the connection, so the client does not
+   * need access to the server's file system. Large slices are split across
+   * several messages and assembled directly into slice.
+   */
+  bool readDataSlice(std::string dataPoolId, std::string field,
+                     std::vector<std::string> sliceDimensions,
+                     DataPool::SliceData &slice, size_t chunkSize = 0);
+
+  /**
+   * @brief Read slices of several fields from the server in one request
+   * @param dataPoolId id of the data pool on the server
+   * @param fields names of the fields to extract
+   * @param sliceDimensions dimensions that can change across the slice
+   * @param slices one slice per field, in the order of fields
+   * @param chunkSize maximum bytes of slice data per message. 0 uses the
+   * server default.
+   * @return false on error or timeout
+   *
+   * The server reads each data file once for all fields.
+   */
+  bool readDataSlices(std::string dataPoolId, std::vector<std::string> fields,
+                      std::vector<std::string> sliceDimensions,
+                      std::vector<DataPool::SliceData> &slices,
+                      size_t chunkSize = 0);
+
+  /**
+   * @brief Compute statistics of a data pool slice on the server
+   * @param dataPoolId id of the data pool on the server
+   * @param field name of the field to reduce
+   * @param sliceDimensions dimensions that can change across the slice
+   * @param reduction statistics received from the server
+   * @param histogramBins number of histogram bins. 0 for no histogram.
+   * @param histogramMin lower bound of the histogram
+   * @param histogramMax upper bound of the histogram. If equal to
+   * histogramMin, the range of the values is used.
+   * @return false on error or timeout
+   *
+   * Only the statistics are sent over the connection, not the slice. See
+   * DataPool::reduceDataSlice().
+   */
+  bool reduceDataSlice(std::string dataPoolId, std::string field,
+                       std::vector<std::string> sliceDimensions,
+                       DataPool::SliceReduction &reduction,
+                       size_t histogramBins = 0, float histogramMin = 0.0f,
+                       float histogramMax = 0.0f);
+
+  /**
+   * @brief Set time to wait for the reply to a command
+   */
+  void setCommandTimeout(float timeoutsec) { mCommandTimeout = timeoutsec; }
+
 protected:
   void processBarrierRequest(al::Socket *src, uint64_t barrierConsecutive);
   void processBarrierUnlock(al::Socket *src, uint64_t barrierConsecutive);
 
   void processStatusMessage(void *message);
 
+  /**
+   * @brief Send command to server and wait for reply
+   * @param objectType object type of the command
+   * @param objectId id of the object the command is for
+   * @param commandDetails protobuf message with command details
+   * @param reply protobuf message to unpack the reply to
+   * @param timeoutsec time to wait for the reply
+   * @return false on timeout, error reply, or when called from the thread
+   * that receives messages, as the reply could never be processed.
+   */
+  bool sendCommand(int objectType, std::string objectId, void *commandDetails,
+                   void *reply, float timeoutsec);
+  // Send command with a message id reserved from mCommandCounter
+  bool sendCommand(int objectType, std::string objectId, void *commandDetails,
+                   void *reply, float timeoutsec, uint64_t commandNumber);
+  void processCommandReply(void *details);
+
 private:
   // Network barriers
   std::map<uint64_t, al::Socket *> mBarrierRequests;
@@ -103,6 +222,31 @@ private:
 
   bool mWaitForServer{false};
 
+  // Commands
+  std::atomic<uint64_t> mCommandCounter{1};
+  std::set<uint64_t> mPendingCommands;
+  // Serialized Command messages for replies received
+  std::map<uint64_t, std::string> mCommandReplies;
+  std::mutex mCommandRepliesLock;
+  std::condition_variable mCommandReplySignal;
+  float mCommandTimeout{10.0};
+  // Thread processing incoming messages. Replies are delivered on it, so it
+  // must never wait for them.
+  std::atomic<std::thread::id> mReceiveThreadId{std::thread::id()};
+
+  // Slices being received inline, by command message id
+  struct SliceAssembly {
+    DataPool::SliceData *slice;
+    uint64_t received{0};
+    bool error{false};
+  };
+  std::map<uint64_t, SliceAssembly> mSliceAssemblies;
+
+  std::vector<std::weak_ptr<CacheManager>> mRemoteCaches;
+
+  std::map<std::string, CacheStatistics> mServerCacheStatistics;
+  std::mutex mServerCacheStatisticsLock;
+
   Status mServerStatus;
 };
 
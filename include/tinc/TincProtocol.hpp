@@ -272,7 +272,16 @@ protected:
 
   bool processCommandParameter(void *any, al::Socket *src);
   bool processCommandParameterSpace(void *any, al::Socket *src);
-  bool processCommandDataPool(void *any, al::Socket *src);
+  // Process command for dataPool, or for the registered data pool with the
+  // command's id if dataPool is nullptr
+  bool processCommandDataPool(void *any, al::Socket *src,
+                              DataPool *dataPool = nullptr);
+  // Send slice values inline as replies to commandNumber, split in chunks of
+  // at most chunkSize bytes. 0 uses the default chunk size.
+  bool sendSliceData(uint64_t commandNumber, std::string datapoolId,
+                     const std::vector<std::string> &fields,
+                     const DataPool::SliceData &slice, size_t chunkSize,
+                     al::Socket *src);
 
   // send proto message (No checks. sends to dst socket)
   bool sendProtobufMessage(void *message, al::Socket *dst);
@@ -293,6 +302,9 @@ protected:
   }
 
   std::vector<ParameterSpace *> mParameterSpaces;
+  // Held when adding parameter spaces, so threads other than the one
+  // registering them can copy mParameterSpaces.
+  std::mutex mParameterSpacesLock;
   std::vector<ParameterSpaceDimension *> mParameterSpaceDimensions;
   std::vector<Processor *> mProcessors;
   std::vector<DiskBufferAbstract *> mDiskBuffers;
@@ -307,6 +319,10 @@ protected:
   std::mutex mBusyCountLock;
   uint32_t mBusyCount = 0;
 
+  // Messages can be sent from several threads. Keeps messages from
+  // interleaving on a socket.
+  std::mutex mSendLock;
+
   bool mVerbose{false};
 };
 } // namespace tinc
@@ -33,8 +33,10 @@
  * authors: Andres Cabrera, Kon Hyong Kim
 */
 
+#include <condition_variable>
 #include <map>
 #include <deque>
+#include <thread>
 
 #include "al/io/al_Socket.hpp"
 #include "al/protocol/al_CommandConnection.hpp"
@@ -44,6 +46,7 @@
 #include "tinc/DiskBuffer.hpp"
 #include "tinc/ParameterSpace.hpp"
 #include "tinc/Processor.hpp"
+#include "tinc/ThreadPool.hpp"
 #include "tinc/TincProtocol.hpp"
 
 namespace tinc {
@@ -55,6 +58,8 @@ public:
 
   TincServer();
 
+  ~TincServer();
+
   bool processIncomingMessage(al::Message &message, al::Socket *src) override;
 
   // See documentation on TincProtocol
@@ -85,12 +90,41 @@ public:
   void markBusy() override;
   void markAvailable() override;
 
+  /**
+   * @brief Send cache statistics of registered parameter spaces periodically
+   * @param intervalsec seconds between status messages. 0 disables (default)
+   *
+   * Clients receive statistics as STATUS messages for each parameter space
+   * that has cache enabled. See TincClient::serverCacheStatistics()
+   */
+  void setCacheStatusInterval(float intervalsec);
+
+  /**
+   * @brief Send cache statistics of registered parameter spaces now
+   * @param dst connection to send to. nullptr sends to all connections
+   */
+  void sendCacheStatus(al::Socket *dst = nullptr);
+
+  /**
+   * @brief Set number of threads that process data pool commands
+   *
+   * Data pool commands run on these threads instead of the network thread,
+   * so other messages are processed while slices are created. Replies are
+   * sent as commands finish. A command reads a copy of its data pool's
+   * parameter space made when it was received, so messages that change the
+   * parameter space don't wait for it. Waits for commands in progress.
+   */
+  void setCommandThreadCount(size_t threadCount);
+
 protected:
   void onConnection(al::Socket *newConnection) override;
 
   void processBarrierAckLock(al::Socket *src, uint64_t barrierConsecutive);
   void disconnectClient(al::Socket *src);
 
+  // Process command on a command thread. details is a protobuf Any message
+  void processCommandAsync(int objectType, void *details, al::Socket *src);
+
 private:
   uint64_t mBarrierConsecutive{1};
   std::mutex mBarrierLock;
@@ -98,6 +132,15 @@ private:
   // Network barriers
   std::map<uint64_t, std::deque<al::Socket *>> mBarrierAcks;
   std::mutex mBarrierAckLock;
+
+  // Cache status
+  std::unique_ptr<std::thread> mCacheStatusThread;
+  float mCacheStatusInterval{0.0};
+  std::mutex mCacheStatusLock;
+  std::condition_variable mCacheStatusSignal;
+
+  std::unique_ptr<ThreadPool> mCommandThreadPool;
+  std::mutex mCommandThreadPoolLock;
 };
 
 } // namespace tinc
@@ -1,19 +1,300 @@
 #include "tinc/CacheManager.hpp"
+#include "FileModified.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <iomanip>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 
+#include <sys/stat.h>
+
 #include "al/io/al_File.hpp"
 
+#ifdef AL_WINDOWS
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+#include "picosha2.h" // SHA256 hash generator
+
+#ifdef TINC_HAS_ZLIB
+#include <zlib.h>
+#endif
+
 #define TINC_META_VERSION_MAJOR 1
-#define TINC_META_VERSION_MINOR 0
+#define TINC_META_VERSION_MINOR 3
+
+#define TINC_CACHE_CHUNK_SIZE 65536
+// The journal is merged into the metadata file when it holds as many records
+// as there are entries, but not before it holds this many records
+#define TINC_CACHE_JOURNAL_MIN_RECORDS 64
 
 using namespace tinc;
 
 // To regenerate this file run update_schema_cpp.sh
 #include "tinc_cache_schema.cpp"
 
+static std::string currentTimestamp() {
+  std::time_t now =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  std::stringstream ss;
+  ss << std::put_time(std::localtime(&now), "%FT%T%z");
+  return ss.str();
+}
+
+// Timezone is ignored, as timestamps are only compared to timestamps written
+// by the same machine.
+static std::time_t parseTimestamp(const std::string &timestamp) {
+  std::tm tm = {};
+  std::istringstream ss(timestamp);
+  ss >> std::get_time(&tm, "%Y-%m-%dT%H:%M:%S");
+  if (ss.fail()) {
+    return 0;
+  }
+  tm.tm_isdst = -1;
+  return std::mktime(&tm);
+}
+
+static std::time_t lastAccessTime(const CacheEntry &entry) {
+  if (entry.timestampLastAccess.size() > 0) {
+    return parseTimestamp(entry.timestampLastAccess);
+  }
+  return parseTimestamp(entry.timestampEnd);
+}
+
+// Stream sourcePath to destinationPath, decompressing and compressing with
+// zlib (gzip format) as needed, so that whole files are never held in memory.
+static bool transcodeFile(const std::string &sourcePath, bool sourceCompressed,
+                          const std::string &destinationPath, bool compress,
+                          int level) {
+#ifndef TINC_HAS_ZLIB
+  if (sourceCompressed || compress) {
+    std::cerr << "ERROR: TINC built without zlib. Can't read or write "
+                 "compressed cache file "
+              << sourcePath << std::endl;
+    return false;
+  }
+#endif
+  std::ifstream in(sourcePath, std::ios::binary);
+  if (!in.good()) {
+    return false;
+  }
+  std::ofstream out(destinationPath, std::ios::binary | std::ios::trunc);
+  if (!out.good()) {
+    return false;
+  }
+  std::vector<char> input(TINC_CACHE_CHUNK_SIZE);
+  bool ok = true;
+  if (!sourceCompressed && !compress) {
+    while (ok && in.good()) {
+      in.read(input.data(), input.size());
+      out.write(input.data(), in.gcount());
+      ok = !in.bad() && out.good();
+    }
+    out.close();
+    return ok && out.good();
+  }
+#ifdef TINC_HAS_ZLIB
+  std::vector<char> decoded(TINC_CACHE_CHUNK_SIZE);
+  std::vector<char> encoded(TINC_CACHE_CHUNK_SIZE);
+  z_stream inflater = {};
+  z_stream deflater = {};
+  // Window bits + 16 selects gzip format, so files can be inspected with
+  // standard tools.
+  if (sourceCompressed && inflateInit2(&inflater, 15 + 16) != Z_OK) {
+    return false;
+  }
+  if (compress && deflateInit2(&deflater, level, Z_DEFLATED, 15 + 16, 8,
+                               Z_DEFAULT_STRATEGY) != Z_OK) {
+    if (sourceCompressed) {
+      inflateEnd(&inflater);
+    }
+    return false;
+  }
+
+  auto writeDecoded = [&](char *data, size_t length, bool finish) {
+    if (!compress) {
+      out.write(data, length);
+      return out.good();
+    }
+    deflater.next_in = reinterpret_cast<Bytef *>(data);
+    deflater.avail_in = (uInt)length;
+    do {
+      deflater.next_out = reinterpret_cast<Bytef *>(encoded.data());
+      deflater.avail_out = (uInt)encoded.size();
+      if (deflate(&deflater, finish ? Z_FINISH : Z_NO_FLUSH) ==
+          Z_STREAM_ERROR) {
+        return false;
+      }
+      out.write(encoded.data(), encoded.size() - deflater.avail_out);
+    } while (deflater.avail_out == 0);
+    return out.good();
+  };
+
+  bool streamEnded = false;
+  bool sourceEnded = false;
+  while (ok && !sourceEnded) {
+    in.read(input.data(), input.size());
+    size_t count = in.gcount();
+    sourceEnded = in.eof();
+    if (in.bad()) {
+      ok = false;
+      break;
+    }
+    if (!sourceCompressed) {
+      ok = writeDecoded(input.data(), count, sourceEnded);
+      continue;
+    }
+    inflater.next_in = reinterpret_cast<Bytef *>(input.data());
+    inflater.avail_in = (uInt)count;
+    do {
+      inflater.next_out = reinterpret_cast<Bytef *>(decoded.data());
+      inflater.avail_out = (uInt)decoded.size();
+      int ret = inflate(&inflater, Z_NO_FLUSH);
+      if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR ||
+          ret == Z_STREAM_ERROR) {
+        ok = false;
+        break;
+      }
+      streamEnded = ret == Z_STREAM_END;
+      ok = writeDecoded(decoded.data(), decoded.size() - inflater.avail_out,
+                        false);
+    } while (ok && inflater.avail_out == 0 && !streamEnded);
+    if (ok && sourceEnded) {
+      // Truncated compressed files are an error
+      ok = streamEnded && writeDecoded(nullptr, 0, true);
+    }
+  }
+  if (sourceCompressed) {
+    inflateEnd(&inflater);
+  }
+  if (compress) {
+    deflateEnd(&deflater);
+  }
+  out.close();
+  return ok && out.good();
+#else
+  return false;
+#endif
+}
+
+// Replace file at destination with source. Used to make new cache files
+// visible only once they have been completely written.
+static bool replaceFile(const std::string &sourcePath,
+                        const std::string &destinationPath) {
+#ifdef AL_WINDOWS
+  if (al::File::exists(destinationPath)) {
+    al::File::remove(destinationPath);
+  }
+#endif
+  return std::rename(sourcePath.c_str(), destinationPath.c_str()) == 0;
+}
+
+// Key identifying an entry by its files. Entries with the same files replace
+// each other, as the files have been overwritten.
+static std::string entryFilesKey(const std::vector<std::string> &filenames) {
+  std::string key;
+  for (const auto &filename : filenames) {
+    key += filename;
+    key += '\n';
+  }
+  return key;
+}
+
+static uint64_t fileSize(const std::string &path) {
+  struct stat s;
+  if (::stat(path.c_str(), &s) == 0) {
+    return s.st_size;
+  }
+  return 0;
+}
+
+// Read records in the journal at path after offset. Returns the offset after
+// the last complete record, so a record being appended by another process is
+// read on the next call.
+static uint64_t readJournal(const std::string &path, uint64_t offset,
+                            std::vector<nlohmann::json> &records) {
+  std::ifstream f(path, std::ios::binary);
+  if (!f.good()) {
+    return offset;
+  }
+  f.seekg(offset);
+  std::string line;
+  while (std::getline(f, line) && !f.eof()) {
+    offset += line.size() + 1;
+    try {
+      records.push_back(nlohmann::json::parse(line));
+    } catch (std::exception &e) {
+      std::cerr << "ERROR parsing cache journal record: " << e.what()
+                << std::endl;
+    }
+  }
+  return offset;
+}
+
+// Advisory lock on a file, used to serialize metadata writes across
+// processes sharing a cache directory.
+class CacheFileLock {
+public:
+  CacheFileLock(const std::string &path) {
+#ifdef AL_WINDOWS
+    mHandle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                          OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mHandle != INVALID_HANDLE_VALUE) {
+      OVERLAPPED overlapped = {};
+      mLocked = LockFileEx(mHandle, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD,
+                           MAXDWORD, &overlapped) != 0;
+    }
+#else
+    mFd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (mFd >= 0) {
+      int ret;
+      while ((ret = ::flock(mFd, LOCK_EX)) != 0 && errno == EINTR) {
+      }
+      mLocked = ret == 0;
+    }
+#endif
+  }
+
+  ~CacheFileLock() {
+#ifdef AL_WINDOWS
+    if (mHandle != INVALID_HANDLE_VALUE) {
+      if (mLocked) {
+        OVERLAPPED overlapped = {};
+        UnlockFileEx(mHandle, 0, MAXDWORD, MAXDWORD, &overlapped);
+      }
+      CloseHandle(mHandle);
+    }
+#else
+    if (mFd >= 0) {
+      if (mLocked) {
+        ::flock(mFd, LOCK_UN);
+      }
+      ::close(mFd);
+    }
+#endif
+  }
+
+  bool locked() { return mLocked; }
+
+private:
+  bool mLocked{false};
+#ifdef AL_WINDOWS
+  HANDLE mHandle{INVALID_HANDLE_VALUE};
+#else
+  int mFd{-1};
+#endif
+};
+
 CacheManager::CacheManager(DistributedPath cachePath) : mCachePath(cachePath) {
 
   auto person_schema = nlohmann::json::parse(
@@ -31,6 +312,10 @@ CacheManager::CacheManager(DistributedPath cachePath) : mCachePath(cachePath) {
   }
 
   if (!al::File::exists(mCachePath.filePath())) {
+    // A journal without metadata file belongs to a removed cache
+    if (al::File::exists(journalPath())) {
+      al::File::remove(journalPath());
+    }
     writeToDisk();
   } else {
     try {
@@ -49,253 +334,1324 @@ CacheManager::CacheManager(DistributedPath cachePath) : mCachePath(cachePath) {
       std::cerr << "Invalid cache format. Ignoring old cache." << std::endl;
     }
   }
+  startMaintenance();
+}
+
+CacheManager::~CacheManager() {
+  stopMaintenance();
+  std::unique_lock<std::mutex> lk(mCacheLock);
+  if (mMetadataDirty) {
+    try {
+      writeEntriesToDisk();
+    } catch (std::exception &e) {
+      std::cerr << "ERROR writing cache metadata on exit" << std::endl;
+    }
+  }
 }
 
 void CacheManager::appendEntry(CacheEntry &entry) {
+  if (entry.size == 0) {
+    entry.size = computeEntrySize(entry);
+  }
+  if (entry.timestampLastAccess.size() == 0) {
+    entry.timestampLastAccess = entry.timestampEnd;
+  }
+  bool needsEviction;
+  std::vector<CacheEntry> replacedEntries;
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    // Replace entries that point to the same files, as the files have been
+    // overwritten
+    auto it = mEntries.begin();
+    while (it != mEntries.end()) {
+      if (it->filenames == entry.filenames) {
+        mCurrentSize -= std::min(mCurrentSize, it->size);
+        if (it->codec != entry.codec) {
+          // Files with a different codec have not been overwritten
+          replacedEntries.push_back(*it);
+        }
+        mRemovedEntries.push_back({it->filenames, it->timestampEnd});
+        it = mEntries.erase(it);
+        mEntryIndexValid = false;
+      } else {
+        it++;
+      }
+    }
+    mEntries.push_back(entry);
+    markChanged(entry);
+    if (mEntryIndexValid) {
+      auto key = entryKey(entry.sourceInfo);
+      if (key.size() > 0) {
+        mEntryIndex[key].push_back(mEntries.size() - 1);
+      }
+    }
+    mCurrentSize += entry.size;
+    needsEviction = overBudget();
+  }
+  for (const auto &replaced : replacedEntries) {
+    removeEntryFiles(replaced);
+  }
+  if (needsEviction) {
+    notifyMaintenance();
+  }
+}
+
+// Canonical representation of an argument value. Values that are equal after
+// quantization produce the same string.
+static std::string canonicalValue(const VariantValue &value, double step) {
+  char buffer[32];
+  switch (value.type) {
+  case VARIANT_DOUBLE:
+  case VARIANT_FLOAT:
+    if (step > 0.0 && std::isfinite(value.valueDouble / step)) {
+      return "q" + std::to_string(std::llround(value.valueDouble / step));
+    }
+    if (value.type == VARIANT_FLOAT ||
+        (double)(float)value.valueDouble == value.valueDouble) {
+      // Float values are widened to double by parameter spaces and when
+      // reading entries back, so doubles that hold a float exactly are
+      // keyed as floats too.
+      snprintf(buffer, sizeof(buffer), "f%.9g", (float)value.valueDouble);
+    } else {
+      snprintf(buffer, sizeof(buffer), "f%.17g", value.valueDouble);
+    }
+    return buffer;
+  case VARIANT_INT32:
+  case VARIANT_INT64:
+    return "i" + std::to_string(value.valueInt64);
+  case VARIANT_STRING:
+    return "s" + value.valueStr;
+  default:
+    return std::string();
+  }
+}
+
+std::string CacheManager::entryKey(const SourceInfo &sourceInfo) {
+  std::vector<std::pair<std::string, std::string>> arguments;
+  for (const auto &arg : sourceInfo.arguments) {
+    auto quantization = mArgumentQuantization.find(arg.id);
+    auto value = canonicalValue(arg.value,
+                                quantization != mArgumentQuantization.end()
+                                    ? quantization->second
+                                    : 0.0);
+    if (value.size() == 0) {
+      std::cerr << "ERROR: Unsupported type for argument value" << std::endl;
+      return std::string();
+    }
+    arguments.push_back({arg.id, value});
+  }
+  std::sort(arguments.begin(), arguments.end());
+  nlohmann::json key = {sourceInfo.type, sourceInfo.tincId,
+                        sourceInfo.commandLineArguments, arguments};
+  return key.dump();
+}
+
+const std::vector<size_t> &
+CacheManager::entryIndexLookup(const std::string &key) {
+  static const std::vector<size_t> empty;
+  if (!mEntryIndexValid) {
+    mEntryIndex.clear();
+    for (size_t i = 0; i < mEntries.size(); i++) {
+      auto entryKeyString = entryKey(mEntries[i].sourceInfo);
+      if (entryKeyString.size() > 0) {
+        mEntryIndex[entryKeyString].push_back(i);
+      }
+    }
+    mEntryIndexValid = true;
+  }
+  auto it = mEntryIndex.find(key);
+  if (it == mEntryIndex.end()) {
+    return empty;
+  }
+  return it->second;
+}
+
+void CacheManager::setArgumentQuantization(const std::string &argumentId,
+                                           double step) {
   std::unique_lock<std::mutex> lk(mCacheLock);
-  mEntries.push_back(entry);
+  if (step > 0.0) {
+    mArgumentQuantization[argumentId] = step;
+  } else {
+    mArgumentQuantization.erase(argumentId);
+  }
+  mEntryIndexValid = false;
 }
 
 std::vector<std::string> CacheManager::findCache(const SourceInfo &sourceInfo,
                                                  bool verifyHash) {
+  auto startTime = std::chrono::steady_clock::now();
+  CacheEntry entry;
+  std::vector<std::string> filenames;
+  bool remoteHit = false;
+  if (findEntry(sourceInfo, entry, verifyHash)) {
+    filenames = entry.filenames;
+  } else {
+    std::function<std::vector<std::string>(const SourceInfo &)> remoteCache;
+    {
+      std::unique_lock<std::mutex> lk(mCacheLock);
+      remoteCache = mRemoteCache;
+    }
+    if (remoteCache) {
+      filenames = remoteCache(sourceInfo);
+    }
+    if (filenames.size() > 0) {
+      remoteHit = true;
+      std::unique_lock<std::mutex> lk(mCacheLock);
+      auto it = std::find_if(
+          mEntries.begin(), mEntries.end(),
+          [&](const CacheEntry &e) { return e.filenames == filenames; });
+      if (it != mEntries.end()) {
+        entry = *it;
+      }
+    }
+  }
+  double lookupTime = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - startTime)
+                          .count();
+
+  std::unique_lock<std::mutex> lk(mStatisticsLock);
+  mStatistics.lookups++;
+  mStatistics.lookupTimeTotal += lookupTime;
+  mStatistics.lookupTimeMax = std::max(mStatistics.lookupTimeMax, lookupTime);
+  if (filenames.size() > 0) {
+    mStatistics.hits++;
+    if (remoteHit) {
+      mStatistics.remoteHits++;
+    }
+    auto start = parseTimestamp(entry.timestampStart);
+    auto end = parseTimestamp(entry.timestampEnd);
+    if (start != 0 && end > start) {
+      mStatistics.computeTimeSaved += std::difftime(end, start);
+    }
+  } else {
+    mStatistics.misses++;
+  }
+  return filenames;
+}
+
+bool CacheManager::findEntry(const SourceInfo &sourceInfo, CacheEntry &entry,
+                             bool verifyHash) {
+  // Dependencies are verified without holding the lock, as verification may
+  // need to hash files. Entries that fail verification are marked stale, so
+  // the next iteration moves on to the next candidate.
+  while (true) {
+    CacheEntry candidate;
+    {
+      std::unique_lock<std::mutex> lk(mCacheLock);
+      auto key = entryKey(sourceInfo);
+      if (key.size() == 0) {
+        return false;
+      }
+      const auto &positions = entryIndexLookup(key);
+      auto position =
+          std::find_if(positions.begin(), positions.end(),
+                       [&](size_t i) { return !mEntries[i].stale; });
+      if (position == positions.end()) {
+        return false;
+      }
+      auto it = mEntries.begin() + *position;
+      if (!verifyHash) {
+        it->cacheHits++;
+        it->timestampLastAccess = currentTimestamp();
+        markChanged(*it);
+        entry = *it;
+        return true;
+      }
+      candidate = *it;
+    }
+    bool valid = dependenciesValid(candidate.sourceInfo, sourceInfo);
+
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    auto it = std::find_if(
+        mEntries.begin(), mEntries.end(), [&](const CacheEntry &e) {
+          return e.filenames == candidate.filenames &&
+                 e.timestampEnd == candidate.timestampEnd;
+        });
+    if (it == mEntries.end()) {
+      // Entry was removed while verifying
+      continue;
+    }
+    if (valid) {
+      it->cacheHits++;
+      it->timestampLastAccess = currentTimestamp();
+      markChanged(*it);
+      entry = *it;
+      return true;
+    }
+    if (mVerbose) {
+      std::cerr << "Cache entry is stale. Source or dependencies have changed."
+                << std::endl;
+    }
+    it->stale = true;
+    markChanged(*it);
+    std::unique_lock<std::mutex> statsLk(mStatisticsLock);
+    mStatistics.staleHits++;
+  }
+}
+
+void CacheManager::setRemoteCache(
+    std::function<std::vector<std::string>(const SourceInfo &)> fetch) {
   std::unique_lock<std::mutex> lk(mCacheLock);
-  for (const auto &entry : mEntries) {
-    if (entry.sourceInfo.commandLineArguments ==
-            sourceInfo.commandLineArguments &&
-        entry.sourceInfo.tincId == sourceInfo.tincId &&
-        entry.sourceInfo.type == sourceInfo.type) {
-      auto entryArguments = entry.sourceInfo.arguments;
-      bool argsMatch = false;
-      if (sourceInfo.arguments.size() == entry.sourceInfo.arguments.size()) {
-        size_t matchCount = 0;
-        for (const auto &sourceArg : sourceInfo.arguments) {
-          for (auto arg = entryArguments.begin(); arg != entryArguments.end();
-               arg++) {
-            if (sourceArg.id == arg->id) {
-              if (sourceArg.value.type == arg->value.type) {
-                if (sourceArg.value.type == VARIANT_DOUBLE ||
-                    sourceArg.value.type == VARIANT_FLOAT) {
-                  if (sourceArg.value.valueDouble == arg->value.valueDouble) {
-                    entryArguments.erase(arg);
-                    matchCount++;
-                    break;
-                  }
-                } else if (sourceArg.value.type == VARIANT_INT32 ||
-                           sourceArg.value.type == VARIANT_INT64) {
-                  if (sourceArg.value.valueInt64 == arg->value.valueInt64) {
-                    entryArguments.erase(arg);
-                    matchCount++;
-                    break;
-                  }
-                } else if (sourceArg.value.type == VARIANT_STRING) {
-                  if (sourceArg.value.valueStr == arg->value.valueStr) {
-                    entryArguments.erase(arg);
-                    matchCount++;
-                    break;
-                  }
-                } else {
-                  std::cerr << "ERROR: Unsupported type for argument value"
-                            << std::endl;
-                }
-              } else {
-                std::cout << "ERROR: type mismatch for argument in cache. "
-                             "Ignoring cache"
-                          << std::endl;
-                continue;
-              }
-            }
-          }
-        }
-        if (matchCount == sourceInfo.arguments.size() &&
-            entryArguments.size() == 0) {
-          return entry.filenames;
-        }
-      } else {
-        // TODO develop mechanisms to recover stale cache
-        std::cout << "Warning, cache entry found, but argument size mismatch"
-                  << std::endl;
+  mRemoteCache = fetch;
+}
+
+bool CacheManager::readStoredFile(const std::string &cacheFilename,
+                                  uint64_t offset, uint64_t maxBytes,
+                                  std::string &data) {
+  // Sizes come from remote nodes, so they can't choose how much to allocate
+  if (maxBytes > TINC_CACHE_MAX_READ_SIZE) {
+    std::cerr << "ERROR: Requested " << maxBytes
+              << " bytes from cache file. Maximum is "
+              << TINC_CACHE_MAX_READ_SIZE << std::endl;
+    return false;
+  }
+  std::string codec;
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    for (const auto &entry : mEntries) {
+      if (std::find(entry.filenames.begin(), entry.filenames.end(),
+                    cacheFilename) != entry.filenames.end()) {
+        codec = entry.codec;
+        break;
+      }
+    }
+  }
+  if (codec.size() == 0) {
+    return false;
+  }
+  std::ifstream f(cacheFilePath(cacheFilename, codec), std::ios::binary);
+  if (!f.good()) {
+    return false;
+  }
+  f.seekg(offset);
+  data.resize(maxBytes);
+  f.read(&data[0], maxBytes);
+  if (f.bad()) {
+    return false;
+  }
+  data.resize(f.gcount());
+  return true;
+}
+
+bool CacheManager::importEntry(
+    CacheEntry &entry,
+    std::function<bool(size_t index, std::ostream &out)> writeFile) {
+  for (size_t i = 0; i < entry.filenames.size(); i++) {
+    auto path = cacheFilePath(entry.filenames[i], entry.codec);
+    bool ok;
+    {
+      std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+      ok = out.good() && writeFile(i, out);
+      out.close();
+      ok = ok && out.good();
+    }
+    if (!ok || !replaceFile(path + ".tmp", path)) {
+      std::cerr << "ERROR importing cache file " << path << std::endl;
+      if (al::File::exists(path + ".tmp")) {
+        al::File::remove(path + ".tmp");
+      }
+      for (size_t j = 0; j < i; j++) {
+        al::File::remove(cacheFilePath(entry.filenames[j], entry.codec));
+      }
+      return false;
+    }
+  }
+  entry.size = computeEntrySize(entry);
+  entry.cacheHits = 0;
+  entry.stale = false;
+  entry.timestampLastAccess = currentTimestamp();
+  appendEntry(entry);
+  std::unique_lock<std::mutex> lk(mStatisticsLock);
+  mStatistics.bytesStored += entry.size;
+  return true;
+}
+
+bool CacheManager::dependenciesValid(const SourceInfo &entrySource,
+                                     const SourceInfo &sourceInfo) {
+  if (sourceInfo.hash.size() > 0 && sourceInfo.hash != entrySource.hash) {
+    return false;
+  }
+  // All requested dependencies must have been used to produce the entry
+  for (const auto &dep : sourceInfo.fileDependencies) {
+    auto path = DistributedPath(dep.file).filePath();
+    if (std::find_if(entrySource.fileDependencies.begin(),
+                     entrySource.fileDependencies.end(),
+                     [&](const FileDependency &entryDep) {
+                       return DistributedPath(entryDep.file).filePath() ==
+                              path;
+                     }) == entrySource.fileDependencies.end()) {
+      return false;
+    }
+  }
+  for (const auto &entryDep : entrySource.fileDependencies) {
+    if (entryDep.hash.size() == 0) {
+      return false;
+    }
+    auto path = DistributedPath(entryDep.file).filePath();
+    // Skip hashing when the file is known to be unchanged since it was hashed
+    struct stat s;
+    if (entryDep.modifiedNs != 0 && ::stat(path.c_str(), &s) == 0 &&
+        (uint64_t)s.st_ino == entryDep.inode &&
+        (uint64_t)s.st_size == entryDep.size &&
+        modifiedNs(s) == entryDep.modifiedNs) {
+      continue;
+    }
+    if (fileHash(path) != entryDep.hash) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CacheManager::storeFiles(const std::vector<std::string> &sourcePaths,
+                              CacheEntry &entry) {
+  if (sourcePaths.size() != entry.filenames.size()) {
+    std::cerr << "ERROR: number of files to store does not match entry"
+              << std::endl;
+    return false;
+  }
+  Codec codec;
+  int level;
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    codec = mCodec;
+    level = mCompressionLevel;
+  }
+  entry.codec = codec == CODEC_ZLIB ? "zlib" : "none";
+  entry.compressionLevel = codec == CODEC_ZLIB ? level : 0;
+  for (size_t i = 0; i < sourcePaths.size(); i++) {
+    auto path = cacheFilePath(entry.filenames[i], entry.codec);
+    if (!transcodeFile(sourcePaths[i], false, path + ".tmp",
+                       codec == CODEC_ZLIB, level) ||
+        !replaceFile(path + ".tmp", path)) {
+      std::cerr << "ERROR storing cache file " << path << std::endl;
+      if (al::File::exists(path + ".tmp")) {
+        al::File::remove(path + ".tmp");
+      }
+      // Don't leave partial entries in the cache directory
+      for (size_t j = 0; j < i; j++) {
+        al::File::remove(cacheFilePath(entry.filenames[j], entry.codec));
+      }
+      return false;
+    }
+  }
+  entry.size = computeEntrySize(entry);
+  for (size_t i = 0; i < sourcePaths.size(); i++) {
+    memoryTierInsert(entry.filenames[i], sourcePaths[i]);
+  }
+  std::unique_lock<std::mutex> lk(mStatisticsLock);
+  mStatistics.bytesStored += entry.size;
+  return true;
+}
+
+bool CacheManager::restoreFile(const std::string &cacheFilename,
+                               const std::string &destinationPath) {
+  std::string codec = "none";
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    for (const auto &entry : mEntries) {
+      if (std::find(entry.filenames.begin(), entry.filenames.end(),
+                    cacheFilename) != entry.filenames.end()) {
+        codec = entry.codec;
+        break;
+      }
+    }
+  }
+  auto bytes = memoryTierFind(cacheFilename);
+  if (bytes) {
+    bool restoreToMemory;
+    {
+      std::unique_lock<std::mutex> lk(mMemoryTierLock);
+      restoreToMemory = mRestoreToMemory;
+      if (restoreToMemory) {
+        mMemoryTierPaths[destinationPath] = {cacheFilename, bytes->size(), 0,
+                                             bytes};
       }
     }
+    if (restoreToMemory || memoryTierPathValid(destinationPath, cacheFilename)) {
+      // Destination already holds these bytes
+      std::unique_lock<std::mutex> lk(mStatisticsLock);
+      mStatistics.bytesRestored += bytes->size();
+      return true;
+    }
+    std::ofstream out(destinationPath + ".tmp",
+                      std::ios::binary | std::ios::trunc);
+    out.write(bytes->data(), bytes->size());
+    out.close();
+    if (out.good() && replaceFile(destinationPath + ".tmp", destinationPath)) {
+      memoryTierAddPath(destinationPath, cacheFilename);
+      std::unique_lock<std::mutex> lk(mStatisticsLock);
+      mStatistics.bytesRestored += bytes->size();
+      return true;
+    }
+    // Fall back to restoring from disk
+  }
+  if (!transcodeFile(cacheFilePath(cacheFilename, codec), codec == "zlib",
+                     destinationPath + ".tmp", false, 0) ||
+      !replaceFile(destinationPath + ".tmp", destinationPath)) {
+    if (al::File::exists(destinationPath + ".tmp")) {
+      al::File::remove(destinationPath + ".tmp");
+    }
+    return false;
+  }
+  memoryTierInsert(cacheFilename, destinationPath);
+  struct stat s;
+  if (::stat(destinationPath.c_str(), &s) == 0) {
+    std::unique_lock<std::mutex> lk(mStatisticsLock);
+    mStatistics.bytesRestored += s.st_size;
+  }
+  return true;
+}
+
+void CacheManager::setMemoryTierSize(uint64_t maxBytes) {
+  std::unique_lock<std::mutex> lk(mMemoryTierLock);
+  mMemoryTierMaxSize = maxBytes;
+  memoryTierTrim();
+}
+
+uint64_t CacheManager::memoryTierUsage() {
+  std::unique_lock<std::mutex> lk(mMemoryTierLock);
+  return mMemoryTierSize;
+}
+
+void CacheManager::setRestoreToMemory(bool enable) {
+  std::unique_lock<std::mutex> lk(mMemoryTierLock);
+  mRestoreToMemory = enable;
+}
+
+std::shared_ptr<const std::vector<char>>
+CacheManager::getFileBytes(const std::string &path) {
+  MemoryTierPath registered;
+  {
+    std::unique_lock<std::mutex> lk(mMemoryTierLock);
+    auto pathIt = mMemoryTierPaths.find(path);
+    if (pathIt == mMemoryTierPaths.end()) {
+      return nullptr;
+    }
+    if (pathIt->second.bytes) {
+      return pathIt->second.bytes;
+    }
+    registered = pathIt->second;
+  }
+  // The file may have been written outside the cache since it was
+  // registered. Query it without holding the lock.
+  struct stat s;
+  bool unchanged = ::stat(path.c_str(), &s) == 0 &&
+                   (uint64_t)s.st_size == registered.size &&
+                   modifiedNs(s) == registered.modifiedNs;
+  std::unique_lock<std::mutex> lk(mMemoryTierLock);
+  auto pathIt = mMemoryTierPaths.find(path);
+  if (pathIt == mMemoryTierPaths.end() ||
+      pathIt->second.cacheFilename != registered.cacheFilename ||
+      pathIt->second.modifiedNs != registered.modifiedNs) {
+    // Registration changed while unlocked
+    return nullptr;
+  }
+  if (!unchanged) {
+    mMemoryTierPaths.erase(pathIt);
+    return nullptr;
+  }
+  auto it = mMemoryTierIndex.find(registered.cacheFilename);
+  if (it == mMemoryTierIndex.end()) {
+    return nullptr;
+  }
+  // Move to front, as most recently used
+  mMemoryTier.splice(mMemoryTier.begin(), mMemoryTier, it->second);
+  return it->second->bytes;
+}
+
+std::shared_ptr<const std::vector<char>>
+CacheManager::getCacheFileBytes(const std::string &cacheFilename) {
+  return memoryTierFind(cacheFilename);
+}
+
+std::shared_ptr<const std::vector<char>>
+CacheManager::memoryTierFind(const std::string &cacheFilename) {
+  std::unique_lock<std::mutex> lk(mMemoryTierLock);
+  auto it = mMemoryTierIndex.find(cacheFilename);
+  if (it == mMemoryTierIndex.end()) {
+    return nullptr;
+  }
+  mMemoryTier.splice(mMemoryTier.begin(), mMemoryTier, it->second);
+  return it->second->bytes;
+}
+
+void CacheManager::memoryTierInsert(const std::string &cacheFilename,
+                                    const std::string &path) {
+  {
+    std::unique_lock<std::mutex> lk(mMemoryTierLock);
+    // The file at path has been written, so any previous registration is
+    // out of date
+    mMemoryTierPaths.erase(path);
+    if (mMemoryTierMaxSize == 0) {
+      return;
+    }
+  }
+  struct stat s;
+  if (::stat(path.c_str(), &s) != 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> lk(mMemoryTierLock);
+  if ((uint64_t)s.st_size > mMemoryTierMaxSize) {
+    return;
+  }
+  lk.unlock();
+  std::ifstream f(path, std::ios::binary);
+  auto bytes = std::make_shared<std::vector<char>>(s.st_size);
+  f.read(bytes->data(), bytes->size());
+  if (!f.good() || (uint64_t)f.gcount() != bytes->size()) {
+    return;
+  }
+  lk.lock();
+  memoryTierRemove(cacheFilename);
+  mMemoryTier.push_front({cacheFilename, bytes});
+  mMemoryTierIndex[cacheFilename] = mMemoryTier.begin();
+  mMemoryTierSize += bytes->size();
+  mMemoryTierPaths[path] = {cacheFilename, (uint64_t)s.st_size,
+                            modifiedNs(s), nullptr};
+  memoryTierTrim();
+}
+
+void CacheManager::memoryTierAddPath(const std::string &path,
+                                     const std::string &cacheFilename) {
+  struct stat s;
+  if (::stat(path.c_str(), &s) != 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> lk(mMemoryTierLock);
+  mMemoryTierPaths[path] = {cacheFilename, (uint64_t)s.st_size,
+                            modifiedNs(s), nullptr};
+}
+
+bool CacheManager::memoryTierPathValid(const std::string &path,
+                                       const std::string &cacheFilename) {
+  struct stat s;
+  if (::stat(path.c_str(), &s) != 0) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lk(mMemoryTierLock);
+  auto it = mMemoryTierPaths.find(path);
+  return it != mMemoryTierPaths.end() && !it->second.bytes &&
+         it->second.cacheFilename == cacheFilename &&
+         it->second.size == (uint64_t)s.st_size &&
+         it->second.modifiedNs == modifiedNs(s);
+}
+
+void CacheManager::memoryTierRemove(const std::string &cacheFilename) {
+  auto it = mMemoryTierIndex.find(cacheFilename);
+  if (it == mMemoryTierIndex.end()) {
+    return;
+  }
+  mMemoryTierSize -= std::min(mMemoryTierSize,
+                              (uint64_t)it->second->bytes->size());
+  mMemoryTier.erase(it->second);
+  mMemoryTierIndex.erase(it);
+  auto pathIt = mMemoryTierPaths.begin();
+  while (pathIt != mMemoryTierPaths.end()) {
+    if (pathIt->second.cacheFilename == cacheFilename &&
+        !pathIt->second.bytes) {
+      pathIt = mMemoryTierPaths.erase(pathIt);
+    } else {
+      pathIt++;
+    }
+  }
+}
+
+void CacheManager::memoryTierTrim() {
+  while (mMemoryTier.size() > 0 && mMemoryTierSize > mMemoryTierMaxSize) {
+    // Copy, as removing the item destroys its name
+    auto cacheFilename = mMemoryTier.back().cacheFilename;
+    memoryTierRemove(cacheFilename);
+  }
+}
+
+std::string CacheManager::fileHash(const std::string &path) {
+  struct stat s;
+  if (::stat(path.c_str(), &s) != 0) {
+    return std::string();
+  }
+  {
+    std::unique_lock<std::mutex> lk(mHashLock);
+    auto it = mHashCache.find(path);
+    if (it != mHashCache.end() && it->second.inode == (uint64_t)s.st_ino &&
+        it->second.size == (uint64_t)s.st_size &&
+        it->second.modifiedNs == modifiedNs(s)) {
+      return it->second.hash;
+    }
+  }
+  std::ifstream f(path, std::ios::binary);
+  if (!f.good()) {
+    return std::string();
+  }
+  picosha2::hash256_one_by_one hasher;
+  std::vector<char> buffer(TINC_CACHE_CHUNK_SIZE);
+  while (f.good()) {
+    f.read(buffer.data(), buffer.size());
+    hasher.process(buffer.begin(), buffer.begin() + f.gcount());
+  }
+  if (f.bad()) {
+    return std::string();
+  }
+  hasher.finish();
+  FileHashInfo info;
+  info.inode = s.st_ino;
+  info.size = s.st_size;
+  info.modifiedNs = modifiedNs(s);
+  info.hash = picosha2::get_hash_hex_string(hasher);
+  std::unique_lock<std::mutex> lk(mHashLock);
+  mHashCache[path] = info;
+  return info.hash;
+}
+
+bool CacheManager::updateFileDependency(FileDependency &dependency) {
+  auto path = dependency.file.filePath();
+  struct stat s;
+  if (::stat(path.c_str(), &s) != 0) {
+    return false;
+  }
+  std::time_t modified = s.st_mtime;
+  std::stringstream ss;
+  ss << std::put_time(std::localtime(&modified), "%FT%T%z");
+  dependency.modified = ss.str();
+  dependency.size = s.st_size;
+  dependency.inode = s.st_ino;
+  dependency.modifiedNs = modifiedNs(s);
+  dependency.hash = fileHash(path);
+  return dependency.hash.size() > 0;
+}
+
+CacheStatistics CacheManager::statistics() {
+  CacheStatistics stats;
+  {
+    std::unique_lock<std::mutex> lk(mStatisticsLock);
+    stats = mStatistics;
+  }
+  std::unique_lock<std::mutex> lk(mCacheLock);
+  stats.entries = mEntries.size();
+  stats.cacheSize = mCurrentSize;
+  return stats;
+}
+
+void CacheManager::resetStatistics() {
+  std::unique_lock<std::mutex> lk(mStatisticsLock);
+  mStatistics = CacheStatistics();
+}
+
+void CacheManager::clearCache() {
+  std::vector<CacheEntry> removedEntries;
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    // Include entries written by other processes sharing the cache
+    syncFromDisk();
+    for (const auto &entry : mEntries) {
+      mRemovedEntries.push_back({entry.filenames, entry.timestampEnd});
+    }
+    removedEntries = std::move(mEntries);
+    mEntries.clear();
+    mEntryIndexValid = false;
+    mCurrentSize = 0;
+    writeEntriesToDisk();
+  }
+  // Metadata no longer references the files, so they can be removed safely
+  for (const auto &entry : removedEntries) {
+    removeEntryFiles(entry);
+  }
+}
+
+void CacheManager::setMaxSize(uint64_t maxBytes) {
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    mMaxSize = maxBytes;
+  }
+  notifyMaintenance();
+}
+
+void CacheManager::setMaxEntries(size_t maxEntries) {
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    mMaxEntries = maxEntries;
+  }
+  notifyMaintenance();
+}
+
+void CacheManager::setEvictionPolicy(EvictionPolicy policy) {
+  std::unique_lock<std::mutex> lk(mCacheLock);
+  mEvictionPolicy = policy;
+}
+
+bool CacheManager::setCompression(Codec codec, int level, int coldLevel) {
+#ifndef TINC_HAS_ZLIB
+  if (codec == CODEC_ZLIB) {
+    std::cerr << "ERROR: TINC built without zlib. Cache compression not "
+                 "available"
+              << std::endl;
+    return false;
+  }
+#endif
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    mCodec = codec;
+    mCompressionLevel = level;
+    mColdCompressionLevel = std::max(level, coldLevel);
+  }
+  notifyMaintenance();
+  return true;
+}
+
+void CacheManager::setColdAge(std::chrono::seconds age) {
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    mColdAge = age;
   }
-  return {};
+  notifyMaintenance();
+}
+
+uint64_t CacheManager::cacheSize() {
+  std::unique_lock<std::mutex> lk(mCacheLock);
+  return mCurrentSize;
 }
 
 std::string CacheManager::cacheDirectory() { return mCachePath.path(); }
 
 void CacheManager::updateFromDisk() {
   std::unique_lock<std::mutex> lk(mCacheLock);
+  // Don't read while another process replaces the metadata file and empties
+  // the journal
+  CacheFileLock fileLock(mCachePath.filePath() + ".lock");
+  std::vector<CacheEntry> entries;
+  auto modified = metadataModifiedNs();
+  if (modified == 0) {
+    std::cerr << "Error attempting to read cache: " << mCachePath.filePath()
+              << std::endl;
+    return;
+  }
+  if (!readEntriesFromDisk(entries, mJournalOffset, mJournalRecords)) {
+    return;
+  }
+  mEntries = std::move(entries);
+  mEntryIndexValid = false;
+  mCurrentSize = 0;
+  mSyncedEntries.clear();
+  for (const auto &e : mEntries) {
+    mCurrentSize += e.size;
+    mSyncedEntries[entryFilesKey(e.filenames)] = e.timestampEnd;
+  }
+  mChangedEntries.clear();
+  mRemovedEntries.clear();
+  mMetadataDirty = false;
+  mMetadataModifiedNs = modified;
+}
 
-  //  j["tincMetaVersionMajor"] = TINC_META_VERSION_MAJOR;
-  //  j["tincMetaVersionMinor"] = TINC_META_VERSION_MINOR;
-  //  j["entries"] = {};
-  std::ifstream f(mCachePath.filePath());
-  if (f.good()) {
-    nlohmann::json j;
-    f >> j;
-    try {
-      mValidator.validate(j);
-    } catch (const std::exception &e) {
-      std::cerr << "Validation failed, here is why: " << e.what() << std::endl;
-      return;
+bool CacheManager::parseEntries(nlohmann::json &j,
+                                std::vector<CacheEntry> &entries) {
+  try {
+    mValidator.validate(j);
+  } catch (const std::exception &e) {
+    std::cerr << "Validation failed, here is why: " << e.what() << std::endl;
+    return false;
+  }
+  // Minor versions only add optional fields, so older minor versions can be
+  // read.
+  if (j["tincMetaVersionMajor"] != TINC_META_VERSION_MAJOR ||
+      j["tincMetaVersionMinor"] > TINC_META_VERSION_MINOR) {
+
+    std::cerr << "Incompatible schema version: " << j["tincMetaVersionMajor"]
+              << "." << j["tincMetaVersionMinor"] << " .This binary uses "
+              << TINC_META_VERSION_MAJOR << "." << TINC_META_VERSION_MINOR
+              << "\n";
+    return false;
+  }
+  for (auto entry : j["entries"]) {
+    entries.push_back(entryFromJson(entry));
+  }
+  return true;
+}
+
+CacheEntry CacheManager::entryFromJson(const nlohmann::json &entry) {
+  CacheEntry e;
+  e.timestampStart = entry["timestamp"]["start"];
+  e.timestampEnd = entry["timestamp"]["end"];
+  if (entry["timestamp"].find("lastAccess") != entry["timestamp"].end()) {
+    e.timestampLastAccess = entry["timestamp"]["lastAccess"];
+  } else {
+    e.timestampLastAccess = e.timestampEnd;
+  }
+  e.filenames = entry["filenames"].get<std::vector<std::string>>();
+
+  e.cacheHits = entry["cacheHits"];
+  e.stale = entry["stale"];
+  if (entry.find("codec") != entry.end()) {
+    e.codec = entry["codec"];
+    e.compressionLevel = entry["compressionLevel"];
+  }
+  if (entry.find("size") != entry.end()) {
+    e.size = entry["size"];
+  } else {
+    e.size = computeEntrySize(e);
+  }
+
+  e.userInfo.userName = entry["userInfo"]["userName"];
+  e.userInfo.userHash = entry["userInfo"]["userHash"];
+  e.userInfo.ip = entry["userInfo"]["ip"];
+  e.userInfo.port = entry["userInfo"]["port"];
+  e.userInfo.server = entry["userInfo"]["server"];
+
+  e.sourceInfo = sourceInfoFromJson(entry["sourceInfo"]);
+  return e;
+}
+
+SourceInfo CacheManager::sourceInfoFromJson(const nlohmann::json &json) {
+  SourceInfo sourceInfo;
+  sourceInfo.type = json["type"];
+  sourceInfo.tincId = json["tincId"];
+  sourceInfo.commandLineArguments = json["commandLineArguments"];
+
+  sourceInfo.workingPath.relativePath = json["workingPath"]["relativePath"];
+  sourceInfo.workingPath.rootPath = json["workingPath"]["rootPath"];
+  sourceInfo.hash = json["hash"];
+
+  for (auto arg : json["arguments"]) {
+    SourceArgument newArg;
+    newArg.id = arg["id"];
+    if (arg["value"].is_number_float()) {
+      newArg.value = arg["value"].get<double>();
+    } else if (arg["value"].is_number_integer()) {
+      newArg.value = arg["value"].get<int64_t>();
+    } else if (arg["value"].is_string()) {
+      newArg.value = arg["value"].get<std::string>();
+    }
+    sourceInfo.arguments.push_back(newArg);
+  }
+  for (auto arg : json["dependencies"]) {
+    SourceArgument newArg;
+    newArg.id = arg["id"];
+    if (arg["value"].is_number_float()) {
+      newArg.value = arg["value"].get<double>();
+    } else if (arg["value"].is_number_integer()) {
+      newArg.value = arg["value"].get<int64_t>();
+    } else if (arg["value"].is_string()) {
+      newArg.value = arg["value"].get<std::string>();
+    }
+    sourceInfo.dependencies.push_back(newArg);
+  }
+  for (auto arg : json["fileDependencies"]) {
+    FileDependency newArg;
+    newArg.file = DistributedPath(arg["file"]["filename"],
+                                  arg["file"]["relativePath"],
+                                  arg["file"]["rootPath"]);
+    newArg.modified = arg["modified"];
+    newArg.size = arg["size"];
+    if (arg.find("hash") != arg.end()) {
+      newArg.hash = arg["hash"];
     }
-    if (j["tincMetaVersionMajor"] != TINC_META_VERSION_MAJOR ||
-        j["tincMetaVersionMinor"] != TINC_META_VERSION_MINOR) {
+    if (arg.find("inode") != arg.end()) {
+      newArg.inode = arg["inode"];
+    }
+    if (arg.find("modifiedNs") != arg.end()) {
+      newArg.modifiedNs = arg["modifiedNs"];
+    }
+    sourceInfo.fileDependencies.push_back(newArg);
+  }
+  return sourceInfo;
+}
 
-      std::cerr << "Incompatible schema version: " << j["tincMetaVersionMajor"]
-                << "." << j["tincMetaVersionMinor"] << " .This binary uses "
-                << TINC_META_VERSION_MAJOR << "." << TINC_META_VERSION_MINOR
-                << "\n";
-      return;
+nlohmann::json CacheManager::entryToJson(const CacheEntry &e) {
+  nlohmann::json entry;
+  entry["timestamp"]["start"] = e.timestampStart;
+  entry["timestamp"]["end"] = e.timestampEnd;
+  entry["timestamp"]["lastAccess"] = e.timestampLastAccess;
+  entry["filenames"] = e.filenames;
+
+  entry["cacheHits"] = e.cacheHits;
+  entry["size"] = e.size;
+  entry["stale"] = e.stale;
+  entry["codec"] = e.codec;
+  entry["compressionLevel"] = e.compressionLevel;
+
+  entry["userInfo"]["userName"] = e.userInfo.userName;
+  entry["userInfo"]["userHash"] = e.userInfo.userHash;
+  entry["userInfo"]["ip"] = e.userInfo.ip;
+  entry["userInfo"]["port"] = e.userInfo.port;
+  entry["userInfo"]["server"] = e.userInfo.server;
+
+  entry["sourceInfo"] = sourceInfoToJson(e.sourceInfo);
+  return entry;
+}
+
+nlohmann::json CacheManager::sourceInfoToJson(const SourceInfo &sourceInfo) {
+  nlohmann::json json;
+  json["type"] = sourceInfo.type;
+  json["tincId"] = sourceInfo.tincId;
+  json["commandLineArguments"] = sourceInfo.commandLineArguments;
+
+  // TODO validate working path
+  json["workingPath"]["relativePath"] = sourceInfo.workingPath.relativePath;
+  json["workingPath"]["rootPath"] = sourceInfo.workingPath.rootPath;
+  json["hash"] = sourceInfo.hash;
+  json["arguments"] = std::vector<nlohmann::json>();
+  json["dependencies"] = std::vector<nlohmann::json>();
+  json["fileDependencies"] = std::vector<nlohmann::json>();
+  for (auto arg : sourceInfo.arguments) {
+    nlohmann::json newArg;
+    newArg["id"] = arg.id;
+    if (arg.value.type == VARIANT_DOUBLE || arg.value.type == VARIANT_FLOAT) {
+      newArg["value"] = arg.value.valueDouble;
+    } else if (arg.value.type == VARIANT_INT32 ||
+               arg.value.type == VARIANT_INT64) {
+      newArg["value"] = arg.value.valueInt64;
+    } else if (arg.value.type == VARIANT_STRING) {
+      newArg["value"] = arg.value.valueStr;
+    } else {
+      newArg["value"] = nlohmann::json();
     }
-    mEntries.clear();
-    for (auto entry : j["entries"]) {
-      CacheEntry e;
-      e.timestampStart = entry["timestamp"]["start"];
-      e.timestampEnd = entry["timestamp"]["end"];
-      e.filenames = entry["filenames"].get<std::vector<std::string>>();
-
-      e.cacheHits = entry["cacheHits"];
-      e.stale = entry["stale"];
-
-      e.userInfo.userName = entry["userInfo"]["userName"];
-      e.userInfo.userHash = entry["userInfo"]["userHash"];
-      e.userInfo.ip = entry["userInfo"]["ip"];
-      e.userInfo.port = entry["userInfo"]["port"];
-      e.userInfo.server = entry["userInfo"]["server"];
-
-      e.sourceInfo.type = entry["sourceInfo"]["type"];
-      e.sourceInfo.tincId = entry["sourceInfo"]["tincId"];
-      e.sourceInfo.commandLineArguments =
-          entry["sourceInfo"]["commandLineArguments"];
-
-      e.sourceInfo.workingPath.relativePath =
-          entry["sourceInfo"]["workingPath"]["relativePath"];
-      e.sourceInfo.workingPath.rootPath =
-          entry["sourceInfo"]["workingPath"]["rootPath"];
-      e.sourceInfo.hash = entry["sourceInfo"]["hash"];
-
-      for (auto arg : entry["sourceInfo"]["arguments"]) {
-        SourceArgument newArg;
-        newArg.id = arg["id"];
-        if (arg["value"].is_number_float()) {
-          newArg.value = arg["value"].get<double>();
-        } else if (arg["value"].is_number_integer()) {
-          newArg.value = arg["value"].get<int64_t>();
-        } else if (arg["value"].is_string()) {
-          newArg.value = arg["value"].get<std::string>();
+    json["arguments"].push_back(newArg);
+  }
+  for (auto arg : sourceInfo.dependencies) {
+    nlohmann::json newArg;
+    newArg["id"] = arg.id;
+    if (arg.value.type == VARIANT_DOUBLE || arg.value.type == VARIANT_FLOAT) {
+      newArg["value"] = arg.value.valueDouble;
+    } else if (arg.value.type == VARIANT_INT32 ||
+               arg.value.type == VARIANT_INT64) {
+      newArg["value"] = arg.value.valueInt64;
+    } else if (arg.value.type == VARIANT_STRING) {
+      newArg["value"] = arg.value.valueStr;
+    } else {
+      newArg["value"] = nlohmann::json();
+    }
+    json["dependencies"].push_back(newArg);
+  }
+  for (auto arg : sourceInfo.fileDependencies) {
+    nlohmann::json newArg;
+    newArg["file"]["filename"] = arg.file.filename;
+    newArg["file"]["relativePath"] = arg.file.relativePath;
+    newArg["file"]["rootPath"] = arg.file.rootPath;
+    newArg["modified"] = arg.modified;
+    newArg["size"] = arg.size;
+    newArg["hash"] = arg.hash;
+    newArg["inode"] = arg.inode;
+    newArg["modifiedNs"] = arg.modifiedNs;
+    json["fileDependencies"].push_back(newArg);
+  }
+  return json;
+}
+
+std::string CacheManager::journalPath() {
+  return mCachePath.filePath() + ".journal";
+}
+
+void CacheManager::markChanged(const CacheEntry &entry) {
+  mChangedEntries.insert(entryFilesKey(entry.filenames));
+  mMetadataDirty = true;
+}
+
+bool CacheManager::readEntriesFromDisk(std::vector<CacheEntry> &entries,
+                                       uint64_t &journalOffset,
+                                       size_t &journalRecords) {
+  std::ifstream f(mCachePath.filePath());
+  if (!f.good()) {
+    return false;
+  }
+  nlohmann::json j;
+  f >> j;
+  if (!parseEntries(j, entries)) {
+    return false;
+  }
+  std::vector<nlohmann::json> records;
+  journalOffset = readJournal(journalPath(), 0, records);
+  journalRecords = records.size();
+  if (records.size() == 0) {
+    return true;
+  }
+  std::unordered_map<std::string, size_t> positions;
+  for (size_t i = 0; i < entries.size(); i++) {
+    positions[entryFilesKey(entries[i].filenames)] = i;
+  }
+  std::vector<bool> removed(entries.size(), false);
+  for (const auto &record : records) {
+    try {
+      if (record.find("entry") != record.end()) {
+        auto entry = entryFromJson(record["entry"]);
+        auto key = entryFilesKey(entry.filenames);
+        auto position = positions.find(key);
+        if (position == positions.end()) {
+          positions[key] = entries.size();
+          entries.push_back(entry);
+          removed.push_back(false);
+        } else {
+          entries[position->second] = entry;
         }
-        e.sourceInfo.arguments.push_back(newArg);
-      }
-      for (auto arg : entry["sourceInfo"]["dependencies"]) {
-        SourceArgument newArg;
-        newArg.id = arg["id"];
-        if (arg["value"].is_number_float()) {
-          newArg.value = arg["value"].get<double>();
-        } else if (arg["value"].is_number_integer()) {
-          newArg.value = arg["value"].get<int64_t>();
-        } else if (arg["value"].is_string()) {
-          newArg.value = arg["value"].get<std::string>();
+      } else if (record.find("removed") != record.end()) {
+        auto key = entryFilesKey(record["removed"]["filenames"]);
+        auto position = positions.find(key);
+        if (position != positions.end() &&
+            entries[position->second].timestampEnd ==
+                record["removed"]["timestampEnd"]) {
+          removed[position->second] = true;
+          positions.erase(position);
         }
-        e.sourceInfo.dependencies.push_back(newArg);
       }
-      for (auto arg : entry["sourceInfo"]["fileDependencies"]) {
-        DistributedPath newArg(arg["filename"], arg["relativePath"],
-                               arg["rootPath"]);
-        e.sourceInfo.fileDependencies.push_back(newArg);
+    } catch (std::exception &e) {
+      std::cerr << "ERROR reading cache journal record: " << e.what()
+                << std::endl;
+    }
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (!removed[i]) {
+      if (count != i) {
+        entries[count] = std::move(entries[i]);
       }
-      mEntries.push_back(e);
+      count++;
     }
+  }
+  entries.resize(count);
+  return true;
+}
 
+void CacheManager::mergeEntry(
+    const CacheEntry &diskEntry,
+    std::unordered_map<std::string, size_t> &positions) {
+  auto key = entryFilesKey(diskEntry.filenames);
+  auto position = positions.find(key);
+  if (position == positions.end()) {
+    mCurrentSize += diskEntry.size;
+    positions[key] = mEntries.size();
+    mEntries.push_back(diskEntry);
+    return;
+  }
+  auto it = mEntries.begin() + position->second;
+  if (it->timestampEnd != diskEntry.timestampEnd) {
+    // Files were recomputed. The most recent computation wrote the files.
+    if (parseTimestamp(diskEntry.timestampEnd) >
+        parseTimestamp(it->timestampEnd)) {
+      mCurrentSize -= std::min(mCurrentSize, it->size);
+      mCurrentSize += diskEntry.size;
+      *it = diskEntry;
+    }
   } else {
-    std::cerr << "Error attempting to read cache: " << mCachePath.filePath()
-              << std::endl;
+    // Same entry seen by both processes
+    it->cacheHits = std::max(it->cacheHits, diskEntry.cacheHits);
+    it->timestampLastAccess =
+        std::max(it->timestampLastAccess, diskEntry.timestampLastAccess);
+    it->stale = it->stale || diskEntry.stale;
+    // Recompression only raises the compression level
+    if (diskEntry.compressionLevel > it->compressionLevel) {
+      it->codec = diskEntry.codec;
+      it->compressionLevel = diskEntry.compressionLevel;
+      mCurrentSize -= std::min(mCurrentSize, it->size);
+      it->size = diskEntry.size;
+      mCurrentSize += it->size;
+    }
   }
 }
 
-// when creating the validator
+// Set of removed entries keyed by files and end timestamp
+static std::unordered_set<std::string> removedKeys(
+    const std::vector<std::pair<std::vector<std::string>, std::string>>
+        &removedEntries) {
+  std::unordered_set<std::string> keys;
+  for (const auto &removed : removedEntries) {
+    keys.insert(entryFilesKey(removed.first) + removed.second);
+  }
+  return keys;
+}
 
-void CacheManager::writeToDisk() {
-  std::unique_lock<std::mutex> lk(mCacheLock);
-  std::ofstream o(mCachePath.filePath());
-  if (o.good()) {
-    nlohmann::json j;
-    j["tincMetaVersionMajor"] = TINC_META_VERSION_MAJOR;
-    j["tincMetaVersionMinor"] = TINC_META_VERSION_MINOR;
-    j["entries"] = std::vector<nlohmann::json>();
-
-    for (auto &e : mEntries) {
-      nlohmann::json entry;
-      entry["timestamp"]["start"] = e.timestampStart;
-      entry["timestamp"]["end"] = e.timestampEnd;
-      entry["filenames"] = e.filenames;
-
-      entry["cacheHits"] = e.cacheHits;
-      entry["stale"] = e.stale;
-
-      entry["userInfo"]["userName"] = e.userInfo.userName;
-      entry["userInfo"]["userHash"] = e.userInfo.userHash;
-      entry["userInfo"]["ip"] = e.userInfo.ip;
-      entry["userInfo"]["port"] = e.userInfo.port;
-      entry["userInfo"]["server"] = e.userInfo.server;
-
-      entry["sourceInfo"]["type"] = e.sourceInfo.type;
-      entry["sourceInfo"]["tincId"] = e.sourceInfo.tincId;
-      entry["sourceInfo"]["commandLineArguments"] =
-          e.sourceInfo.commandLineArguments;
-
-      // TODO validate working path
-      entry["sourceInfo"]["workingPath"]["relativePath"] =
-          e.sourceInfo.workingPath.relativePath;
-      entry["sourceInfo"]["workingPath"]["rootPath"] =
-          e.sourceInfo.workingPath.rootPath;
-      entry["sourceInfo"]["hash"] = e.sourceInfo.hash;
-      entry["sourceInfo"]["arguments"] = std::vector<nlohmann::json>();
-      entry["sourceInfo"]["dependencies"] = std::vector<nlohmann::json>();
-      entry["sourceInfo"]["fileDependencies"] = std::vector<nlohmann::json>();
-      for (auto arg : e.sourceInfo.arguments) {
-        nlohmann::json newArg;
-        newArg["id"] = arg.id;
-        if (arg.value.type == VARIANT_DOUBLE ||
-            arg.value.type == VARIANT_FLOAT) {
-          newArg["value"] = arg.value.valueDouble;
-        } else if (arg.value.type == VARIANT_INT32 ||
-                   arg.value.type == VARIANT_INT64) {
-          newArg["value"] = arg.value.valueInt64;
-        } else if (arg.value.type == VARIANT_STRING) {
-          newArg["value"] = arg.value.valueStr;
-        } else {
-          newArg["value"] = nlohmann::json();
+void CacheManager::mergeEntries(const std::vector<CacheEntry> &diskEntries) {
+  mEntryIndexValid = false;
+  auto removed = removedKeys(mRemovedEntries);
+  std::unordered_map<std::string, size_t> positions;
+  for (size_t i = 0; i < mEntries.size(); i++) {
+    positions[entryFilesKey(mEntries[i].filenames)] = i;
+  }
+  std::unordered_set<std::string> onDisk;
+  for (const auto &diskEntry : diskEntries) {
+    auto key = entryFilesKey(diskEntry.filenames);
+    onDisk.insert(key);
+    if (removed.find(key + diskEntry.timestampEnd) != removed.end()) {
+      // Removed by this process since last write
+      continue;
+    }
+    mergeEntry(diskEntry, positions);
+  }
+  // Entries not on disk are either new in this process or have been removed
+  // by another process, if they were on disk when last synchronized.
+  auto it = mEntries.begin();
+  while (it != mEntries.end()) {
+    auto key = entryFilesKey(it->filenames);
+    auto synced = mSyncedEntries.find(key);
+    bool wasOnDisk = synced != mSyncedEntries.end() &&
+                     synced->second == it->timestampEnd;
+    if (onDisk.find(key) == onDisk.end() && wasOnDisk) {
+      mCurrentSize -= std::min(mCurrentSize, it->size);
+      it = mEntries.erase(it);
+    } else {
+      it++;
+    }
+  }
+  mSyncedEntries.clear();
+  for (const auto &e : diskEntries) {
+    mSyncedEntries[entryFilesKey(e.filenames)] = e.timestampEnd;
+  }
+}
+
+void CacheManager::mergeJournalRecords(
+    const std::vector<nlohmann::json> &records) {
+  mEntryIndexValid = false;
+  auto removed = removedKeys(mRemovedEntries);
+  std::unordered_map<std::string, size_t> positions;
+  for (size_t i = 0; i < mEntries.size(); i++) {
+    positions[entryFilesKey(mEntries[i].filenames)] = i;
+  }
+  std::vector<bool> erased(mEntries.size(), false);
+  for (const auto &record : records) {
+    try {
+      if (record.find("entry") != record.end()) {
+        auto diskEntry = entryFromJson(record["entry"]);
+        auto key = entryFilesKey(diskEntry.filenames);
+        mSyncedEntries[key] = diskEntry.timestampEnd;
+        if (removed.find(key + diskEntry.timestampEnd) != removed.end()) {
+          // Removed by this process since last write
+          continue;
         }
-        entry["sourceInfo"]["arguments"].push_back(newArg);
-      }
-      for (auto arg : e.sourceInfo.dependencies) {
-        nlohmann::json newArg;
-        newArg["id"] = arg.id;
-        if (arg.value.type == VARIANT_DOUBLE ||
-            arg.value.type == VARIANT_FLOAT) {
-          newArg["value"] = arg.value.valueDouble;
-        } else if (arg.value.type == VARIANT_INT32 ||
-                   arg.value.type == VARIANT_INT64) {
-          newArg["value"] = arg.value.valueInt64;
-        } else if (arg.value.type == VARIANT_STRING) {
-          newArg["value"] = arg.value.valueStr;
-        } else {
-          newArg["value"] = nlohmann::json();
+        mergeEntry(diskEntry, positions);
+        erased.resize(mEntries.size(), false);
+      } else if (record.find("removed") != record.end()) {
+        auto key = entryFilesKey(record["removed"]["filenames"]);
+        std::string timestampEnd = record["removed"]["timestampEnd"];
+        auto synced = mSyncedEntries.find(key);
+        if (synced != mSyncedEntries.end() &&
+            synced->second == timestampEnd) {
+          mSyncedEntries.erase(synced);
+        }
+        // Removed by another process. Entries with other end timestamps
+        // belong to other computations of the files.
+        auto position = positions.find(key);
+        if (position != positions.end() &&
+            mEntries[position->second].timestampEnd == timestampEnd) {
+          auto &entry = mEntries[position->second];
+          mCurrentSize -= std::min(mCurrentSize, entry.size);
+          erased[position->second] = true;
+          positions.erase(position);
         }
-        entry["sourceInfo"]["dependencies"].push_back(newArg);
       }
-      for (auto arg : e.sourceInfo.fileDependencies) {
-        nlohmann::json newArg;
-        newArg["fileName"] = arg.filename;
-        newArg["relativePath"] = arg.relativePath;
-        newArg["rootPath"] = arg.rootPath;
-        entry["sourceInfo"]["fileDependencies"].push_back(newArg);
+    } catch (std::exception &e) {
+      std::cerr << "ERROR reading cache journal record: " << e.what()
+                << std::endl;
+    }
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < mEntries.size(); i++) {
+    if (!erased[i]) {
+      if (count != i) {
+        mEntries[count] = std::move(mEntries[i]);
       }
+      count++;
+    }
+  }
+  mEntries.resize(count);
+}
 
-      j["entries"].push_back(entry);
+bool CacheManager::syncFromDisk() {
+  auto modified = metadataModifiedNs();
+  if (modified == 0) {
+    return false;
+  }
+  auto journalSize = fileSize(journalPath());
+  try {
+    if (modified != mMetadataModifiedNs || journalSize < mJournalOffset) {
+      // Metadata file has been replaced
+      std::vector<CacheEntry> diskEntries;
+      if (!readEntriesFromDisk(diskEntries, mJournalOffset,
+                               mJournalRecords)) {
+        return true;
+      }
+      mergeEntries(diskEntries);
+      mMetadataModifiedNs = modified;
+    } else if (journalSize > mJournalOffset) {
+      std::vector<nlohmann::json> records;
+      mJournalOffset = readJournal(journalPath(), mJournalOffset, records);
+      mJournalRecords += records.size();
+      mergeJournalRecords(records);
     }
-    o << j << std::endl;
+  } catch (std::exception &e) {
+    std::cerr << "ERROR parsing cache metadata: " << e.what() << std::endl;
+  }
+  return true;
+}
+
+int64_t CacheManager::metadataModifiedNs() {
+  struct stat s;
+  if (::stat(mCachePath.filePath().c_str(), &s) == 0) {
+    return modifiedNs(s);
+  }
+  return 0;
+}
+
+nlohmann::json CacheManager::metadataJson() {
+  nlohmann::json j;
+  j["tincMetaVersionMajor"] = TINC_META_VERSION_MAJOR;
+  j["tincMetaVersionMinor"] = TINC_META_VERSION_MINOR;
+  j["entries"] = std::vector<nlohmann::json>();
+
+  for (auto &e : mEntries) {
+    j["entries"].push_back(entryToJson(e));
+  }
+  return j;
+}
+
+void CacheManager::writeToDisk() {
+  std::unique_lock<std::mutex> lk(mCacheLock);
+  writeEntriesToDisk();
+}
+
+void CacheManager::writeEntriesToDisk() {
+  // Other processes may have written entries since we last read the
+  // metadata. Merge them while holding the lock, so no entries are lost.
+  CacheFileLock fileLock(mCachePath.filePath() + ".lock");
+  if (!fileLock.locked()) {
+    std::cerr << "Warning: could not lock cache metadata. Concurrent writers "
+                 "may lose entries."
+              << std::endl;
+  }
+  bool metadataExists = syncFromDisk();
+  // Replacing the metadata file costs as much as all entries, so it is done
+  // once the journal holds as many records
+  size_t changes = mChangedEntries.size() + mRemovedEntries.size();
+  if (!metadataExists ||
+      mJournalRecords + changes >
+          std::max<size_t>(TINC_CACHE_JOURNAL_MIN_RECORDS, mEntries.size())) {
+    writeMetadataFile();
+  } else if (changes > 0) {
+    appendJournal();
+  }
+  mChangedEntries.clear();
+  mRemovedEntries.clear();
+  mMetadataDirty = false;
+}
+
+void CacheManager::writeMetadataFile() {
+  // Readers don't take the lock, so the metadata file is replaced atomically
+  std::string tempPath = mCachePath.filePath() + ".tmp";
+  std::ofstream o(tempPath);
+  if (o.good()) {
+    o << metadataJson() << std::endl;
     o.close();
+    if (!o.good() || !replaceFile(tempPath, mCachePath.filePath())) {
+      std::cerr << "ERROR: Can't write cache file: " << mCachePath.filePath()
+                << std::endl;
+      throw std::runtime_error("Can't write cache file");
+    }
+    if (al::File::exists(journalPath())) {
+      al::File::remove(journalPath());
+    }
+    mJournalOffset = 0;
+    mJournalRecords = 0;
+    mMetadataModifiedNs = metadataModifiedNs();
+    mSyncedEntries.clear();
+    for (const auto &e : mEntries) {
+      mSyncedEntries[entryFilesKey(e.filenames)] = e.timestampEnd;
+    }
   } else {
     std::cerr << "ERROR: Can't create cache file: " << mCachePath.filePath()
               << std::endl;
@@ -303,14 +1659,452 @@ void CacheManager::writeToDisk() {
   }
 }
 
+void CacheManager::appendJournal() {
+  std::vector<nlohmann::json> records;
+  // Removals first, as an entry may replace a removed entry with the same
+  // files
+  for (const auto &removed : mRemovedEntries) {
+    records.push_back({{"removed",
+                        {{"filenames", removed.first},
+                         {"timestampEnd", removed.second}}}});
+  }
+  for (const auto &e : mEntries) {
+    if (mChangedEntries.find(entryFilesKey(e.filenames)) !=
+        mChangedEntries.end()) {
+      records.push_back({{"entry", entryToJson(e)}});
+    }
+  }
+  std::ofstream o(journalPath(), std::ios::app | std::ios::binary);
+  for (const auto &record : records) {
+    o << record.dump() << '\n';
+  }
+  o.close();
+  if (!o.good()) {
+    std::cerr << "ERROR: Can't write cache journal: " << journalPath()
+              << std::endl;
+    throw std::runtime_error("Can't write cache journal");
+  }
+  mJournalOffset = fileSize(journalPath());
+  mJournalRecords += records.size();
+  for (const auto &removed : mRemovedEntries) {
+    auto synced = mSyncedEntries.find(entryFilesKey(removed.first));
+    if (synced != mSyncedEntries.end() && synced->second == removed.second) {
+      mSyncedEntries.erase(synced);
+    }
+  }
+  for (const auto &e : mEntries) {
+    auto key = entryFilesKey(e.filenames);
+    if (mChangedEntries.find(key) != mChangedEntries.end()) {
+      mSyncedEntries[key] = e.timestampEnd;
+    }
+  }
+}
+
 std::string CacheManager::dump() {
-  writeToDisk();
   std::unique_lock<std::mutex> lk(mCacheLock);
-  std::ifstream f(mCachePath.filePath());
-  std::stringstream ss;
+  writeEntriesToDisk();
+  // Entries are now the same as in the metadata file and journal
+  return metadataJson().dump() + "\n";
+}
 
-  ss << f.rdbuf();
-  return ss.str();
+void CacheManager::startMaintenance() {
+  std::unique_lock<std::mutex> lk(mMaintenanceLock);
+  if (mMaintenanceThread) {
+    return;
+  }
+  mMaintenanceRunning = true;
+  mMaintenanceThread = std::make_unique<std::thread>([this]() {
+    std::unique_lock<std::mutex> lk(mMaintenanceLock);
+    while (mMaintenanceRunning) {
+      mMaintenanceSignal.wait_for(lk, mMaintenanceInterval, [this]() {
+        return mMaintenanceRequested || !mMaintenanceRunning;
+      });
+      if (!mMaintenanceRunning) {
+        break;
+      }
+      mMaintenanceRequested = false;
+      lk.unlock();
+      while (mMaintenanceRunning && evictionStep()) {
+        // Give lookups a chance to take the cache lock between batches
+        std::this_thread::yield();
+      }
+      while (mMaintenanceRunning && recompressionStep()) {
+        std::this_thread::yield();
+      }
+      if (garbageCollectionDue()) {
+        size_t collected = 0;
+        while (mMaintenanceRunning && garbageCollectionStep(collected)) {
+          std::this_thread::yield();
+        }
+      }
+      {
+        std::unique_lock<std::mutex> cacheLk(mCacheLock);
+        if (mMetadataDirty) {
+          try {
+            writeEntriesToDisk();
+          } catch (std::exception &e) {
+            std::cerr << "ERROR writing cache metadata" << std::endl;
+          }
+        } else if (metadataModifiedNs() != mMetadataModifiedNs ||
+                   fileSize(journalPath()) != mJournalOffset) {
+          // Pick up entries written by other processes
+          CacheFileLock fileLock(mCachePath.filePath() + ".lock");
+          syncFromDisk();
+        }
+      }
+      lk.lock();
+    }
+  });
+}
+
+void CacheManager::stopMaintenance() {
+  {
+    std::unique_lock<std::mutex> lk(mMaintenanceLock);
+    mMaintenanceRunning = false;
+    mMaintenanceSignal.notify_all();
+  }
+  if (mMaintenanceThread) {
+    mMaintenanceThread->join();
+    mMaintenanceThread = nullptr;
+  }
+}
+
+void CacheManager::notifyMaintenance() {
+  std::unique_lock<std::mutex> lk(mMaintenanceLock);
+  mMaintenanceRequested = true;
+  mMaintenanceSignal.notify_all();
+}
+
+bool CacheManager::evictionStep() {
+  std::vector<CacheEntry> evicted;
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    while (evicted.size() < mEvictionBatchSize && overBudget()) {
+      auto index = selectEvictionCandidate();
+      mCurrentSize -= std::min(mCurrentSize, mEntries[index].size);
+      mRemovedEntries.push_back(
+          {mEntries[index].filenames, mEntries[index].timestampEnd});
+      evicted.push_back(std::move(mEntries[index]));
+      mEntries.erase(mEntries.begin() + index);
+      mEntryIndexValid = false;
+    }
+    if (evicted.size() == 0) {
+      return false;
+    }
+    // Entries are removed from metadata before removing files, so that a
+    // lookup can never return files that are being removed.
+    try {
+      writeEntriesToDisk();
+    } catch (std::exception &e) {
+      std::cerr << "ERROR writing cache metadata during eviction" << std::endl;
+    }
+  }
+  for (const auto &entry : evicted) {
+    removeEntryFiles(entry);
+  }
+  std::unique_lock<std::mutex> lk(mCacheLock);
+  return overBudget();
+}
+
+bool CacheManager::recompressionStep() {
+  CacheEntry entry;
+  int level;
+  {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    if (mCodec != CODEC_ZLIB) {
+      return false;
+    }
+    level = mColdCompressionLevel;
+    auto now = std::time(nullptr);
+    auto it = std::find_if(
+        mEntries.begin(), mEntries.end(), [&](const CacheEntry &e) {
+          return !e.stale &&
+                 (e.codec != "zlib" || e.compressionLevel < level) &&
+                 std::difftime(now, lastAccessTime(e)) > mColdAge.count();
+        });
+    if (it == mEntries.end()) {
+      return false;
+    }
+    entry = *it;
+  }
+  // Compress to temporary files without holding the lock, as this can take a
+  // while for large files.
+  bool ok = true;
+  size_t written = 0;
+  for (const auto &filename : entry.filenames) {
+    if (!transcodeFile(cacheFilePath(filename, entry.codec),
+                       entry.codec == "zlib",
+                       cacheFilePath(filename, "zlib") + ".tmp", true,
+                       level)) {
+      ok = false;
+      break;
+    }
+    written++;
+  }
+  std::unique_lock<std::mutex> lk(mCacheLock);
+  auto it = std::find_if(
+      mEntries.begin(), mEntries.end(), [&](const CacheEntry &e) {
+        return e.filenames == entry.filenames &&
+               e.timestampEnd == entry.timestampEnd && e.codec == entry.codec;
+      });
+  if (!ok || it == mEntries.end()) {
+    for (size_t i = 0; i < written; i++) {
+      al::File::remove(cacheFilePath(entry.filenames[i], "zlib") + ".tmp");
+    }
+    if (!ok && it != mEntries.end()) {
+      std::cerr << "ERROR recompressing cache entry. Marking as stale."
+                << std::endl;
+      it->stale = true;
+      markChanged(*it);
+    }
+    return ok;
+  }
+  for (const auto &filename : entry.filenames) {
+    auto path = cacheFilePath(filename, "zlib");
+    if (!replaceFile(path + ".tmp", path)) {
+      std::cerr << "ERROR replacing cache file " << path << std::endl;
+      it->stale = true;
+    }
+  }
+  it->codec = "zlib";
+  it->compressionLevel = level;
+  mCurrentSize -= std::min(mCurrentSize, it->size);
+  it->size = computeEntrySize(*it);
+  mCurrentSize += it->size;
+  markChanged(*it);
+  try {
+    writeEntriesToDisk();
+  } catch (std::exception &e) {
+    std::cerr << "ERROR writing cache metadata after recompression"
+              << std::endl;
+  }
+  lk.unlock();
+  if (entry.codec != "zlib") {
+    for (const auto &filename : entry.filenames) {
+      al::File::remove(cacheFilePath(filename, entry.codec));
+    }
+  }
+  return true;
+}
+
+void CacheManager::setGarbageCollection(std::chrono::seconds interval,
+                                        std::chrono::seconds minAge) {
+  std::unique_lock<std::mutex> lk(mGarbageLock);
+  mGarbageInterval = interval;
+  mGarbageMinAge = minAge;
+}
+
+size_t CacheManager::collectGarbage() {
+  size_t collected = 0;
+  while (garbageCollectionStep(collected)) {
+  }
+  return collected;
+}
+
+bool CacheManager::garbageCollectionDue() {
+  std::unique_lock<std::mutex> lk(mGarbageLock);
+  return mGarbageInterval.count() > 0 &&
+         (mGarbagePassActive ||
+          std::chrono::steady_clock::now() - mGarbageLastPass >=
+              mGarbageInterval);
+}
+
+bool CacheManager::garbageCollectionStep(size_t &collected) {
+  std::unique_lock<std::mutex> gcLk(mGarbageLock);
+  auto directory = cacheDirectory();
+  if (!mGarbagePassActive) {
+    mGarbageFiles.clear();
+    for (auto &item : al::itemListInDir(directory)) {
+      if (!al::File::isDirectory(directory + item.file())) {
+        mGarbageFiles.push_back(item.file());
+      }
+    }
+    // Files stored after this snapshot are newer than mGarbageMinAge, and
+    // candidates are checked again against current entries before removal.
+    mGarbageReferenced.clear();
+    mGarbageEntries.clear();
+    {
+      std::unique_lock<std::mutex> lk(mCacheLock);
+      for (const auto &entry : mEntries) {
+        for (const auto &filename : entry.filenames) {
+          mGarbageReferenced.insert(cacheFilePath(filename, entry.codec));
+        }
+        if (!entry.stale) {
+          mGarbageEntries.push_back(
+              {entry.filenames, entry.timestampEnd, entry.codec});
+        }
+      }
+    }
+    mGarbageFileCursor = 0;
+    mGarbageEntryCursor = 0;
+    mGarbagePassActive = true;
+  }
+
+  if (mGarbageFileCursor < mGarbageFiles.size()) {
+    auto now = std::chrono::system_clock::now();
+    int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        now.time_since_epoch())
+                        .count();
+    int64_t minAgeNs =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(mGarbageMinAge)
+            .count();
+    std::vector<std::string> orphans;
+    size_t end =
+        std::min(mGarbageFileCursor + mGarbageBatchSize, mGarbageFiles.size());
+    for (; mGarbageFileCursor < end; mGarbageFileCursor++) {
+      const auto &name = mGarbageFiles[mGarbageFileCursor];
+      // Metadata, its lock and temporary files
+      if (name.compare(0, mCachePath.filename.size(), mCachePath.filename) ==
+          0) {
+        continue;
+      }
+      auto path = directory + name;
+      struct stat s;
+      if (mGarbageReferenced.find(path) != mGarbageReferenced.end() ||
+          ::stat(path.c_str(), &s) != 0 || nowNs - modifiedNs(s) < minAgeNs) {
+        continue;
+      }
+      orphans.push_back(path);
+    }
+    if (orphans.size() > 0) {
+      std::unique_lock<std::mutex> lk(mCacheLock);
+      for (const auto &path : orphans) {
+        bool referenced =
+            std::find_if(mEntries.begin(), mEntries.end(),
+                         [&](const CacheEntry &e) {
+                           for (const auto &filename : e.filenames) {
+                             if (cacheFilePath(filename, e.codec) == path) {
+                               return true;
+                             }
+                           }
+                           return false;
+                         }) != mEntries.end();
+        if (!referenced && al::File::remove(path)) {
+          collected++;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Entries whose files have been removed outside the cache
+  if (mGarbageEntryCursor >= mGarbageEntries.size()) {
+    mGarbagePassActive = false;
+    mGarbageFiles.clear();
+    mGarbageReferenced.clear();
+    mGarbageEntries.clear();
+    mGarbageLastPass = std::chrono::steady_clock::now();
+    return false;
+  }
+  std::vector<GarbageEntry> dangling;
+  size_t end = std::min(mGarbageEntryCursor + mGarbageBatchSize,
+                        mGarbageEntries.size());
+  for (; mGarbageEntryCursor < end; mGarbageEntryCursor++) {
+    const auto &entry = mGarbageEntries[mGarbageEntryCursor];
+    for (const auto &filename : entry.filenames) {
+      if (!al::File::exists(cacheFilePath(filename, entry.codec))) {
+        dangling.push_back(entry);
+        break;
+      }
+    }
+  }
+  if (dangling.size() > 0) {
+    std::unique_lock<std::mutex> lk(mCacheLock);
+    for (const auto &entry : dangling) {
+      auto it = std::find_if(
+          mEntries.begin(), mEntries.end(), [&](const CacheEntry &e) {
+            return e.filenames == entry.filenames &&
+                   e.timestampEnd == entry.timestampEnd &&
+                   e.codec == entry.codec;
+          });
+      if (it != mEntries.end() && !it->stale) {
+        if (mVerbose) {
+          std::cerr << "Cache entry files missing. Marking as stale."
+                    << std::endl;
+        }
+        it->stale = true;
+        markChanged(*it);
+        collected++;
+      }
+    }
+  }
+  return true;
+}
+
+bool CacheManager::overBudget() {
+  if (mEntries.size() == 0) {
+    return false;
+  }
+  return (mMaxSize > 0 && mCurrentSize > mMaxSize) ||
+         (mMaxEntries > 0 && mEntries.size() > mMaxEntries);
+}
+
+size_t CacheManager::selectEvictionCandidate() {
+  size_t candidate = 0;
+  double candidateScore = 0.0;
+  for (size_t i = 0; i < mEntries.size(); i++) {
+    const auto &entry = mEntries[i];
+    if (entry.stale) {
+      return i;
+    }
+    double score;
+    switch (mEvictionPolicy) {
+    case EVICTION_LFU:
+      // Break ties in hit count using access time
+      score = entry.cacheHits * 1.0e10 + lastAccessTime(entry);
+      break;
+    case EVICTION_COST: {
+      // Seconds of computation saved per byte of storage, weighted by use
+      double computeTime = std::difftime(parseTimestamp(entry.timestampEnd),
+                                         parseTimestamp(entry.timestampStart));
+      score = (entry.cacheHits + 1) * (std::max(computeTime, 0.0) + 1.0) /
+              (entry.size + 1.0);
+    } break;
+    case EVICTION_LRU:
+    default:
+      score = lastAccessTime(entry);
+      break;
+    }
+    if (i == 0 || score < candidateScore) {
+      candidate = i;
+      candidateScore = score;
+    }
+  }
+  return candidate;
+}
+
+uint64_t CacheManager::computeEntrySize(const CacheEntry &entry) {
+  uint64_t size = 0;
+  for (const auto &filename : entry.filenames) {
+    struct stat s;
+    if (::stat(cacheFilePath(filename, entry.codec).c_str(), &s) == 0) {
+      size += s.st_size;
+    }
+  }
+  return size;
+}
+
+std::string CacheManager::cacheFilePath(const std::string &filename,
+                                        const std::string &codec) {
+  if (codec == "zlib") {
+    return cacheDirectory() + filename + ".gz";
+  }
+  return cacheDirectory() + filename;
+}
+
+void CacheManager::removeEntryFiles(const CacheEntry &entry) {
+  {
+    std::unique_lock<std::mutex> lk(mMemoryTierLock);
+    for (const auto &filename : entry.filenames) {
+      memoryTierRemove(filename);
+    }
+  }
+  for (const auto &filename : entry.filenames) {
+    auto path = cacheFilePath(filename, entry.codec);
+    if (al::File::exists(path) && !al::File::remove(path)) {
+      std::cerr << "ERROR removing cache file " << path << std::endl;
+    }
+  }
 }
 
 void CacheManager::tincSchemaFormatChecker(const std::string &format,
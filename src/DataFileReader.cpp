@@ -0,0 +1,320 @@
+#include "tinc/DataFileReader.hpp"
+#include "tinc/MappedFile.hpp"
+
+#include "al/io/al_File.hpp"
+
+#include "nlohmann/json.hpp"
+using json = nlohmann::json;
+
+#ifdef TINC_HAS_NETCDF
+#include <netcdf.h>
+#endif
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace tinc;
+
+namespace {
+
+template <typename T> float valueAt(const uint8_t *p) {
+  T value;
+  memcpy(&value, p, sizeof(T));
+  return (float)value;
+}
+
+// Strided view of values in a mapped file
+class DataFieldMapped : public DataField {
+public:
+  DataFieldMapped(std::shared_ptr<MappedFile> file,
+                  BinaryFileReader::DataType type, size_t offset,
+                  size_t stride)
+      : mFile(file), mType(type), mStride(stride) {
+    auto typeSize = BinaryFileReader::typeSize(type);
+    if (mStride == 0) {
+      mStride = typeSize;
+    }
+    if (file->size() >= offset + typeSize) {
+      mSize = (file->size() - offset - typeSize) / mStride + 1;
+      mBase = file->data() + offset;
+    }
+  }
+
+  size_t size() const override { return mSize; }
+
+  float at(size_t index) const override {
+    const uint8_t *p = mBase + index * mStride;
+    switch (mType) {
+    case BinaryFileReader::FLOAT32:
+      return valueAt<float>(p);
+    case BinaryFileReader::FLOAT64:
+      return valueAt<double>(p);
+    case BinaryFileReader::INT8:
+      return valueAt<int8_t>(p);
+    case BinaryFileReader::UINT8:
+      return valueAt<uint8_t>(p);
+    case BinaryFileReader::INT16:
+      return valueAt<int16_t>(p);
+    case BinaryFileReader::UINT16:
+      return valueAt<uint16_t>(p);
+    case BinaryFileReader::INT32:
+      return valueAt<int32_t>(p);
+    case BinaryFileReader::UINT32:
+      return valueAt<uint32_t>(p);
+    case BinaryFileReader::INT64:
+      return valueAt<int64_t>(p);
+    case BinaryFileReader::UINT64:
+      return valueAt<uint64_t>(p);
+    }
+    return 0.0f;
+  }
+
+  bool read(float *data, size_t start, size_t count) const override {
+    if (start + count > mSize) {
+      return false;
+    }
+    if (mType == BinaryFileReader::FLOAT32 && mStride == sizeof(float)) {
+      memcpy(data, mBase + start * sizeof(float), count * sizeof(float));
+      return true;
+    }
+    return DataField::read(data, start, count);
+  }
+
+private:
+  std::shared_ptr<MappedFile> mFile;
+  BinaryFileReader::DataType mType;
+  size_t mStride;
+  const uint8_t *mBase{nullptr};
+  size_t mSize{0};
+};
+
+std::string trimField(const std::string &text) {
+  auto begin = text.find_first_not_of(" \t\r\"");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  auto end = text.find_last_not_of(" \t\r\"");
+  return text.substr(begin, end - begin + 1);
+}
+
+std::vector<std::string> splitLine(const std::string &line, char delimiter) {
+  std::vector<std::string> tokens;
+  std::stringstream ss(line);
+  std::string token;
+  while (std::getline(ss, token, delimiter)) {
+    tokens.push_back(trimField(token));
+  }
+  if (line.size() > 0 && line.back() == delimiter) {
+    tokens.push_back(std::string());
+  }
+  return tokens;
+}
+
+} // namespace
+
+bool DataField::read(float *data, size_t start, size_t count) const {
+  if (start + count > size()) {
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    data[i] = at(start + i);
+  }
+  return true;
+}
+
+bool DataFieldVector::read(float *data, size_t start, size_t count) const {
+  if (start + count > mValues.size()) {
+    return false;
+  }
+  memcpy(data, mValues.data() + start, count * sizeof(float));
+  return true;
+}
+
+bool JsonFileReader::readFields(const std::string &path,
+                                const std::string &field,
+                                DataFieldMap &fields) {
+  std::ifstream f(path);
+  if (!f.good()) {
+    std::cerr << "ERROR reading file: " << path << std::endl;
+    return false;
+  }
+  try {
+    json j = json::parse(f);
+    if (!j.is_object()) {
+      return false;
+    }
+    // Extract all numeric fields, so requests for other fields don't parse
+    // the file again
+    for (auto it = j.begin(); it != j.end(); it++) {
+      auto column = std::make_shared<DataFieldVector>();
+      if (it->is_number()) {
+        column->values().push_back(it->get<float>());
+      } else if (it->is_array()) {
+        column->values().reserve(it->size());
+        for (const auto &value : *it) {
+          if (!value.is_number()) {
+            column = nullptr;
+            break;
+          }
+          column->values().push_back(value.get<float>());
+        }
+      } else {
+        column = nullptr;
+      }
+      if (column) {
+        fields[it.key()] = column;
+      }
+    }
+  } catch (std::exception &e) {
+    std::cerr << "ERROR parsing file: " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool CsvFileReader::readFields(const std::string &path,
+                               const std::string &field,
+                               DataFieldMap &fields) {
+  std::ifstream f(path);
+  if (!f.good()) {
+    std::cerr << "ERROR reading file: " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  if (!std::getline(f, line)) {
+    std::cerr << "ERROR: no header in CSV file: " << path << std::endl;
+    return false;
+  }
+  auto names = splitLine(line, mDelimiter);
+  std::vector<std::shared_ptr<DataFieldVector>> columns;
+  for (size_t i = 0; i < names.size(); i++) {
+    columns.push_back(std::make_shared<DataFieldVector>());
+  }
+  while (std::getline(f, line)) {
+    if (trimField(line).size() == 0) {
+      continue;
+    }
+    auto tokens = splitLine(line, mDelimiter);
+    for (size_t i = 0; i < columns.size(); i++) {
+      if (!columns[i]) {
+        continue;
+      }
+      char *end = nullptr;
+      float value = 0.0f;
+      if (i < tokens.size() && tokens[i].size() > 0) {
+        value = std::strtof(tokens[i].c_str(), &end);
+      }
+      if (!end || *end != '\0') {
+        // Not a numeric column
+        columns[i] = nullptr;
+        continue;
+      }
+      columns[i]->values().push_back(value);
+    }
+  }
+  for (size_t i = 0; i < columns.size(); i++) {
+    if (columns[i] && names[i].size() > 0) {
+      fields[names[i]] = columns[i];
+    }
+  }
+  return true;
+}
+
+bool NetCDFFileReader::readFields(const std::string &path,
+                                  const std::string &field,
+                                  DataFieldMap &fields) {
+#ifdef TINC_HAS_NETCDF
+  std::unique_lock<std::mutex> lk(libraryLock());
+  int ncid, varid, ndims;
+  if (nc_open(path.c_str(), NC_NOWRITE, &ncid)) {
+    std::cerr << "ERROR reading file: " << path << std::endl;
+    return false;
+  }
+  if (nc_inq_varid(ncid, field.c_str(), &varid) ||
+      nc_inq_varndims(ncid, varid, &ndims)) {
+    // File is readable but does not have the field
+    nc_close(ncid);
+    return true;
+  }
+  std::vector<int> dimids(ndims);
+  size_t count = 1;
+  bool ok = nc_inq_vardimid(ncid, varid, dimids.data()) == 0;
+  for (int i = 0; ok && i < ndims; i++) {
+    size_t len;
+    ok = nc_inq_dimlen(ncid, dimids[i], &len) == 0;
+    count *= len;
+  }
+  auto column = std::make_shared<DataFieldVector>();
+  if (ok) {
+    column->values().resize(count);
+    ok = count == 0 ||
+         nc_get_var_float(ncid, varid, column->values().data()) == 0;
+  }
+  nc_close(ncid);
+  if (!ok) {
+    std::cerr << "ERROR reading variable " << field << " in " << path
+              << std::endl;
+    return false;
+  }
+  fields[field] = column;
+  return true;
+#else
+  std::cerr << "ERROR: NetCDF support not available. Can't read " << path
+            << std::endl;
+  return false;
+#endif
+}
+
+std::mutex &NetCDFFileReader::libraryLock() {
+  static std::mutex lock;
+  return lock;
+}
+
+void BinaryFileReader::addField(std::string name, DataType type, size_t offset,
+                                size_t stride) {
+  mFields[name] = FieldLayout{type, offset, stride};
+}
+
+bool BinaryFileReader::readFields(const std::string &path,
+                                  const std::string &field,
+                                  DataFieldMap &fields) {
+  auto file = MappedFile::open(path);
+  if (!file) {
+    std::cerr << "ERROR mapping file: " << path << std::endl;
+    return false;
+  }
+  if (mFields.size() == 0) {
+    fields[field] = std::make_shared<DataFieldMapped>(file, mDefaultType,
+                                                      mHeaderSize, 0);
+    return true;
+  }
+  // All fields share the mapping
+  for (const auto &layout : mFields) {
+    fields[layout.first] = std::make_shared<DataFieldMapped>(
+        file, layout.second.type, mHeaderSize + layout.second.offset,
+        layout.second.stride);
+  }
+  return true;
+}
+
+size_t BinaryFileReader::typeSize(DataType type) {
+  switch (type) {
+  case INT8:
+  case UINT8:
+    return 1;
+  case INT16:
+  case UINT16:
+    return 2;
+  case FLOAT32:
+  case INT32:
+  case UINT32:
+    return 4;
+  case FLOAT64:
+  case INT64:
+  case UINT64:
+    return 8;
+  }
+  return 4;
+}
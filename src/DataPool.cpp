@@ -1,4 +1,5 @@
 #include "tinc/DataPool.hpp"
+#include "FileModified.hpp"
 
 #include "al/io/al_File.hpp"
 
@@ -9,12 +10,117 @@ using json = nlohmann::json;
 #include <netcdf.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <fstream>
+#include <limits>
+
+#ifdef AL_WINDOWS
+#include <windows.h>
+#endif
 
 using namespace tinc;
 
+#ifdef TINC_HAS_NETCDF
+// Read global text attribute of open NetCDF file
+static bool readTextAttribute(int ncid, const char *name, std::string &text) {
+  size_t len;
+  if (nc_inq_attlen(ncid, NC_GLOBAL, name, &len)) {
+    return false;
+  }
+  text.resize(len);
+  return len == 0 || nc_get_att_text(ncid, NC_GLOBAL, name, &text[0]) == 0;
+}
+#endif
+
+// Values per chunk in consolidated files
+#define TINC_CONSOLIDATED_CHUNK_SIZE 65536
+
+// Values reduced by a single task
+#define TINC_REDUCE_CHUNK_SIZE 65536
+// Values summed in float before adding to the double total
+#define TINC_REDUCE_BLOCK_SIZE 4096
+#define TINC_REDUCE_LANES 16
+
+// Minimum, maximum, sum and number of values that are not NaN. Uses
+// independent lanes without branches so the inner loop can be vectorized.
+static void reduceValues(const float *values, size_t count, float &min,
+                         float &max, double &sum, uint64_t &valid) {
+  for (size_t block = 0; block < count; block += TINC_REDUCE_BLOCK_SIZE) {
+    size_t blockEnd = std::min(count, block + TINC_REDUCE_BLOCK_SIZE);
+    float mins[TINC_REDUCE_LANES], maxs[TINC_REDUCE_LANES];
+    float sums[TINC_REDUCE_LANES], counts[TINC_REDUCE_LANES];
+    for (size_t l = 0; l < TINC_REDUCE_LANES; l++) {
+      mins[l] = std::numeric_limits<float>::infinity();
+      maxs[l] = -std::numeric_limits<float>::infinity();
+      sums[l] = 0.0f;
+      counts[l] = 0.0f;
+    }
+    size_t i = block;
+    for (; i + TINC_REDUCE_LANES <= blockEnd; i += TINC_REDUCE_LANES) {
+      for (size_t l = 0; l < TINC_REDUCE_LANES; l++) {
+        float v = values[i + l];
+        // Comparisons with NaN are false, so NaN never becomes min or max
+        float isNumber = v == v;
+        mins[l] = v < mins[l] ? v : mins[l];
+        maxs[l] = v > maxs[l] ? v : maxs[l];
+        sums[l] += isNumber ? v : 0.0f;
+        counts[l] += isNumber;
+      }
+    }
+    for (; i < blockEnd; i++) {
+      float v = values[i];
+      mins[0] = v < mins[0] ? v : mins[0];
+      maxs[0] = v > maxs[0] ? v : maxs[0];
+      sums[0] += v == v ? v : 0.0f;
+      counts[0] += v == v ? 1.0f : 0.0f;
+    }
+    for (size_t l = 0; l < TINC_REDUCE_LANES; l++) {
+      min = std::min(min, mins[l]);
+      max = std::max(max, maxs[l]);
+      sum += sums[l];
+      valid += (uint64_t)counts[l];
+    }
+  }
+}
+
+// Add values in [lo, hi] to bins. NaN values are not counted.
+static void histogramValues(const float *values, size_t count, float lo,
+                            float hi, uint64_t *bins, size_t binCount) {
+  float scale = hi > lo ? binCount / (hi - lo) : 0.0f;
+  for (size_t i = 0; i < count; i++) {
+    float v = values[i];
+    if (!(v >= lo && v <= hi)) {
+      continue;
+    }
+    size_t bin = (size_t)((v - lo) * scale);
+    bins[bin < binCount ? bin : binCount - 1]++;
+  }
+}
+
+// Parameter space set by ScopedParameterSpace for the current thread
+struct ParameterSpaceOverride {
+  const DataPool *pool;
+  ParameterSpace *ps;
+};
+static thread_local ParameterSpaceOverride parameterSpaceOverride{nullptr,
+                                                                  nullptr};
+
+DataPool::ScopedParameterSpace::ScopedParameterSpace(DataPool &pool,
+                                                     ParameterSpace &ps)
+    : mPreviousPool(parameterSpaceOverride.pool),
+      mPreviousSpace(parameterSpaceOverride.ps) {
+  parameterSpaceOverride = {&pool, &ps};
+}
+
+DataPool::ScopedParameterSpace::~ScopedParameterSpace() {
+  parameterSpaceOverride = {mPreviousPool, mPreviousSpace};
+}
+
 DataPool::DataPool(ParameterSpace &ps, std::string sliceCacheDir)
-    : mParameterSpace(&ps) {
+    : mParameterSpace(&ps), mThreadPool(std::make_shared<ThreadPool>()) {
+  registerDefaultFileReaders();
   if (sliceCacheDir.size() == 0) {
     sliceCacheDir = al::File::currentPath();
   }
@@ -23,8 +129,9 @@ DataPool::DataPool(ParameterSpace &ps, std::string sliceCacheDir)
 
 DataPool::DataPool(std::string id, ParameterSpace &ps,
                    std::string sliceCacheDir)
-    : mParameterSpace(&ps) {
+    : mParameterSpace(&ps), mThreadPool(std::make_shared<ThreadPool>()) {
   mId = id;
+  registerDefaultFileReaders();
   if (sliceCacheDir.size() == 0) {
     sliceCacheDir = al::File::currentPath();
   }
@@ -39,156 +146,1080 @@ std::string DataPool::createDataSlice(std::string field,
 std::string
 DataPool::createDataSlice(std::string field,
                           std::vector<std::string> sliceDimensions) {
-
-  std::vector<std::string> filesystemDims;
-  for (auto dim : mParameterSpace->getDimensions()) {
-    if (mParameterSpace->isFilesystemDimension(dim->getName())) {
-      filesystemDims.push_back(dim->getName());
+  if (sliceSize(sliceDimensions) == 0) {
+    return std::string();
+  }
+  SliceProvenance provenance;
+  auto filename = sliceFilename(field, sliceDimensions, provenance);
+  if (mUseLiveSlices) {
+    auto live = getLiveSlice(filename);
+    std::unique_lock<std::mutex> lk(live->lock);
+    std::vector<size_t> changedCells;
+    updateLiveSlice(*live, sliceDimensions, provenance, changedCells);
+    if (!live->fileWritten) {
+      // Slice file may have been written before the slice was live
+      live->fileWritten = sliceIsCurrent(filename, live->provenance);
+    } else if (!al::File::exists(mSliceCacheDirectory + filename)) {
+      live->fileWritten = false;
+    } else if (changedCells.size() > 0 &&
+               !writeSliceCells(filename, sliceDimensions, live->values,
+                                changedCells, live->provenance)) {
+      live->fileWritten = false;
+    }
+    if (!live->fileWritten) {
+      live->fileWritten = writeSliceFile(filename, sliceDimensions,
+                                         live->values, live->provenance);
+      if (!live->fileWritten) {
+        return std::string();
+      }
     }
+    return filename;
+  }
+  if (sliceIsCurrent(filename, provenance)) {
+    return filename;
+  }
+  std::vector<float> values(sliceSize(sliceDimensions));
+  gatherSlice(field, sliceDimensions, values.data(), provenance);
+  if (!writeSliceFile(filename, sliceDimensions, values, provenance)) {
+    return std::string();
   }
-  // FIXME implement slicing along more than one dimension.
-  std::vector<float> values;
-  std::string filename = "slice_";
+  return filename;
+}
 
-  size_t fieldSize = 1; // FIXME get actual field size
-  size_t dimCount = fieldSize;
+std::string
+DataPool::createDataSlices(std::vector<std::string> fields,
+                           std::vector<std::string> sliceDimensions) {
+  auto count = sliceSize(sliceDimensions);
+  if (count == 0 || fields.size() == 0) {
+    return std::string();
+  }
+  SliceProvenance provenance;
+  auto filename =
+      sliceFilename(joinSliceFields(fields), sliceDimensions, provenance);
+  if (sliceIsCurrent(filename, provenance)) {
+    return filename;
+  }
+  std::vector<std::vector<float>> values(fields.size(),
+                                         std::vector<float>(count));
+  std::vector<float *> fieldValues;
+  std::vector<const float *> variables;
+  for (auto &v : values) {
+    fieldValues.push_back(v.data());
+    variables.push_back(v.data());
+  }
+  if (!gatherSlices(fields, sliceDimensions, fieldValues, provenance)) {
+    return std::string();
+  }
+  if (!writeSliceFile(filename, sliceDimensions, fields, variables,
+                      provenance)) {
+    return std::string();
+  }
+  return filename;
+}
+
+size_t DataPool::sliceSize(const std::vector<std::string> &sliceDimensions) {
+  size_t dimCount = 1;
   for (auto sliceDimension : sliceDimensions) {
-    auto dim = mParameterSpace->getDimension(sliceDimension);
+    auto dim = parameterSpace().getDimension(sliceDimension);
     if (dim) {
       dimCount *= dim->size();
     } else {
       std::cerr << "ERROR: Unknown dimension: " << sliceDimension << std::endl;
-      return std::string();
+      return 0;
+    }
+  }
+  if (sliceDimensions.size() == 0 || dimCount == 0) {
+    std::cerr << "ERROR: Empty slice requested" << std::endl;
+    return 0;
+  }
+  return dimCount;
+}
+
+size_t DataPool::readDataSlice(std::string field,
+                               std::vector<std::string> sliceDimensions,
+                               float *data, size_t maxLen) {
+  auto count = sliceSize(sliceDimensions);
+  if (count == 0) {
+    return 0;
+  }
+  if (maxLen < count) {
+    std::cerr << "ERROR: Slice for " << field << " has " << count
+              << " values, buffer has space for " << maxLen << std::endl;
+    return 0;
+  }
+  SliceProvenance provenance;
+  auto filename = sliceFilename(field, sliceDimensions, provenance);
+  if (mUseLiveSlices) {
+    if (mWriteSliceOnRead) {
+      createDataSlice(field, sliceDimensions);
     }
+    auto live = getLiveSlice(filename);
+    std::unique_lock<std::mutex> lk(live->lock);
+    std::vector<size_t> changedCells;
+    updateLiveSlice(*live, sliceDimensions, provenance, changedCells);
+    memcpy(data, live->values.data(), count * sizeof(float));
+    return count;
+  }
+  gatherSlice(field, sliceDimensions, data, provenance);
+  if (mWriteSliceOnRead && !sliceIsCurrent(filename, provenance)) {
+    writeSliceFile(filename, sliceDimensions,
+                   std::vector<float>(data, data + count), provenance);
+  }
+  return count;
+}
+
+bool DataPool::readDataSlice(std::string field,
+                             std::vector<std::string> sliceDimensions,
+                             SliceData &slice) {
+  auto count = sliceSize(sliceDimensions);
+  if (count == 0) {
+    return false;
+  }
+  slice.dimensions = sliceDimensions;
+  slice.shape.clear();
+  for (auto sliceDimension : sliceDimensions) {
+    slice.shape.push_back(
+        parameterSpace().getDimension(sliceDimension)->size());
   }
-  values.reserve(dimCount);
+  slice.values.resize(count);
+  return readDataSlice(field, sliceDimensions, slice.values.data(), count) ==
+         count;
+}
 
-  // TODO check if file exists and is the correct slice to use cache instead.
-  // TODO for this we need to add metadata to the file indicating where the
-  // slice came from. This is part of the bigger TINC metadata idea
+bool DataPool::readDataSlices(std::vector<std::string> fields,
+                              std::vector<std::string> sliceDimensions,
+                              std::vector<SliceData> &slices) {
+  auto count = sliceSize(sliceDimensions);
+  if (count == 0) {
+    return false;
+  }
+  std::vector<size_t> shape;
   for (auto sliceDimension : sliceDimensions) {
-    auto dim = mParameterSpace->getDimension(sliceDimension);
-    assert(dim);
-    if (std::find(filesystemDims.begin(), filesystemDims.end(),
-                  sliceDimension) == filesystemDims.end()) {
-      // TODO should we perform a  copy of the parameter space to avoid race
-      // conditions?
-      // sliceDimension is a dimension that affects filesystem paths.
-      size_t dimCount = dim->size();
-      values.reserve(dimCount);
-
-      auto dataPaths = getAllPaths();
-      for (auto directory : dataPaths) {
-        for (auto file : mDataFilenames) {
-          float value;
-          size_t index =
-              mParameterSpace->getDimension(file.second)->getCurrentIndex();
-          if (getFieldFromFile(field, al::File::conformDirectory(directory) +
-                                          file.first,
-                               index, &value)) {
-            values.push_back(value);
-            break;
-          }
-        }
-      }
-    } else { // We can slice the data from a single file
-      values.resize(dim->size());
-      std::map<std::string, size_t> currentIndeces;
-      for (auto dimension : mParameterSpace->getDimensions()) {
-        currentIndeces[dimension->getName()] = dimension->getCurrentIndex();
-      }
-      auto directory = mParameterSpace->generateRelativeRunPath(
-          currentIndeces, mParameterSpace);
-      for (auto file : mDataFilenames) {
-        if (getFieldFromFile(field,
-                             al::File::conformDirectory(directory) + file.first,
-                             values.data(), values.size())) {
-          break;
-        }
+    shape.push_back(parameterSpace().getDimension(sliceDimension)->size());
+  }
+  slices.resize(fields.size());
+  std::vector<float *> values;
+  for (auto &slice : slices) {
+    slice.dimensions = sliceDimensions;
+    slice.shape = shape;
+    slice.values.resize(count);
+    values.push_back(slice.values.data());
+  }
+  if (mUseLiveSlices) {
+    // Live slices are kept per field
+    for (size_t f = 0; f < fields.size(); f++) {
+      if (readDataSlice(fields[f], sliceDimensions, values[f], count) !=
+          count) {
+        return false;
       }
     }
-    filename += sliceDimension + +"_" +
-                mParameterSpace->getDimension(sliceDimension)->getCurrentId();
+    return true;
+  }
+  SliceProvenance provenance;
+  auto filename =
+      sliceFilename(joinSliceFields(fields), sliceDimensions, provenance);
+  if (!gatherSlices(fields, sliceDimensions, values, provenance)) {
+    return false;
+  }
+  if (mWriteSliceOnRead && !sliceIsCurrent(filename, provenance)) {
+    writeSliceFile(filename, sliceDimensions, fields,
+                   std::vector<const float *>(values.begin(), values.end()),
+                   provenance);
+  }
+  return true;
+}
+
+size_t DataPool::readDataSlice(std::string field, std::string sliceDimension,
+                               void *data, size_t maxLen) {
+  return readDataSlice(field, std::vector<std::string>{sliceDimension},
+                       (float *)data, maxLen);
+}
+
+bool DataPool::reduceDataSlice(std::string field,
+                               std::vector<std::string> sliceDimensions,
+                               SliceReduction &reduction,
+                               size_t histogramBins, float histogramMin,
+                               float histogramMax) {
+  auto count = sliceSize(sliceDimensions);
+  if (count == 0) {
+    return false;
+  }
+  std::vector<float> values(count);
+  if (readDataSlice(field, sliceDimensions, values.data(), count) != count) {
+    return false;
+  }
+  reduction = SliceReduction();
+  float min = std::numeric_limits<float>::infinity();
+  float max = -std::numeric_limits<float>::infinity();
+  double sum = 0.0;
+  std::mutex reductionLock;
+  mThreadPool->parallelFor(
+      count,
+      [&](size_t begin, size_t end) {
+        float chunkMin = std::numeric_limits<float>::infinity();
+        float chunkMax = -std::numeric_limits<float>::infinity();
+        double chunkSum = 0.0;
+        uint64_t chunkCount = 0;
+        reduceValues(values.data() + begin, end - begin, chunkMin, chunkMax,
+                     chunkSum, chunkCount);
+        std::unique_lock<std::mutex> lk(reductionLock);
+        min = std::min(min, chunkMin);
+        max = std::max(max, chunkMax);
+        sum += chunkSum;
+        reduction.count += chunkCount;
+      },
+      TINC_REDUCE_CHUNK_SIZE);
+  reduction.missing = count - reduction.count;
+  if (reduction.count == 0) {
+    reduction.min = reduction.max = std::numeric_limits<float>::quiet_NaN();
+    reduction.mean = std::numeric_limits<double>::quiet_NaN();
+    return true;
+  }
+  reduction.min = min;
+  reduction.max = max;
+  reduction.mean = sum / reduction.count;
+
+  if (histogramBins > 0) {
+    if (histogramMin == histogramMax) {
+      histogramMin = min;
+      histogramMax = max;
+    }
+    reduction.histogramMin = histogramMin;
+    reduction.histogramMax = histogramMax;
+    reduction.histogram.resize(histogramBins, 0);
+    mThreadPool->parallelFor(
+        count,
+        [&](size_t begin, size_t end) {
+          std::vector<uint64_t> bins(histogramBins, 0);
+          histogramValues(values.data() + begin, end - begin, histogramMin,
+                          histogramMax, bins.data(), histogramBins);
+          std::unique_lock<std::mutex> lk(reductionLock);
+          for (size_t i = 0; i < histogramBins; i++) {
+            reduction.histogram[i] += bins[i];
+          }
+        },
+        TINC_REDUCE_CHUNK_SIZE);
+  }
+  return true;
+}
+
+std::string
+DataPool::joinSliceFields(const std::vector<std::string> &fields) {
+  std::string joined;
+  for (auto &field : fields) {
+    if (joined.size() > 0) {
+      joined += "+";
+    }
+    joined += field;
   }
+  return joined;
+}
 
-  for (auto dim : mParameterSpace->getDimensions()) {
+std::string
+DataPool::sliceFilename(const std::string &field,
+                        const std::vector<std::string> &sliceDimensions,
+                        SliceProvenance &provenance) {
+  std::string filename = "slice_" + field;
+  for (auto sliceDimension : sliceDimensions) {
+    filename += "_" + sliceDimension;
+  }
+  provenance.field = field;
+  provenance.sliceDimensions = sliceDimensions;
+  provenance.shape.clear();
+  for (auto sliceDimension : sliceDimensions) {
+    provenance.shape.push_back(
+        parameterSpace().getDimension(sliceDimension)->size());
+  }
+  provenance.fixedIndeces.clear();
+  provenance.sourceModified.clear();
+  // Dimensions not in the slice stay at their current index
+  for (auto dim : parameterSpace().getDimensions()) {
     if (std::find(sliceDimensions.begin(), sliceDimensions.end(),
                   dim->getName()) == sliceDimensions.end()) {
-      filename += "_" + dim->getName();
+      provenance.fixedIndeces[dim->getName()] = dim->getCurrentIndex();
+      filename += "_" + dim->getName() + "_" + dim->getCurrentId();
     }
   }
   filename += ".nc";
+  return filename;
+}
+
+bool DataPool::gatherSlice(const std::string &field,
+                           const std::vector<std::string> &sliceDimensions,
+                           float *values, SliceProvenance &provenance) {
+  return gatherSlices({field}, sliceDimensions, {values}, provenance);
+}
+
+bool DataPool::gatherSlices(const std::vector<std::string> &fields,
+                            const std::vector<std::string> &sliceDimensions,
+                            const std::vector<float *> &values,
+                            SliceProvenance &provenance) {
+  bool missingValues = false;
+  // Fields in the consolidated file don't need the data files
+  std::vector<size_t> fieldIndeces;
+  for (size_t f = 0; f < fields.size(); f++) {
+    bool complete;
+    if (gatherConsolidatedSlice(fields[f], sliceDimensions, values[f],
+                                provenance, complete)) {
+      missingValues |= !complete;
+    } else {
+      fieldIndeces.push_back(f);
+    }
+  }
+  if (fieldIndeces.size() == 0) {
+    return !missingValues;
+  }
+  std::vector<size_t> shape;
+  size_t dimCount = 1;
+  for (auto sliceDimension : sliceDimensions) {
+    shape.push_back(parameterSpace().getDimension(sliceDimension)->size());
+    dimCount *= shape.back();
+  }
+  std::map<std::string, size_t> currentIndeces = provenance.fixedIndeces;
+  std::mutex provenanceLock;
+
+  // Values are laid out with the last slice dimension varying fastest, as
+  // NetCDF expects. All fields are read in the same pass over the files.
+  // Pool threads don't see this thread's ScopedParameterSpace
+  auto &ps = parameterSpace();
+  mThreadPool->parallelFor(dimCount, [&](size_t begin, size_t end) {
+    auto indeces = currentIndeces;
+    std::map<std::string, int64_t> sourceModified;
+    bool missing = false;
+    // Consecutive values usually come from the same files
+    std::string lastDirectory;
+    std::vector<std::map<std::string, std::shared_ptr<const DataField>>>
+        columns(fields.size());
+    for (size_t i = begin; i < end; i++) {
+      sliceCellIndeces(i, sliceDimensions, shape, indeces);
+      auto directory = cellDirectory(ps, indeces);
+      if (directory != lastDirectory) {
+        for (auto &fieldColumns : columns) {
+          fieldColumns.clear();
+        }
+        lastDirectory = directory;
+      }
+      for (auto f : fieldIndeces) {
+        missing |= !readCellValue(fields[f], directory, indeces, columns[f],
+                                  sourceModified, values[f][i]);
+      }
+    }
+    std::unique_lock<std::mutex> lk(provenanceLock);
+    provenance.sourceModified.insert(sourceModified.begin(),
+                                     sourceModified.end());
+    missingValues |= missing;
+  });
+  if (missingValues) {
+    std::cerr << "WARNING: Some values for " << provenance.field
+              << " not found. Slice will contain NaN" << std::endl;
+  }
+  return !missingValues;
+}
+
+void DataPool::sliceCellIndeces(size_t cell,
+                                const std::vector<std::string> &sliceDimensions,
+                                const std::vector<size_t> &shape,
+                                std::map<std::string, size_t> &indeces) {
+  for (size_t d = shape.size(); d > 0; d--) {
+    indeces[sliceDimensions[d - 1]] = cell % shape[d - 1];
+    cell /= shape[d - 1];
+  }
+}
+
+ParameterSpace &DataPool::parameterSpace() {
+  if (parameterSpaceOverride.pool == this) {
+    return *parameterSpaceOverride.ps;
+  }
+  return *mParameterSpace;
+}
+
+std::string
+DataPool::cellDirectory(ParameterSpace &ps,
+                        const std::map<std::string, size_t> &indeces) {
+  return al::File::conformDirectory(
+      al::File::conformPathToOS(ps.getRootPath()) +
+      ps.generateRelativeRunPath(indeces, &ps));
+}
+
+bool DataPool::readCellValue(
+    const std::string &field, const std::string &directory,
+    const std::map<std::string, size_t> &indeces,
+    std::map<std::string, std::shared_ptr<const DataField>> &columns,
+    std::map<std::string, int64_t> &sourceModified, float &value) {
+  value = std::numeric_limits<float>::quiet_NaN();
+  for (auto file : mDataFilenames) {
+    auto path = directory + file.first;
+    auto columnIt = columns.find(path);
+    if (columnIt == columns.end()) {
+      // Take modification time before reading, so that changes during
+      // the read invalidate the slice
+      auto modified = fileModifiedNs(path);
+      columnIt = columns.insert({path, getFieldColumn(field, path)}).first;
+      sourceModified[path] = modified;
+    }
+    if (!columnIt->second) {
+      continue;
+    }
+    auto indexIt = indeces.find(file.second);
+    size_t index = indexIt != indeces.end() ? indexIt->second : 0;
+    if (index < columnIt->second->size()) {
+      value = columnIt->second->at(index);
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<std::string> DataPool::consolidatedDimensions() {
+  std::vector<std::string> dimensions;
+  for (auto dim : parameterSpace().getDimensions()) {
+    bool inDataFile = false;
+    for (const auto &file : mDataFilenames) {
+      if (file.second == dim->getName()) {
+        inDataFile = true;
+      }
+    }
+    if (inDataFile || parameterSpace().isFilesystemDimension(dim->getName())) {
+      dimensions.push_back(dim->getName());
+    }
+  }
+  return dimensions;
+}
+
+std::vector<std::string>
+DataPool::directoryDimensions(const std::vector<std::string> &dimensions) {
+  std::vector<std::string> names;
+  for (const auto &dimension : dimensions) {
+    if (parameterSpace().isFilesystemDimension(dimension)) {
+      names.push_back(dimension);
+    }
+  }
+  return names;
+}
+
+int64_t DataPool::dataFilesModified(const std::string &directory) {
+  int64_t modified = 0;
+  for (const auto &file : mDataFilenames) {
+    modified = std::max(modified, fileModifiedNs(directory + file.first));
+  }
+  return modified;
+}
+
+std::string DataPool::getConsolidatedPath() {
+  // getId() would make up a temporary id
+  std::string name = mId.size() > 0 ? mId : "datapool";
+  return al::File::conformDirectory(
+             al::File::conformPathToOS(parameterSpace().getRootPath())) +
+         "tinc_consolidated_" + name + ".nc";
+}
+
+bool DataPool::consolidate(std::vector<std::string> fields) {
 #ifdef TINC_HAS_NETCDF
-  int retval, ncid;
-  if ((retval = nc_create((mSliceCacheDirectory + filename).c_str(),
-                          NC_NETCDF4 | NC_CLOBBER, &ncid))) {
-    std::cerr << "Error opening file: " << filename << std::endl;
-    filename.clear();
+  auto dimensions = consolidatedDimensions();
+  std::vector<size_t> shape;
+  size_t count = 1;
+  for (const auto &dimension : dimensions) {
+    shape.push_back(parameterSpace().getDimension(dimension)->size());
+    count *= shape.back();
   }
-  int x_dimid, varid;
-  int dimids[1];
-  if ((retval = nc_def_dim(ncid, "values", values.size(), &x_dimid))) {
-    filename.clear();
+  if (dimensions.size() == 0 || count == 0) {
+    std::cerr << "ERROR: Nothing to consolidate" << std::endl;
+    return false;
   }
-  dimids[0] = x_dimid;
 
-  /* Define the variable.*/
-  if ((retval = nc_def_var(ncid, "data", NC_FLOAT, 1, dimids, &varid))) {
-    filename.clear();
+  if (fields.size() == 0) {
+    // Take fields from the first copy found of each data file
+    auto paths = parameterSpace().runningPaths();
+    for (const auto &file : mDataFilenames) {
+      for (const auto &runPath : paths) {
+        auto path = al::File::conformDirectory(runPath) + file.first;
+        if (!al::File::exists(path)) {
+          continue;
+        }
+        auto reader = getFileReader(path);
+        DataFieldMap found;
+        if (reader && reader->readFields(path, std::string(), found)) {
+          for (const auto &f : found) {
+            if (f.first.size() > 0 && std::find(fields.begin(), fields.end(),
+                                                f.first) == fields.end()) {
+              fields.push_back(f.first);
+            }
+          }
+        }
+        break;
+      }
+    }
   }
-  if ((retval = nc_enddef(ncid))) {
-    filename.clear();
+  for (auto it = fields.begin(); it != fields.end();) {
+    if (std::find(dimensions.begin(), dimensions.end(), *it) !=
+        dimensions.end()) {
+      std::cerr << "WARNING: Field " << *it
+                << " has the name of a dimension. Not consolidated"
+                << std::endl;
+      it = fields.erase(it);
+    } else {
+      it++;
+    }
   }
-  if ((retval = nc_put_var_float(ncid, varid, values.data()))) {
-    filename.clear();
+  if (fields.size() == 0) {
+    std::cerr << "ERROR: No fields found to consolidate" << std::endl;
+    return false;
   }
-  if ((retval = nc_close(ncid))) {
-    filename.clear();
+
+  std::map<std::string, size_t> currentIndeces;
+  for (auto dim : parameterSpace().getDimensions()) {
+    currentIndeces[dim->getName()] = dim->getCurrentIndex();
+  }
+  // Take modification times before reading, so that changes during the read
+  // are seen as newer
+  auto directoryDims = directoryDimensions(dimensions);
+  std::vector<size_t> directoryShape;
+  size_t directoryCount = 1;
+  for (const auto &dimension : directoryDims) {
+    directoryShape.push_back(parameterSpace().getDimension(dimension)->size());
+    directoryCount *= directoryShape.back();
   }
+  std::vector<int64_t> sourceModified(directoryCount);
+  // Pool threads don't see this thread's ScopedParameterSpace
+  auto &ps = parameterSpace();
+  mThreadPool->parallelFor(directoryCount, [&](size_t begin, size_t end) {
+    auto indeces = currentIndeces;
+    for (size_t i = begin; i < end; i++) {
+      sliceCellIndeces(i, directoryDims, directoryShape, indeces);
+      sourceModified[i] = dataFilesModified(cellDirectory(ps, indeces));
+    }
+  });
+  std::vector<std::vector<float>> values(fields.size(),
+                                         std::vector<float>(count));
+  // Read all fields in one pass over the data files
+  mThreadPool->parallelFor(count, [&](size_t begin, size_t end) {
+    auto indeces = currentIndeces;
+    std::map<std::string, int64_t> sourceModified;
+    std::string lastDirectory;
+    std::vector<std::map<std::string, std::shared_ptr<const DataField>>>
+        columns(fields.size());
+    for (size_t i = begin; i < end; i++) {
+      sliceCellIndeces(i, dimensions, shape, indeces);
+      auto directory = cellDirectory(ps, indeces);
+      if (directory != lastDirectory) {
+        for (auto &fieldColumns : columns) {
+          fieldColumns.clear();
+        }
+        lastDirectory = directory;
+      }
+      for (size_t f = 0; f < fields.size(); f++) {
+        readCellValue(fields[f], directory, indeces, columns[f],
+                      sourceModified, values[f][i]);
+      }
+    }
+  });
 
+  // Write to a temporary file, so readers never see a partial file
+  auto path = getConsolidatedPath();
+  auto tempPath = path + ".tmp";
+  std::unique_lock<std::mutex> lk(NetCDFFileReader::libraryLock());
+  int ncid;
+  if (nc_create(tempPath.c_str(), NC_NETCDF4 | NC_CLOBBER, &ncid)) {
+    std::cerr << "ERROR creating file: " << tempPath << std::endl;
+    return false;
+  }
+  bool ok = true;
+  std::vector<int> dimids(dimensions.size());
+  std::vector<int> coordinateVarids(dimensions.size());
+  for (size_t d = 0; d < dimensions.size(); d++) {
+    ok &= nc_def_dim(ncid, dimensions[d].c_str(), shape[d], &dimids[d]) == 0;
+    ok &= nc_def_var(ncid, dimensions[d].c_str(), NC_FLOAT, 1, &dimids[d],
+                     &coordinateVarids[d]) == 0;
+  }
+  // Chunks span the last dimensions, up to TINC_CONSOLIDATED_CHUNK_SIZE
+  // values
+  std::vector<size_t> chunks(shape.size());
+  size_t chunkBudget = TINC_CONSOLIDATED_CHUNK_SIZE;
+  for (size_t d = shape.size(); d > 0; d--) {
+    chunks[d - 1] = std::max((size_t)1, std::min(shape[d - 1], chunkBudget));
+    chunkBudget = std::max((size_t)1, chunkBudget / chunks[d - 1]);
+  }
+  std::vector<int> directoryDimids;
+  for (const auto &dimension : directoryDims) {
+    auto index = std::find(dimensions.begin(), dimensions.end(), dimension) -
+                 dimensions.begin();
+    directoryDimids.push_back(dimids[index]);
+  }
+  int sourceModifiedVarid;
+  ok &= nc_def_var(ncid, "tinc_source_modified", NC_INT64,
+                   (int)directoryDimids.size(), directoryDimids.data(),
+                   &sourceModifiedVarid) == 0;
+  float fillValue = std::numeric_limits<float>::quiet_NaN();
+  std::vector<int> varids(fields.size());
+  for (size_t f = 0; f < fields.size(); f++) {
+    ok &= nc_def_var(ncid, fields[f].c_str(), NC_FLOAT, (int)dimids.size(),
+                     dimids.data(), &varids[f]) == 0;
+    ok &= nc_def_var_chunking(ncid, varids[f], NC_CHUNKED, chunks.data()) == 0;
+    ok &= nc_def_var_fill(ncid, varids[f], 0, &fillValue) == 0;
+  }
+  json dataFiles = mDataFilenames;
+  json dimensionNames = dimensions;
+  auto dataFilesText = dataFiles.dump();
+  auto dimensionsText = dimensionNames.dump();
+  ok &= nc_put_att_text(ncid, NC_GLOBAL, "tinc_data_files",
+                        dataFilesText.size(), dataFilesText.c_str()) == 0;
+  ok &= nc_put_att_text(ncid, NC_GLOBAL, "tinc_dimensions",
+                        dimensionsText.size(), dimensionsText.c_str()) == 0;
+  ok &= nc_enddef(ncid) == 0;
+  for (size_t d = 0; d < dimensions.size(); d++) {
+    auto dim = parameterSpace().getDimension(dimensions[d]);
+    std::vector<float> coordinates(dim->size());
+    for (size_t i = 0; i < coordinates.size(); i++) {
+      coordinates[i] = dim->at(i);
+    }
+    ok &= nc_put_var_float(ncid, coordinateVarids[d], coordinates.data()) == 0;
+  }
+  ok &= nc_put_var_longlong(ncid, sourceModifiedVarid,
+                            (const long long *)sourceModified.data()) == 0;
+  for (size_t f = 0; f < fields.size(); f++) {
+    ok &= nc_put_var_float(ncid, varids[f], values[f].data()) == 0;
+  }
+  ok &= nc_close(ncid) == 0;
+  lk.unlock();
+  if (!ok) {
+    std::cerr << "ERROR writing consolidated file: " << tempPath << std::endl;
+    std::remove(tempPath.c_str());
+    return false;
+  }
+  // Replace the file in one step, so readers see either the old or the new
+  // consolidated file
+#ifdef AL_WINDOWS
+  if (!MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
 #else
-  std::cerr << " ERROR not implemented" << std::endl;
-  filename.clear();
+  if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+#endif
+    std::cerr << "ERROR moving consolidated file to: " << path << std::endl;
+    std::remove(tempPath.c_str());
+    return false;
+  }
+  return true;
+#else
+  std::cerr << "ERROR: consolidate() requires NetCDF support" << std::endl;
+  return false;
 #endif
-  return filename;
 }
 
-size_t DataPool::readDataSlice(std::string field, std::string sliceDimension,
-                               void *data, size_t maxLen) {
-  auto filename = DataPool::createDataSlice(field, sliceDimension);
-  if (filename.size() > 0) {
+bool DataPool::getConsolidatedInfo(ConsolidatedInfo &info) {
+  auto path = getConsolidatedPath();
+  auto modified = fileModifiedNs(path);
+  if (modified == 0) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lk(mConsolidatedInfoLock);
+  if (mConsolidatedInfo.modified != modified) {
 #ifdef TINC_HAS_NETCDF
-    int retval, ncid, varid, nattsp;
-    size_t lenp;
-    nc_type xtypep;
-    int ndimsp;
-    int dimidsp[32];
-    if ((retval = nc_open(filename.c_str(), NC_NETCDF4, &ncid))) {
-      std::cerr << "Error opening file: " << filename << std::endl;
-    }
-    if ((retval = nc_inq_varid(ncid, "data", &varid))) {
-      return 0;
+    ConsolidatedInfo newInfo;
+    newInfo.modified = modified;
+    std::unique_lock<std::mutex> ncLock(NetCDFFileReader::libraryLock());
+    int ncid;
+    if (nc_open(path.c_str(), NC_NOWRITE, &ncid)) {
+      return false;
+    }
+    std::string dimensionsText;
+    bool ok = readTextAttribute(ncid, "tinc_data_files", newInfo.dataFiles) &&
+              readTextAttribute(ncid, "tinc_dimensions", dimensionsText);
+    try {
+      if (ok) {
+        newInfo.dimensions =
+            json::parse(dimensionsText).get<std::vector<std::string>>();
+      }
+    } catch (std::exception &e) {
+      ok = false;
+    }
+    size_t directoryCount = 1;
+    for (size_t d = 0; ok && d < newInfo.dimensions.size(); d++) {
+      int dimid;
+      size_t len;
+      ok = nc_inq_dimid(ncid, newInfo.dimensions[d].c_str(), &dimid) == 0 &&
+           nc_inq_dimlen(ncid, dimid, &len) == 0;
+      newInfo.shape.push_back(len);
+      if (parameterSpace().isFilesystemDimension(newInfo.dimensions[d])) {
+        directoryCount *= len;
+      }
     }
+    // Files without modification times can't be checked, so they are not
+    // used
+    int varid;
+    if (ok && nc_inq_varid(ncid, "tinc_source_modified", &varid) == 0) {
+      newInfo.sourceModified.resize(directoryCount);
+      ok = nc_get_var_longlong(
+               ncid, varid, (long long *)newInfo.sourceModified.data()) == 0;
+    } else {
+      ok = false;
+    }
+    nc_close(ncid);
+    if (!ok) {
+      std::cerr << "ERROR reading consolidated file: " << path << std::endl;
+      return false;
+    }
+    mConsolidatedInfo = newInfo;
+#else
+    return false;
+#endif
+  }
+  info = mConsolidatedInfo;
+  lk.unlock();
 
-    if ((retval = nc_inq_var(ncid, varid, nullptr, &xtypep, &ndimsp, dimidsp,
-                             &nattsp))) {
-      return 0;
+  // Check that it still matches the data pool
+  json dataFiles = mDataFilenames;
+  if (info.dataFiles != dataFiles.dump() ||
+      info.dimensions != consolidatedDimensions()) {
+    return false;
+  }
+  for (size_t d = 0; d < info.dimensions.size(); d++) {
+    if (parameterSpace().getDimension(info.dimensions[d])->size() !=
+        info.shape[d]) {
+      return false;
     }
-    if ((retval = nc_inq_dimlen(ncid, dimidsp[0], &lenp))) {
-      return 0;
+  }
+  return true;
+}
+
+bool DataPool::gatherConsolidatedSlice(
+    const std::string &field, const std::vector<std::string> &sliceDimensions,
+    float *values, SliceProvenance &provenance, bool &complete) {
+  ConsolidatedInfo info;
+  if (!getConsolidatedInfo(info)) {
+    return false;
+  }
+  auto path = getConsolidatedPath();
+  auto column = getFieldColumn(field, path);
+  size_t storeCount = 1;
+  for (auto size : info.shape) {
+    storeCount *= size;
+  }
+  if (!column || column->size() != storeCount) {
+    // Field not consolidated
+    return false;
+  }
+  std::vector<size_t> shape;
+  size_t count = 1;
+  for (auto sliceDimension : sliceDimensions) {
+    shape.push_back(parameterSpace().getDimension(sliceDimension)->size());
+    count *= shape.back();
+  }
+  // Run directories in the slice, by index in info.sourceModified
+  auto directoryDims = directoryDimensions(info.dimensions);
+  std::map<size_t, std::map<std::string, size_t>> directories;
+  {
+    auto indeces = provenance.fixedIndeces;
+    for (size_t i = 0; i < count; i++) {
+      sliceCellIndeces(i, sliceDimensions, shape, indeces);
+      size_t directoryIndex = 0;
+      for (size_t d = 0; d < info.dimensions.size(); d++) {
+        if (std::find(directoryDims.begin(), directoryDims.end(),
+                      info.dimensions[d]) != directoryDims.end()) {
+          auto indexIt = indeces.find(info.dimensions[d]);
+          directoryIndex = directoryIndex * info.shape[d] +
+                           (indexIt != indeces.end() ? indexIt->second : 0);
+        }
+      }
+      if (directories.find(directoryIndex) == directories.end()) {
+        directories[directoryIndex] = indeces;
+      }
+    }
+  }
+  // The slice also depends on the data files, so changes to them are seen
+  // by sliceIsCurrent()
+  for (const auto &directory : directories) {
+    auto path = cellDirectory(parameterSpace(), directory.second);
+    int64_t newest = 0;
+    for (const auto &file : mDataFilenames) {
+      auto modified = fileModifiedNs(path + file.first);
+      provenance.sourceModified[path + file.first] = modified;
+      newest = std::max(newest, modified);
+    }
+    if (directory.first >= info.sourceModified.size() ||
+        newest > info.sourceModified[directory.first]) {
+      // Read the data files until consolidate() is run again
+      return false;
+    }
+  }
+  std::atomic<bool> missing(false);
+  mThreadPool->parallelFor(count, [&](size_t begin, size_t end) {
+    auto indeces = provenance.fixedIndeces;
+    for (size_t i = begin; i < end; i++) {
+      sliceCellIndeces(i, sliceDimensions, shape, indeces);
+      size_t index = 0;
+      for (size_t d = 0; d < info.dimensions.size(); d++) {
+        auto indexIt = indeces.find(info.dimensions[d]);
+        index = index * info.shape[d] +
+                (indexIt != indeces.end() ? indexIt->second : 0);
+      }
+      values[i] = column->at(index);
+      if (values[i] != values[i]) {
+        missing = true;
+      }
+    }
+  });
+  provenance.sourceModified[path] = info.modified;
+  complete = !missing;
+  return true;
+}
+
+void DataPool::setLiveSlices(bool live) {
+  mUseLiveSlices = live;
+  if (!live) {
+    clearLiveSlices();
+  }
+}
+
+void DataPool::clearLiveSlices() {
+  std::unique_lock<std::mutex> lk(mLiveSlicesLock);
+  mLiveSlices.clear();
+  mLiveSliceUsage.clear();
+}
+
+void DataPool::setMaxLiveSlices(size_t count) {
+  std::unique_lock<std::mutex> lk(mLiveSlicesLock);
+  mMaxLiveSlices = count;
+  while (mLiveSliceUsage.size() > mMaxLiveSlices) {
+    mLiveSlices.erase(mLiveSliceUsage.back());
+    mLiveSliceUsage.pop_back();
+  }
+}
+
+std::shared_ptr<DataPool::LiveSlice>
+DataPool::getLiveSlice(const std::string &filename) {
+  std::unique_lock<std::mutex> lk(mLiveSlicesLock);
+  auto it = mLiveSlices.find(filename);
+  if (it != mLiveSlices.end()) {
+    mLiveSliceUsage.splice(mLiveSliceUsage.begin(), mLiveSliceUsage,
+                           it->second.usage);
+    return it->second.slice;
+  }
+  auto live = std::make_shared<LiveSlice>();
+  if (mMaxLiveSlices == 0) {
+    // Not kept, so the slice is read completely every time
+    return live;
+  }
+  // Slices dropped here stay valid for callers still holding them
+  while (mLiveSliceUsage.size() >= mMaxLiveSlices) {
+    mLiveSlices.erase(mLiveSliceUsage.back());
+    mLiveSliceUsage.pop_back();
+  }
+  mLiveSliceUsage.push_front(filename);
+  mLiveSlices[filename] = {live, mLiveSliceUsage.begin()};
+  return live;
+}
+
+void DataPool::updateLiveSlice(LiveSlice &live,
+                               const std::vector<std::string> &sliceDimensions,
+                               const SliceProvenance &provenance,
+                               std::vector<size_t> &changedCells) {
+  std::vector<size_t> shape;
+  size_t count = 1;
+  for (auto sliceDimension : sliceDimensions) {
+    shape.push_back(parameterSpace().getDimension(sliceDimension)->size());
+    count *= shape.back();
+  }
+  if (live.values.size() != count || live.provenance.shape != shape) {
+    // First use or the slice dimensions changed. Read the whole slice and
+    // the state of its files.
+    live.provenance = provenance;
+    live.values.resize(count);
+    live.directoryCells.clear();
+    live.fileModified.clear();
+    live.fileWritten = false;
+    auto indeces = provenance.fixedIndeces;
+    for (size_t i = 0; i < count; i++) {
+      sliceCellIndeces(i, sliceDimensions, shape, indeces);
+      auto directory = cellDirectory(parameterSpace(), indeces);
+      live.directoryCells[directory].push_back(i);
+    }
+    for (const auto &directory : live.directoryCells) {
+      for (const auto &file : mDataFilenames) {
+        auto path = directory.first + file.first;
+        live.fileModified[path] = fileModifiedNs(path);
+      }
     }
+    gatherSlice(provenance.field, sliceDimensions, live.values.data(),
+                live.provenance);
+    changedCells.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      changedCells[i] = i;
+    }
+    return;
+  }
 
-    if (maxLen >= lenp) {
-      if ((retval = nc_get_var(ncid, varid, data))) {
-        return 0;
+  std::vector<const std::pair<const std::string, std::vector<size_t>> *>
+      directories;
+  for (const auto &directory : live.directoryCells) {
+    directories.push_back(&directory);
+  }
+  std::map<std::string, int64_t> updatedFiles;
+  std::mutex updateLock;
+  mThreadPool->parallelFor(directories.size(), [&](size_t begin, size_t end) {
+    std::map<std::string, int64_t> fileModified;
+    std::map<std::string, int64_t> sourceModified;
+    std::vector<size_t> cells;
+    auto indeces = provenance.fixedIndeces;
+    for (size_t d = begin; d < end; d++) {
+      const auto &directory = directories[d]->first;
+      std::map<std::string, int64_t> directoryFiles;
+      bool changed = false;
+      for (const auto &file : mDataFilenames) {
+        auto path = directory + file.first;
+        auto modified = fileModifiedNs(path);
+        auto knownIt = live.fileModified.find(path);
+        if (knownIt == live.fileModified.end() ||
+            knownIt->second != modified) {
+          changed = true;
+        }
+        directoryFiles[path] = modified;
+      }
+      if (!changed) {
+        continue;
+      }
+      fileModified.insert(directoryFiles.begin(), directoryFiles.end());
+      // Only cells from this directory need to be read again
+      std::map<std::string, std::shared_ptr<const DataField>> columns;
+      for (auto cell : directories[d]->second) {
+        sliceCellIndeces(cell, sliceDimensions, shape, indeces);
+        readCellValue(provenance.field, directory, indeces, columns,
+                      sourceModified, live.values[cell]);
+        cells.push_back(cell);
       }
-      return lenp;
     }
+    std::unique_lock<std::mutex> lk(updateLock);
+    for (const auto &file : fileModified) {
+      live.provenance.sourceModified.erase(file.first);
+    }
+    live.provenance.sourceModified.insert(sourceModified.begin(),
+                                          sourceModified.end());
+    updatedFiles.insert(fileModified.begin(), fileModified.end());
+    changedCells.insert(changedCells.end(), cells.begin(), cells.end());
+  });
+  // Tasks read fileModified, so update it after they finish
+  for (const auto &file : updatedFiles) {
+    live.fileModified[file.first] = file.second;
+  }
+}
+bool DataPool::writeSliceFile(const std::string &filename,
+                              const std::vector<std::string> &sliceDimensions,
+                              const std::vector<float> &values,
+                              const SliceProvenance &provenance) {
+  return writeSliceFile(filename, sliceDimensions, {"data"}, {values.data()},
+                        provenance);
+}
+
+bool DataPool::writeSliceFile(const std::string &filename,
+                              const std::vector<std::string> &sliceDimensions,
+                              const std::vector<std::string> &variables,
+                              const std::vector<const float *> &values,
+                              const SliceProvenance &provenance) {
+#ifdef TINC_HAS_NETCDF
+  std::unique_lock<std::mutex> lk(NetCDFFileReader::libraryLock());
+  int retval, ncid;
+  if ((retval = nc_create((mSliceCacheDirectory + filename).c_str(),
+                          NC_NETCDF4 | NC_CLOBBER, &ncid))) {
+    std::cerr << "Error opening file: " << filename << std::endl;
+    return false;
+  }
+  bool ok = true;
+  std::vector<int> dimids(sliceDimensions.size());
+  std::vector<int> coordinateVarids(sliceDimensions.size());
+  std::vector<int> varids(variables.size());
+  for (size_t d = 0; d < sliceDimensions.size(); d++) {
+    auto dim = parameterSpace().getDimension(sliceDimensions[d]);
+    if ((retval = nc_def_dim(ncid, sliceDimensions[d].c_str(), dim->size(),
+                             &dimids[d]))) {
+      ok = false;
+    }
+    // Coordinate variable with the values of the dimension
+    if ((retval = nc_def_var(ncid, sliceDimensions[d].c_str(), NC_FLOAT, 1,
+                             &dimids[d], &coordinateVarids[d]))) {
+      ok = false;
+    }
+  }
+
+  /* Define one variable per field.*/
+  for (size_t v = 0; v < variables.size(); v++) {
+    if ((retval = nc_def_var(ncid, variables[v].c_str(), NC_FLOAT,
+                             (int)dimids.size(), dimids.data(), &varids[v]))) {
+      ok = false;
+    }
+  }
+  if (!writeSliceProvenance(ncid, provenance)) {
+    ok = false;
+  }
+  if ((retval = nc_enddef(ncid))) {
+    ok = false;
+  }
+  for (size_t d = 0; d < sliceDimensions.size(); d++) {
+    auto dim = parameterSpace().getDimension(sliceDimensions[d]);
+    std::vector<float> coordinates(dim->size());
+    for (size_t i = 0; i < coordinates.size(); i++) {
+      coordinates[i] = dim->at(i);
+    }
+    if ((retval = nc_put_var_float(ncid, coordinateVarids[d],
+                                   coordinates.data()))) {
+      ok = false;
+    }
+  }
+  for (size_t v = 0; v < variables.size(); v++) {
+    if ((retval = nc_put_var_float(ncid, varids[v], values[v]))) {
+      ok = false;
+    }
+  }
+  if ((retval = nc_close(ncid))) {
+    ok = false;
+  }
+  lk.unlock();
+  if (ok) {
+    std::unique_lock<std::mutex> indexLock(mSliceIndexLock);
+    mSliceIndex[filename] = provenance;
+  }
+  return ok;
+#else
+  std::cerr << " ERROR not implemented" << std::endl;
+  return false;
 #endif
-    return 0; // FIXME finish the edge case
-  } else {
-    return 0;
+}
+
+bool DataPool::writeSliceCells(const std::string &filename,
+                               const std::vector<std::string> &sliceDimensions,
+                               const std::vector<float> &values,
+                               const std::vector<size_t> &cells,
+                               const SliceProvenance &provenance) {
+#ifdef TINC_HAS_NETCDF
+  std::unique_lock<std::mutex> lk(NetCDFFileReader::libraryLock());
+  int ncid, varid;
+  if (nc_open((mSliceCacheDirectory + filename).c_str(), NC_WRITE, &ncid)) {
+    return false;
+  }
+  bool ok = nc_inq_varid(ncid, "data", &varid) == 0;
+  std::vector<size_t> shape;
+  for (auto sliceDimension : sliceDimensions) {
+    shape.push_back(parameterSpace().getDimension(sliceDimension)->size());
+  }
+  std::vector<size_t> index(shape.size());
+  for (size_t i = 0; ok && i < cells.size(); i++) {
+    size_t cell = cells[i];
+    for (size_t d = shape.size(); d > 0; d--) {
+      index[d - 1] = cell % shape[d - 1];
+      cell /= shape[d - 1];
+    }
+    ok = nc_put_var1_float(ncid, varid, index.data(), &values[cells[i]]) ==
+         0;
   }
+  ok = ok && nc_redef(ncid) == 0 && writeSliceProvenance(ncid, provenance) &&
+       nc_enddef(ncid) == 0;
+  ok &= nc_close(ncid) == 0;
+  lk.unlock();
+  if (ok) {
+    std::unique_lock<std::mutex> indexLock(mSliceIndexLock);
+    mSliceIndex[filename] = provenance;
+  }
+  return ok;
+#else
+  return false;
+#endif
 }
 
 void DataPool::setCacheDirectory(std::string cacheDirectory) {
@@ -199,52 +1230,303 @@ void DataPool::setCacheDirectory(std::string cacheDirectory) {
     }
   }
   mSliceCacheDirectory = cacheDirectory;
+  {
+    std::unique_lock<std::mutex> lk(mSliceIndexLock);
+    mSliceIndex.clear();
+  }
+  clearLiveSlices();
   modified();
 }
 
+bool DataPool::sliceIsCurrent(const std::string &filename,
+                              const SliceProvenance &provenance) {
+  if (!al::File::exists(mSliceCacheDirectory + filename)) {
+    return false;
+  }
+  SliceProvenance stored;
+  {
+    std::unique_lock<std::mutex> lk(mSliceIndexLock);
+    auto it = mSliceIndex.find(filename);
+    if (it != mSliceIndex.end()) {
+      stored = it->second;
+    } else {
+      // Slice written by a previous run
+      lk.unlock();
+      if (!readSliceProvenance(mSliceCacheDirectory + filename, stored)) {
+        return false;
+      }
+      lk.lock();
+      mSliceIndex[filename] = stored;
+    }
+  }
+  if (stored.field != provenance.field ||
+      stored.sliceDimensions != provenance.sliceDimensions ||
+      stored.shape != provenance.shape ||
+      stored.fixedIndeces != provenance.fixedIndeces ||
+      stored.sourceModified.size() == 0) {
+    return false;
+  }
+  for (const auto &source : stored.sourceModified) {
+    if (fileModifiedNs(source.first) != source.second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DataPool::readSliceProvenance(const std::string &path,
+                                   SliceProvenance &provenance) {
+#ifdef TINC_HAS_NETCDF
+  std::unique_lock<std::mutex> lk(NetCDFFileReader::libraryLock());
+  int ncid;
+  if (nc_open(path.c_str(), NC_NOWRITE, &ncid)) {
+    return false;
+  }
+  std::string field, sliceDimensions, shape, fixedIndeces, sourceModified;
+  bool ok =
+      readTextAttribute(ncid, "tinc_field", field) &&
+      readTextAttribute(ncid, "tinc_slice_dimensions", sliceDimensions) &&
+      readTextAttribute(ncid, "tinc_slice_shape", shape) &&
+      readTextAttribute(ncid, "tinc_fixed_indeces", fixedIndeces) &&
+      readTextAttribute(ncid, "tinc_source_modified", sourceModified);
+  nc_close(ncid);
+  lk.unlock();
+  if (!ok) {
+    return false;
+  }
+  try {
+    provenance.field = field;
+    provenance.sliceDimensions =
+        json::parse(sliceDimensions).get<std::vector<std::string>>();
+    provenance.shape = json::parse(shape).get<std::vector<size_t>>();
+    provenance.fixedIndeces =
+        json::parse(fixedIndeces).get<std::map<std::string, size_t>>();
+    provenance.sourceModified =
+        json::parse(sourceModified).get<std::map<std::string, int64_t>>();
+  } catch (std::exception &e) {
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool DataPool::writeSliceProvenance(int ncid,
+                                    const SliceProvenance &provenance) {
+#ifdef TINC_HAS_NETCDF
+  auto writeText = [ncid](const char *name, const std::string &text) {
+    return nc_put_att_text(ncid, NC_GLOBAL, name, text.size(),
+                           text.c_str()) == 0;
+  };
+  json sliceDimensions = provenance.sliceDimensions;
+  json shape = provenance.shape;
+  json fixedIndeces = provenance.fixedIndeces;
+  json sourceModified = provenance.sourceModified;
+  return writeText("tinc_field", provenance.field) &&
+         writeText("tinc_slice_dimensions", sliceDimensions.dump()) &&
+         writeText("tinc_slice_shape", shape.dump()) &&
+         writeText("tinc_fixed_indeces", fixedIndeces.dump()) &&
+         writeText("tinc_source_modified", sourceModified.dump());
+#else
+  return false;
+#endif
+}
+
 bool DataPool::getFieldFromFile(std::string field, std::string file,
                                 size_t dimensionInFileIndex, void *data) {
-  std::ifstream f(file);
-  if (!f.good()) {
-    std::cerr << "ERROR reading file: " << file << std::endl;
+  auto column = getFieldColumn(field, file);
+  if (!column || dimensionInFileIndex >= column->size()) {
     return false;
   }
-  json j = json::parse(f);
-  auto fieldData = j[field].at(dimensionInFileIndex).get<float>();
-  *(float *)data = fieldData;
+  *(float *)data = column->at(dimensionInFileIndex);
   return true;
 }
 
 bool DataPool::getFieldFromFile(std::string field, std::string file, void *data,
                                 size_t length) {
+  auto column = getFieldColumn(field, file);
+  if (!column) {
+    return false;
+  }
+  if (column->size() < length) {
+    std::cerr << "ERROR: field " << field << " in " << file << " has "
+              << column->size() << " values. Expected " << length
+              << std::endl;
+    return false;
+  }
+  return column->read((float *)data, 0, length);
+}
 
-  auto fileType = getFileType(file);
-  std::ifstream f(file);
-  if (!f.good()) {
+std::shared_ptr<const DataField>
+DataPool::getFieldColumn(const std::string &field, const std::string &file) {
+  struct stat s;
+  if (::stat(file.c_str(), &s) != 0) {
     std::cerr << "ERROR reading file: " << file << std::endl;
-    return false;
+    return nullptr;
   }
-  json j;
-  f >> j;
-  auto fieldData = j[field];
-  if (fieldData && fieldData.is_array()) {
-    memcpy((float *)data, fieldData.get<std::vector<float>>().data(),
-           length * sizeof(float));
+  auto modified = modifiedNs(s);
+  {
+    std::unique_lock<std::mutex> lk(mParsedFilesLock);
+    auto it = mParsedFiles.find(file);
+    if (it != mParsedFiles.end() && it->second.modified == modified &&
+        it->second.size == (uint64_t)s.st_size) {
+      mParsedFileUsage.splice(mParsedFileUsage.begin(), mParsedFileUsage,
+                              it->second.usage);
+      auto fieldIt = it->second.fields.find(field);
+      if (fieldIt != it->second.fields.end()) {
+        return fieldIt->second;
+      }
+      if (it->second.complete) {
+        return nullptr;
+      }
+    }
+  }
+
+  auto reader = getFileReader(file);
+  if (!reader) {
+    return nullptr;
+  }
+  // Read outside the lock, so files can be read concurrently
+  DataFieldMap fields;
+  if (!reader->readFields(file, field, fields)) {
+    return nullptr;
+  }
+  std::shared_ptr<const DataField> column;
+  auto fieldIt = fields.find(field);
+  if (fieldIt != fields.end()) {
+    column = fieldIt->second;
+  }
+  std::unique_lock<std::mutex> lk(mParsedFilesLock);
+  auto it = mParsedFiles.find(file);
+  if ((uint64_t)s.st_size > mMaxParsedFileBytes) {
+    // Not kept, so the file is read every time
+    if (it != mParsedFiles.end()) {
+      mParsedFileBytes -= it->second.size;
+      mParsedFileUsage.erase(it->second.usage);
+      mParsedFiles.erase(it);
+    }
+    return column;
+  }
+  if (it == mParsedFiles.end()) {
+    mParsedFileUsage.push_front(file);
+    it = mParsedFiles.insert({file, ParsedFile()}).first;
+    it->second.usage = mParsedFileUsage.begin();
   } else {
-    return false;
+    mParsedFileUsage.splice(mParsedFileUsage.begin(), mParsedFileUsage,
+                            it->second.usage);
   }
-  return true;
+  auto &parsed = it->second;
+  if (parsed.modified != modified || parsed.size != (uint64_t)s.st_size) {
+    mParsedFileBytes -= parsed.size;
+    parsed.fields.clear();
+    parsed.modified = modified;
+    parsed.size = s.st_size;
+    mParsedFileBytes += parsed.size;
+  }
+  for (auto &f : fields) {
+    parsed.fields[f.first] = f.second;
+  }
+  parsed.complete = reader->readsAllFields();
+  trimParsedFiles();
+  return column;
+}
+
+void DataPool::trimParsedFiles() {
+  // Fields dropped here stay valid for callers still holding them
+  while (mParsedFileBytes > mMaxParsedFileBytes &&
+         mParsedFileUsage.size() > 0) {
+    auto it = mParsedFiles.find(mParsedFileUsage.back());
+    mParsedFileBytes -= it->second.size;
+    mParsedFiles.erase(it);
+    mParsedFileUsage.pop_back();
+  }
+}
+
+std::shared_ptr<DataFileReader>
+DataPool::getFileReader(const std::string &file) {
+  auto type = getFileType(file);
+  std::unique_lock<std::mutex> lk(mFileReadersLock);
+  auto readerIt = mFileReaders.find(type);
+  if (readerIt == mFileReaders.end()) {
+    std::cerr << "ERROR: No reader for file type " << type << ": " << file
+              << std::endl;
+    return nullptr;
+  }
+  return readerIt->second;
+}
+
+void DataPool::clearParsedFileCache() {
+  std::unique_lock<std::mutex> lk(mParsedFilesLock);
+  mParsedFiles.clear();
+  mParsedFileUsage.clear();
+  mParsedFileBytes = 0;
+}
+
+void DataPool::setMaxParsedFileBytes(uint64_t maxBytes) {
+  std::unique_lock<std::mutex> lk(mParsedFilesLock);
+  mMaxParsedFileBytes = maxBytes;
+  trimParsedFiles();
 }
 
-std::string DataPool::getFileType(std::string file) { /*if (file.substr())*/
-  std::string type;
-  return type;
+void DataPool::registerFileReader(std::string type,
+                                  std::shared_ptr<DataFileReader> reader,
+                                  std::vector<std::string> extensions,
+                                  std::vector<std::string> magic) {
+  {
+    std::unique_lock<std::mutex> lk(mFileReadersLock);
+    mFileReaders[type] = reader;
+    for (auto extension : extensions) {
+      std::transform(extension.begin(), extension.end(), extension.begin(),
+                     ::tolower);
+      mFileExtensions[extension] = type;
+    }
+    for (const auto &m : magic) {
+      mFileMagic.push_back({m, type});
+    }
+  }
+  // Files may now be read differently
+  clearParsedFileCache();
+}
+
+void DataPool::registerDefaultFileReaders() {
+  registerFileReader("json", std::make_shared<JsonFileReader>(), {".json"});
+  registerFileReader("csv", std::make_shared<CsvFileReader>(), {".csv"});
+  registerFileReader("netcdf", std::make_shared<NetCDFFileReader>(),
+                     {".nc", ".nc4"},
+                     {std::string("CDF\x01", 4), std::string("CDF\x02", 4),
+                      std::string("CDF\x05", 4), "\x89HDF"});
+  registerFileReader("binary", std::make_shared<BinaryFileReader>(),
+                     {".bin", ".raw"});
+}
+
+std::string DataPool::getFileType(std::string file) {
+  auto extension = al::File::extension(file);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 ::tolower);
+  std::unique_lock<std::mutex> lk(mFileReadersLock);
+  auto extensionIt = mFileExtensions.find(extension);
+  if (extensionIt != mFileExtensions.end()) {
+    return extensionIt->second;
+  }
+  if (mFileMagic.size() > 0) {
+    std::ifstream f(file, std::ios::binary);
+    char start[16];
+    f.read(start, sizeof(start));
+    std::string header(start, (size_t)f.gcount());
+    for (const auto &magic : mFileMagic) {
+      if (header.compare(0, magic.first.size(), magic.first) == 0) {
+        return magic.second;
+      }
+    }
+  }
+  return "json";
 }
 
 std::vector<std::string> DataPool::getCurrentFiles() {
   std::vector<std::string> files;
-  std::string path = al::File::conformPathToOS(mParameterSpace->getRootPath()) +
-                     mParameterSpace->currentRelativeRunPath();
+  std::string path = al::File::conformPathToOS(parameterSpace().getRootPath()) +
+                     parameterSpace().currentRelativeRunPath();
   for (auto f : mDataFilenames) {
     files.push_back(path + f.first);
   }
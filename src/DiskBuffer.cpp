@@ -1,7 +1,131 @@
 #include "tinc/DiskBuffer.hpp"
+#include "FileModified.hpp"
+#include "tinc/FileWatcher.hpp"
+#include "tinc/ThreadPool.hpp"
+
+#define TINC_DISKBUFFER_IO_THREADS 4
+#define TINC_DISKBUFFER_WRITABLE_TIMEOUT 1.0f
 
 using namespace tinc;
 
+namespace {
+// Split path into directory, including the trailing separator, and name
+void splitPath(const std::string &path, std::string &directory,
+               std::string &name) {
+  auto separator = path.find_last_of("/\\");
+  if (separator == std::string::npos) {
+    directory = "";
+    name = path;
+  } else {
+    directory = path.substr(0, separator + 1);
+    name = path.substr(separator + 1);
+  }
+}
+
+// Set while updateData() runs on the I/O threads or the watcher's thread
+thread_local bool backgroundUpdate = false;
+
+struct BackgroundUpdate {
+  BackgroundUpdate() { backgroundUpdate = true; }
+  ~BackgroundUpdate() { backgroundUpdate = false; }
+};
+} // namespace
+
+void DiskBufferAbstract::setFileWatcher(
+    std::shared_ptr<FileWatcher> fileWatcher) {
+  stopWatchingFile();
+  if (!fileWatcher) {
+    return;
+  }
+  std::string directory, name;
+  splitPath(getPath() + getCurrentFileName(), directory, name);
+  mFileWatcher = fileWatcher;
+  mFileWatchId =
+      fileWatcher->watch(directory, [this, directory](const std::string &file) {
+        // The file name may have changed since watching started
+        std::string currentDirectory, currentName;
+        splitPath(getPath() + getCurrentFileName(), currentDirectory,
+                  currentName);
+        if (currentDirectory == directory && currentName == file) {
+          BackgroundUpdate background;
+          updateData("");
+        }
+      });
+  if (mFileWatchId == 0) {
+    mFileWatcher = nullptr;
+  }
+}
+
+void DiskBufferAbstract::updateDataAsync(std::string filename) {
+  std::unique_lock<std::mutex> lk(mAsyncLock);
+  mAsyncUpdateFilename = filename;
+  if (mAsyncUpdateRunning) {
+    // Picked up when the running update finishes
+    mAsyncUpdateQueued = true;
+    return;
+  }
+  mAsyncUpdateRunning = true;
+  lk.unlock();
+  runAsync([this]() {
+    std::unique_lock<std::mutex> lk(mAsyncLock);
+    do {
+      std::string filename = mAsyncUpdateFilename;
+      mAsyncUpdateQueued = false;
+      lk.unlock();
+      {
+        BackgroundUpdate background;
+        updateData(filename);
+      }
+      lk.lock();
+    } while (mAsyncUpdateQueued);
+    mAsyncUpdateRunning = false;
+  });
+}
+
+void DiskBufferAbstract::waitForAsyncTasks() {
+  std::unique_lock<std::mutex> lk(mAsyncLock);
+  mAsyncSignal.wait(lk, [this]() { return mAsyncTasks == 0; });
+}
+
+ThreadPool &DiskBufferAbstract::ioThreadPool() {
+  static ThreadPool pool(TINC_DISKBUFFER_IO_THREADS);
+  return pool;
+}
+
+void DiskBufferAbstract::runAsync(std::function<void()> task) {
+  {
+    std::unique_lock<std::mutex> lk(mAsyncLock);
+    mAsyncTasks++;
+  }
+  ioThreadPool().push([this, task]() {
+    task();
+    std::unique_lock<std::mutex> lk(mAsyncLock);
+    mAsyncTasks--;
+    mAsyncSignal.notify_all();
+  });
+}
+
+float DiskBufferAbstract::writableTimeout() {
+  return backgroundUpdate ? TINC_DISKBUFFER_WRITABLE_TIMEOUT : -1.0f;
+}
+
+int64_t DiskBufferAbstract::fileModified(const std::string &path) {
+  return fileModifiedNs(path);
+}
+
+void DiskBufferAbstract::shutdown() {
+  stopWatchingFile();
+  waitForAsyncTasks();
+}
+
+void DiskBufferAbstract::stopWatchingFile() {
+  if (mFileWatcher) {
+    mFileWatcher->unwatch(mFileWatchId);
+    mFileWatcher = nullptr;
+    mFileWatchId = 0;
+  }
+}
+
 // void AbstractDiskBuffer::exposeToNetwork(al::ParameterServer &p) {
 //  if (m_trigger) {
 //    std::cerr << "ERROR: already registered. Aborting." << std::endl;
@@ -0,0 +1,145 @@
+#include "tinc/DiskBufferMapped.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef AL_WINDOWS
+#include <windows.h>
+#endif
+
+using namespace tinc;
+
+namespace {
+const char MAPPED_ARRAY_MAGIC[4] = {'T', 'N', 'C', 'A'};
+}
+
+bool MappedArray::setFile(std::shared_ptr<MappedFile> file) {
+  const uint8_t *bytes = file ? file->data() : nullptr;
+  if (!bytes || file->size() < HEADER_PREFIX_SIZE ||
+      memcmp(bytes, MAPPED_ARRAY_MAGIC, 4) != 0) {
+    std::cerr << "ERROR: Not an array file" << std::endl;
+    return false;
+  }
+  if (bytes[4] != FORMAT_VERSION || bytes[5] > BinaryFileReader::UINT64) {
+    std::cerr << "ERROR: Unsupported array file version or type" << std::endl;
+    return false;
+  }
+  auto type = (BinaryFileReader::DataType)bytes[5];
+  uint16_t dimensionCount;
+  memcpy(&dimensionCount, bytes + 6, sizeof(uint16_t));
+  size_t headerSize = HEADER_PREFIX_SIZE + dimensionCount * sizeof(uint64_t);
+  if (file->size() < headerSize) {
+    std::cerr << "ERROR: Array file header truncated" << std::endl;
+    return false;
+  }
+  // Sizes in the header are not trusted, so the value count and byte size
+  // are checked for overflow before comparing them to the file size
+  std::vector<size_t> shape(dimensionCount);
+  size_t count = 1;
+  for (size_t i = 0; i < dimensionCount; i++) {
+    uint64_t size;
+    memcpy(&size, bytes + HEADER_PREFIX_SIZE + i * sizeof(uint64_t),
+           sizeof(uint64_t));
+    if (size > SIZE_MAX || (size > 0 && count > SIZE_MAX / size)) {
+      std::cerr << "ERROR: Array file shape too large" << std::endl;
+      return false;
+    }
+    shape[i] = (size_t)size;
+    count *= shape[i];
+  }
+  size_t typeSize = BinaryFileReader::typeSize(type);
+  if (count > SIZE_MAX / typeSize) {
+    std::cerr << "ERROR: Array file shape too large" << std::endl;
+    return false;
+  }
+  if (file->size() - headerSize < count * typeSize) {
+    std::cerr << "ERROR: Array file has fewer values than its shape"
+              << std::endl;
+    return false;
+  }
+  mFile = file;
+  mType = type;
+  mShape = shape;
+  mCount = count;
+  mData = bytes + headerSize;
+  return true;
+}
+
+bool MappedArray::writeFile(const std::string &path, const void *data,
+                            BinaryFileReader::DataType type,
+                            const std::vector<size_t> &shape) {
+  size_t count = 1;
+  for (auto size : shape) {
+    count *= size;
+  }
+  // Mapped files must not be truncated, so the new file replaces the old one
+  std::string tempPath = path + ".tmp";
+  std::ofstream f(tempPath, std::ios::binary);
+  if (!f.good()) {
+    std::cerr << "ERROR creating array file: " << path << std::endl;
+    return false;
+  }
+  uint8_t prefix[HEADER_PREFIX_SIZE];
+  memcpy(prefix, MAPPED_ARRAY_MAGIC, 4);
+  prefix[4] = FORMAT_VERSION;
+  prefix[5] = (uint8_t)type;
+  uint16_t dimensionCount = (uint16_t)shape.size();
+  memcpy(prefix + 6, &dimensionCount, sizeof(uint16_t));
+  f.write((const char *)prefix, HEADER_PREFIX_SIZE);
+  for (auto size : shape) {
+    uint64_t dimensionSize = size;
+    f.write((const char *)&dimensionSize, sizeof(uint64_t));
+  }
+  f.write((const char *)data, count * BinaryFileReader::typeSize(type));
+  f.close();
+  if (!f.good()) {
+    std::cerr << "ERROR writing array file: " << path << std::endl;
+    std::remove(tempPath.c_str());
+    return false;
+  }
+  // Readers open mapped files with FILE_SHARE_DELETE on Windows, so the file
+  // can be replaced while it is open
+#ifdef AL_WINDOWS
+  if (!MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+#else
+  if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+#endif
+    std::cerr << "ERROR replacing array file: " << path << std::endl;
+    std::remove(tempPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool DiskBufferMapped::writeArray(const void *data,
+                                  BinaryFileReader::DataType type,
+                                  std::vector<size_t> shape,
+                                  std::string filename) {
+  if (filename.size() == 0) {
+    filename = getCurrentFileName();
+  }
+  if (!MappedArray::writeFile(m_path + filename, data, type, shape)) {
+    return false;
+  }
+  return updateData(filename);
+}
+
+bool DiskBufferMapped::parseFile(std::istream &file,
+                                 std::shared_ptr<MappedArray> newData) {
+  std::cerr << "ERROR: DiskBufferMapped can only map files, not read streams"
+            << std::endl;
+  return false;
+}
+
+bool DiskBufferMapped::loadFile(const std::string &path,
+                                std::shared_ptr<MappedArray> newData) {
+  auto file = MappedFile::open(path);
+  if (!file) {
+    std::cerr << "ERROR mapping file: " << path << std::endl;
+    return false;
+  }
+  return newData->setFile(file);
+}
@@ -0,0 +1,39 @@
+#ifndef FILEMODIFIED_HPP
+#define FILEMODIFIED_HPP
+
+// Internal helpers shared by the sources in this directory. Not installed.
+
+#include <cinttypes>
+#include <string>
+
+#include <sys/stat.h>
+
+// Defines the AL_ platform macros
+#include "al/io/al_File.hpp"
+
+namespace tinc {
+
+// Modification time in nanoseconds where the platform provides it, so that
+// quick successive writes are detected.
+inline int64_t modifiedNs(const struct stat &s) {
+#if defined(AL_OSX)
+  return (int64_t)s.st_mtimespec.tv_sec * 1000000000 + s.st_mtimespec.tv_nsec;
+#elif defined(AL_LINUX)
+  return (int64_t)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+#else
+  return (int64_t)s.st_mtime * 1000000000;
+#endif
+}
+
+// Modification time of file in nanoseconds. 0 if it does not exist.
+inline int64_t fileModifiedNs(const std::string &path) {
+  struct stat s;
+  if (::stat(path.c_str(), &s) != 0) {
+    return 0;
+  }
+  return modifiedNs(s);
+}
+
+} // namespace tinc
+
+#endif // FILEMODIFIED_HPP
@@ -0,0 +1,160 @@
+#include "tinc/FileWatcher.hpp"
+
+#include "al/io/al_File.hpp"
+
+#include <iostream>
+
+#ifdef AL_LINUX
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using namespace tinc;
+
+FileWatcher::FileWatcher(float debounceTime) : mDebounceTime(debounceTime) {}
+
+FileWatcher::~FileWatcher() {
+  mRunning = false;
+  if (mThread) {
+    mThread->join();
+  }
+#ifdef AL_LINUX
+  if (mInotifyFd >= 0) {
+    close(mInotifyFd);
+  }
+#endif
+  // mLoader finishes queued callbacks as it is destroyed
+}
+
+uint64_t
+FileWatcher::watch(std::string directory,
+                   std::function<void(const std::string &)> callback) {
+#ifdef AL_LINUX
+  if (directory.size() == 0) {
+    directory = al::File::currentPath();
+  }
+  std::unique_lock<std::mutex> lk(mLock);
+  if (mInotifyFd < 0) {
+    mInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (mInotifyFd < 0) {
+      std::cerr << "ERROR: Can't initialize inotify" << std::endl;
+      return 0;
+    }
+  }
+  int wd = inotify_add_watch(mInotifyFd, directory.c_str(),
+                             IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY);
+  if (wd < 0) {
+    std::cerr << "ERROR: Can't watch directory: " << directory << std::endl;
+    return 0;
+  }
+  auto subscription = std::make_shared<Subscription>();
+  subscription->watchDescriptor = wd;
+  subscription->callback = callback;
+  uint64_t id = mNextId++;
+  mSubscriptions[id] = subscription;
+  mWatchCount[wd]++;
+  if (!mThread) {
+    mRunning = true;
+    mThread = std::make_unique<std::thread>(&FileWatcher::watcherThread, this);
+  }
+  return id;
+#else
+  std::cerr << "ERROR: FileWatcher is only supported on Linux" << std::endl;
+  return 0;
+#endif
+}
+
+void FileWatcher::unwatch(uint64_t id) {
+  std::shared_ptr<Subscription> subscription;
+  {
+    std::unique_lock<std::mutex> lk(mLock);
+    auto it = mSubscriptions.find(id);
+    if (it == mSubscriptions.end()) {
+      return;
+    }
+    subscription = it->second;
+    mSubscriptions.erase(it);
+    int wd = subscription->watchDescriptor;
+    if (--mWatchCount[wd] == 0) {
+      mWatchCount.erase(wd);
+#ifdef AL_LINUX
+      inotify_rm_watch(mInotifyFd, wd);
+#endif
+    }
+  }
+  // Wait for a running callback
+  std::unique_lock<std::mutex> lk(subscription->lock);
+  subscription->active = false;
+}
+
+void FileWatcher::watcherThread() {
+#ifdef AL_LINUX
+  // Buffer aligned for inotify_event, with space for many events
+  alignas(struct inotify_event) char buffer[4096];
+  while (mRunning) {
+    struct pollfd fds;
+    fds.fd = mInotifyFd;
+    fds.events = POLLIN;
+    int timeoutMs = 100;
+    {
+      std::unique_lock<std::mutex> lk(mLock);
+      if (mPending.size() > 0) {
+        timeoutMs = std::max(1, (int)(mDebounceTime * 1000.0f) / 2);
+      }
+    }
+    int ret = poll(&fds, 1, timeoutMs);
+    auto now = std::chrono::steady_clock::now();
+    if (ret > 0 && (fds.revents & POLLIN)) {
+      ssize_t len;
+      while ((len = read(mInotifyFd, buffer, sizeof(buffer))) > 0) {
+        std::unique_lock<std::mutex> lk(mLock);
+        for (char *p = buffer; p < buffer + len;) {
+          auto *event = (struct inotify_event *)p;
+          p += sizeof(struct inotify_event) + event->len;
+          if (event->len == 0 || (event->mask & IN_ISDIR)) {
+            continue;
+          }
+          auto key = std::make_pair(event->wd, std::string(event->name));
+          if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            mPending[key] = now;
+          } else if (mPending.find(key) != mPending.end()) {
+            // Still being written. Restart the debounce time.
+            mPending[key] = now;
+          }
+        }
+      }
+    }
+    std::unique_lock<std::mutex> lk(mLock);
+    dispatchPending();
+  }
+#endif
+}
+
+void FileWatcher::dispatchPending() {
+  auto now = std::chrono::steady_clock::now();
+  auto debounce =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<float>(mDebounceTime.load()));
+  for (auto it = mPending.begin(); it != mPending.end();) {
+    if (now - it->second < debounce) {
+      it++;
+      continue;
+    }
+    int wd = it->first.first;
+    std::string fileName = it->first.second;
+    for (auto &subscription : mSubscriptions) {
+      if (subscription.second->watchDescriptor != wd) {
+        continue;
+      }
+      auto s = subscription.second;
+      mLoader.push([s, fileName]() {
+        std::unique_lock<std::mutex> lk(s->lock);
+        if (s->active) {
+          s->callback(fileName);
+        }
+      });
+    }
+    it = mPending.erase(it);
+  }
+}
@@ -0,0 +1,85 @@
+#include "tinc/MappedFile.hpp"
+
+#include "al/io/al_File.hpp"
+
+#ifdef AL_WINDOWS
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace tinc;
+
+MappedFile::~MappedFile() {
+#ifdef AL_WINDOWS
+  if (mData) {
+    UnmapViewOfFile(mData);
+  }
+  if (mMapping) {
+    CloseHandle((HANDLE)mMapping);
+  }
+  if (mFile) {
+    CloseHandle((HANDLE)mFile);
+  }
+#else
+  if (mData) {
+    munmap((void *)mData, mSize);
+  }
+#endif
+}
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string &path) {
+  auto mapped = std::make_shared<MappedFile>();
+#ifdef AL_WINDOWS
+  // Allow writers to replace the file while it is mapped
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+  mapped->mFile = file;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    return nullptr;
+  }
+  mapped->mSize = (size_t)size.QuadPart;
+  if (mapped->mSize == 0) {
+    return mapped;
+  }
+  mapped->mMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!mapped->mMapping) {
+    return nullptr;
+  }
+  mapped->mData = (const uint8_t *)MapViewOfFile((HANDLE)mapped->mMapping,
+                                                 FILE_MAP_READ, 0, 0, 0);
+  if (!mapped->mData) {
+    return nullptr;
+  }
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat s;
+  if (fstat(fd, &s) != 0) {
+    ::close(fd);
+    return nullptr;
+  }
+  mapped->mSize = (size_t)s.st_size;
+  if (mapped->mSize > 0) {
+    void *data = mmap(nullptr, mapped->mSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd);
+      return nullptr;
+    }
+    mapped->mData = (const uint8_t *)data;
+  }
+  // The mapping stays valid after closing the descriptor
+  ::close(fd);
+#endif
+  return mapped;
+}
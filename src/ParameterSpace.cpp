@@ -1,4 +1,5 @@
 #include "tinc/ParameterSpace.hpp"
+#include "tinc/ProcessorScript.hpp"
 
 #include "al/io/al_File.hpp"
 
@@ -144,6 +145,21 @@ void ParameterSpace::removeDimension(std::string dimensionName) {
   }
 }
 
+std::shared_ptr<ParameterSpace> ParameterSpace::snapshot() {
+  auto copy = std::make_shared<ParameterSpace>();
+  copy->mId = mId;
+  std::unique_lock<std::mutex> lk(mDimensionsLock);
+  for (auto dim : mDimensions) {
+    // Not registered, as the copy's values don't change
+    copy->mDimensions.push_back(dim->deepCopy());
+  }
+  copy->parameterNameMap = parameterNameMap;
+  copy->generateRelativeRunPath = generateRelativeRunPath;
+  copy->mCurrentPathTemplate = mCurrentPathTemplate;
+  copy->mRootPath = mRootPath;
+  return copy;
+}
+
 std::vector<std::shared_ptr<ParameterSpaceDimension>>
 ParameterSpace::getDimensions() {
   return mDimensions;
@@ -1226,10 +1242,26 @@ bool ParameterSpace::executeProcess(Processor &processor, bool recompute) {
 
     entry.sourceInfo.type = al::demangle(typeid(processor).name());
     entry.sourceInfo.tincId = processor.getId();
-    entry.sourceInfo.hash = "";                 // FIXME
-    entry.sourceInfo.fileDependencies = {};     // FIXME
     entry.sourceInfo.commandLineArguments = ""; // FIXME
 
+    // Changes to the script or to input files invalidate cache entries
+    if (auto *script = dynamic_cast<ProcessorScript *>(&processor)) {
+      std::string scriptPath = script->scriptFile(true);
+      if (!al::File::exists(scriptPath)) {
+        scriptPath = script->getRunningDirectory() + scriptPath;
+      }
+      entry.sourceInfo.hash = mCacheManager->fileHash(scriptPath);
+    }
+    for (auto filename : processor.getInputFileNames()) {
+      FileDependency dep;
+      dep.file = DistributedPath(filename, processor.getInputDirectory());
+      if (!mCacheManager->updateFileDependency(dep)) {
+        std::cerr << "Warning: input file not found for cache: "
+                  << dep.file.filePath() << std::endl;
+      }
+      entry.sourceInfo.fileDependencies.push_back(dep);
+    }
+
     for (auto dim : mDimensions) {
       SourceArgument arg;
       arg.id = dim->getName();
@@ -1283,7 +1315,10 @@ bool ParameterSpace::executeProcess(Processor &processor, bool recompute) {
       }
       entry.sourceInfo.arguments.push_back(arg);
     }
-    auto cacheFiles = mCacheManager->findCache(entry.sourceInfo);
+    std::vector<std::string> cacheFiles;
+    if (!recompute) {
+      cacheFiles = mCacheManager->findCache(entry.sourceInfo);
+    }
 
     // TODO caching is currently done by copying. There should also be an option
     // for in-place caching.
@@ -1295,14 +1330,16 @@ bool ParameterSpace::executeProcess(Processor &processor, bool recompute) {
                   << std::endl;
       } else {
         for (size_t i = 0; i < cacheFiles.size(); i++) {
-          if (!al::File::copy(
-                  mCacheManager->cacheDirectory() + cacheFiles.at(i),
+          if (!mCacheManager->restoreFile(
+                  cacheFiles.at(i),
                   processor.getOutputDirectory() + outputFiles.at(i))) {
             std::cerr << "ERROR restoring cache from"
                       << mCacheManager->cacheDirectory() + cacheFiles.at(i)
                       << " to "
                       << processor.getOutputDirectory() + outputFiles.at(i)
                       << std::endl;
+            recompute = true;
+            break;
           }
           std::cout << "Cache restored from: "
                     << mCacheManager->cacheDirectory() + cacheFiles.at(i)
@@ -1318,8 +1355,10 @@ bool ParameterSpace::executeProcess(Processor &processor, bool recompute) {
   }
   bool ret = processor.process(recompute);
 
-  if (mCacheManager) {
+  // Only store in cache if results were computed successfully
+  if (mCacheManager && recompute && ret) {
     std::vector<std::string> cacheFilenames;
+    std::vector<std::string> outputPaths;
 
     for (auto filename : processor.getOutputFileNames()) {
       std::string parameterPrefix;
@@ -1327,23 +1366,15 @@ bool ParameterSpace::executeProcess(Processor &processor, bool recompute) {
         parameterPrefix += "%%" + dim->getName() + "%%_";
       }
       parameterPrefix = resolveFilename(parameterPrefix);
-      std::string cacheFilename =
-          mCacheManager->cacheDirectory() + parameterPrefix + filename;
-      if (al::File::exists(cacheFilename)) {
-        // FIXME handle case when file exists.
-      }
-      if (!al::File::copy(processor.getOutputDirectory() + filename,
-                          cacheFilename)) {
-        std::cerr << "ERROR creating cache file " << cacheFilename
-                  << " Cache entry not created. " << std::endl;
-        return ret;
-      }
       cacheFilenames.push_back(parameterPrefix + filename);
+      outputPaths.push_back(processor.getOutputDirectory() + filename);
     }
-
-    for (auto filename : processor.getInputFileNames()) {
-      DistributedPath dep(filename); // TODO enrich meta data
-      entry.sourceInfo.fileDependencies.push_back(dep);
+    entry.filenames = cacheFilenames;
+    // Files are compressed according to the cache manager's codec
+    if (!mCacheManager->storeFiles(outputPaths, entry)) {
+      std::cerr << "ERROR creating cache files. Cache entry not created. "
+                << std::endl;
+      return ret;
     }
 
     entry.sourceInfo.workingPath = DistributedPath(); // FIXME
@@ -1353,7 +1384,6 @@ bool ParameterSpace::executeProcess(Processor &processor, bool recompute) {
     entry.timestampStart = ss.str();
     // Leave end timestamp for last
     //    entry.cacheHits = 23;
-    entry.filenames = cacheFilenames;
     entry.stale = false; // FIXME
 
     entry.userInfo.userName = "User";    // FIXME
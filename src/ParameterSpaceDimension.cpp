@@ -395,6 +395,7 @@ std::shared_ptr<ParameterSpaceDimension> ParameterSpaceDimension::deepCopy() {
                                mSpaceValues.size());
   dimCopy->mSpaceValues.setIds(mSpaceValues.getIds());
   mSpaceValues.unlock();
+  dimCopy->mRepresentationType = mRepresentationType;
   dimCopy->setCurrentIndex(getCurrentIndex());
   return dimCopy;
 }
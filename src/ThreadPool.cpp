@@ -0,0 +1,87 @@
+#include "tinc/ThreadPool.hpp"
+
+#include <algorithm>
+
+using namespace tinc;
+
+ThreadPool::ThreadPool(size_t threadCount) {
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < threadCount; i++) {
+    mThreads.emplace_back([this]() {
+      std::unique_lock<std::mutex> lk(mTasksLock);
+      while (true) {
+        mTasksSignal.wait(lk,
+                          [this]() { return !mRunning || mTasks.size() > 0; });
+        if (mTasks.size() == 0) {
+          // Only exit once queued tasks are done
+          break;
+        }
+        auto task = std::move(mTasks.front());
+        mTasks.pop_front();
+        lk.unlock();
+        task();
+        lk.lock();
+      }
+    });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lk(mTasksLock);
+    mRunning = false;
+  }
+  mTasksSignal.notify_all();
+  for (auto &thread : mThreads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::push(std::function<void()> task) {
+  {
+    std::unique_lock<std::mutex> lk(mTasksLock);
+    mTasks.push_back(std::move(task));
+  }
+  mTasksSignal.notify_one();
+}
+
+void ThreadPool::parallelFor(size_t count,
+                             std::function<void(size_t, size_t)> func,
+                             size_t chunkSize) {
+  if (count == 0) {
+    return;
+  }
+  if (chunkSize == 0) {
+    chunkSize = std::max((size_t)1, count / (mThreads.size() + 1));
+  }
+  size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+
+  // Shared with helper tasks, which may start after this function returns
+  struct State {
+    std::atomic<size_t> nextChunk{0};
+    size_t doneChunks{0};
+    std::mutex lock;
+    std::condition_variable done;
+  };
+  auto state = std::make_shared<State>();
+  auto work = [state, func, count, chunkSize, chunkCount]() {
+    size_t chunk;
+    while ((chunk = state->nextChunk++) < chunkCount) {
+      size_t begin = chunk * chunkSize;
+      func(begin, std::min(begin + chunkSize, count));
+      std::unique_lock<std::mutex> lk(state->lock);
+      if (++state->doneChunks == chunkCount) {
+        state->done.notify_all();
+      }
+    }
+  };
+  size_t helpers = std::min(mThreads.size(), chunkCount - 1);
+  for (size_t i = 0; i < helpers; i++) {
+    push(work);
+  }
+  work();
+  std::unique_lock<std::mutex> lk(state->lock);
+  state->done.wait(lk, [&]() { return state->doneChunks == chunkCount; });
+}
@@ -6,6 +6,7 @@
 #include "tinc/DiskBufferNetCDF.hpp"
 #include "tinc/ProcessorAsyncWrapper.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 
@@ -20,6 +21,14 @@ TincClient::TincClient() {
   mRevision = TINC_PROTOCOL_REVISION;
 }
 
+TincClient::~TincClient() {
+  for (auto &remoteCache : mRemoteCaches) {
+    if (auto cacheManager = remoteCache.lock()) {
+      cacheManager->setRemoteCache(nullptr);
+    }
+  }
+}
+
 void TincClient::stop() {
   TincMessage tincMessage;
 
@@ -32,6 +41,7 @@ void TincClient::stop() {
 }
 
 bool TincClient::processIncomingMessage(al::Message &message, al::Socket *src) {
+  mReceiveThreadId = std::this_thread::get_id();
 
   while (message.remainingBytes() > 8) {
     size_t msgSize;
@@ -95,6 +105,9 @@ bool TincClient::processIncomingMessage(al::Message &message, al::Socket *src) {
                   << ": Command message received, but not implemented"
                   << std::endl;
         break;
+      case MessageType::COMMAND_REPLY:
+        processCommandReply(&details);
+        break;
       case MessageType::PING:
         std::cerr << __FUNCTION__
                   << ": Ping message received, but not implemented"
@@ -187,7 +200,354 @@ void TincClient::processStatusMessage(void *message) {
       std::cerr << "ERROR: non global status messages not supported"
                 << std::endl;
     }
+  } else if (details.Is<ParameterSpaceCacheStatus>()) {
+    ParameterSpaceCacheStatus status;
+    details.UnpackTo(&status);
+    CacheStatistics stats;
+    stats.lookups = status.lookups();
+    stats.hits = status.hits();
+    stats.remoteHits = status.remotehits();
+    stats.misses = status.misses();
+    stats.staleHits = status.stalehits();
+    stats.bytesRestored = status.bytesrestored();
+    stats.bytesStored = status.bytesstored();
+    stats.lookupTimeTotal = status.lookuptimetotal();
+    stats.lookupTimeMax = status.lookuptimemax();
+    stats.computeTimeSaved = status.computetimesaved();
+    stats.entries = status.entries();
+    stats.cacheSize = status.cachesize();
+    std::unique_lock<std::mutex> lk(mServerCacheStatisticsLock);
+    mServerCacheStatistics[status.id().id()] = stats;
+  }
+}
+
+bool TincClient::serverCacheStatistics(std::string parameterSpaceId,
+                                       CacheStatistics &stats) {
+  std::unique_lock<std::mutex> lk(mServerCacheStatisticsLock);
+  auto it = mServerCacheStatistics.find(parameterSpaceId);
+  if (it == mServerCacheStatistics.end()) {
+    return false;
+  }
+  stats = it->second;
+  return true;
+}
+
+void TincClient::processCommandReply(void *details) {
+  auto *any = static_cast<google::protobuf::Any *>(details);
+  if (!any->Is<Command>()) {
+    std::cerr << __FUNCTION__ << ": Invalid payload for COMMAND_REPLY"
+              << std::endl;
+    return;
+  }
+  Command command;
+  any->UnpackTo(&command);
+  std::unique_lock<std::mutex> lk(mCommandRepliesLock);
+  // Ignore replies that arrive after the command timed out
+  if (mPendingCommands.find(command.message_id()) == mPendingCommands.end()) {
+    return;
+  }
+  auto assemblyIt = mSliceAssemblies.find(command.message_id());
+  if (assemblyIt != mSliceAssemblies.end() &&
+      command.details().Is<DataPoolCommandSliceReply>()) {
+    // Copy chunk into the slice and wait for the rest
+    auto &assembly = assemblyIt->second;
+    if (assembly.error) {
+      // Error already reported to the caller, drop remaining chunks
+      return;
+    }
+    DataPoolCommandSliceReply reply;
+    command.details().UnpackTo(&reply);
+    size_t count = reply.data().size() / sizeof(float);
+    auto *slice = assembly.slice;
+    bool valid = reply.datatype() == SliceDataType::SLICE_FLOAT32 &&
+                 reply.data().size() % sizeof(float) == 0;
+    if (valid && assembly.received == 0) {
+      slice->dimensions.assign(reply.dimension().begin(),
+                               reply.dimension().end());
+      slice->shape.assign(reply.shape().begin(), reply.shape().end());
+      slice->values.resize(reply.totalcount());
+    } else if (valid) {
+      // Later chunks must describe the slice allocated from the first one
+      valid = reply.totalcount() == slice->values.size() &&
+              std::equal(reply.dimension().begin(), reply.dimension().end(),
+                         slice->dimensions.begin(), slice->dimensions.end()) &&
+              std::equal(reply.shape().begin(), reply.shape().end(),
+                         slice->shape.begin(), slice->shape.end());
+    }
+    if (!valid || reply.offset() > slice->values.size() ||
+        count > slice->values.size() - reply.offset()) {
+      std::cerr << __FUNCTION__ << ": Invalid slice data received"
+                << std::endl;
+      assembly.error = true;
+    } else {
+      memcpy(slice->values.data() + reply.offset(), reply.data().data(),
+             count * sizeof(float));
+      assembly.received += count;
+      if (assembly.received < slice->values.size()) {
+        return;
+      }
+    }
+  }
+  mCommandReplies[command.message_id()] = command.SerializeAsString();
+  mCommandReplySignal.notify_all();
+}
+
+bool TincClient::sendCommand(int objectType, std::string objectId,
+                             void *commandDetails, void *reply,
+                             float timeoutsec) {
+  return sendCommand(objectType, objectId, commandDetails, reply, timeoutsec,
+                     mCommandCounter++);
+}
+
+bool TincClient::sendCommand(int objectType, std::string objectId,
+                             void *commandDetails, void *reply,
+                             float timeoutsec, uint64_t commandNumber) {
+  if (std::this_thread::get_id() == mReceiveThreadId) {
+    // e.g. from a parameter callback triggered by the server
+    std::cerr << __FUNCTION__
+              << ": ERROR commands can't be sent from the thread receiving "
+                 "replies. Send from a different thread."
+              << std::endl;
+    return false;
+  }
+  auto *detailsMessage =
+      static_cast<google::protobuf::Message *>(commandDetails);
+
+  TincMessage msg;
+  msg.set_messagetype(MessageType::COMMAND);
+  msg.set_objecttype((ObjectType)objectType);
+  auto *msgDetails = msg.details().New();
+
+  Command command;
+  command.set_message_id(commandNumber);
+  command.mutable_id()->set_id(objectId);
+  auto *details = command.details().New();
+  details->PackFrom(*detailsMessage);
+  command.set_allocated_details(details);
+
+  msgDetails->PackFrom(command);
+  msg.set_allocated_details(msgDetails);
+
+  std::unique_lock<std::mutex> lk(mCommandRepliesLock);
+  mPendingCommands.insert(commandNumber);
+  lk.unlock();
+  if (!sendTincMessage(&msg)) {
+    lk.lock();
+    mPendingCommands.erase(commandNumber);
+    return false;
+  }
+  lk.lock();
+  bool received = mCommandReplySignal.wait_for(
+      lk, std::chrono::milliseconds((int64_t)(timeoutsec * 1000)), [&]() {
+        return mCommandReplies.find(commandNumber) != mCommandReplies.end();
+      });
+  mPendingCommands.erase(commandNumber);
+  if (!received) {
+    std::cerr << __FUNCTION__ << ": Timeout waiting for command reply"
+              << std::endl;
+    return false;
+  }
+  Command replyCommand;
+  replyCommand.ParseFromString(mCommandReplies[commandNumber]);
+  mCommandReplies.erase(commandNumber);
+  lk.unlock();
+
+  if (replyCommand.details().Is<CommandErrorPayload>()) {
+    CommandErrorPayload error;
+    replyCommand.details().UnpackTo(&error);
+    std::cerr << __FUNCTION__ << ": Command error: " << error.error()
+              << std::endl;
+    return false;
+  }
+  return replyCommand.details().UnpackTo(
+      static_cast<google::protobuf::Message *>(reply));
+}
+
+bool TincClient::readDataSlice(std::string dataPoolId, std::string field,
+                               std::vector<std::string> sliceDimensions,
+                               DataPool::SliceData &slice, size_t chunkSize) {
+  DataPoolCommandSlice command;
+  command.set_field(field);
+  for (const auto &dim : sliceDimensions) {
+    command.add_dimension(dim);
+  }
+  command.set_inlinedata(true);
+  command.set_chunksize(chunkSize);
+
+  slice = DataPool::SliceData();
+  uint64_t commandNumber = mCommandCounter++;
+  {
+    std::unique_lock<std::mutex> lk(mCommandRepliesLock);
+    mSliceAssemblies[commandNumber].slice = &slice;
+  }
+  DataPoolCommandSliceReply reply;
+  bool ok = sendCommand(ObjectType::DATA_POOL, dataPoolId, &command, &reply,
+                        mCommandTimeout, commandNumber);
+  std::unique_lock<std::mutex> lk(mCommandRepliesLock);
+  ok &= !mSliceAssemblies[commandNumber].error;
+  mSliceAssemblies.erase(commandNumber);
+  return ok;
+}
+
+bool TincClient::readDataSlices(std::string dataPoolId,
+                                std::vector<std::string> fields,
+                                std::vector<std::string> sliceDimensions,
+                                std::vector<DataPool::SliceData> &slices,
+                                size_t chunkSize) {
+  DataPoolCommandSliceFields command;
+  for (const auto &field : fields) {
+    command.add_field(field);
+  }
+  for (const auto &dim : sliceDimensions) {
+    command.add_dimension(dim);
+  }
+  command.set_inlinedata(true);
+  command.set_chunksize(chunkSize);
+
+  // All fields arrive as one flattened slice
+  DataPool::SliceData slice;
+  uint64_t commandNumber = mCommandCounter++;
+  {
+    std::unique_lock<std::mutex> lk(mCommandRepliesLock);
+    mSliceAssemblies[commandNumber].slice = &slice;
+  }
+  DataPoolCommandSliceReply reply;
+  bool ok = sendCommand(ObjectType::DATA_POOL, dataPoolId, &command, &reply,
+                        mCommandTimeout, commandNumber);
+  {
+    std::unique_lock<std::mutex> lk(mCommandRepliesLock);
+    ok &= !mSliceAssemblies[commandNumber].error;
+    mSliceAssemblies.erase(commandNumber);
+  }
+  slices.clear();
+  if (!ok || fields.size() == 0) {
+    return false;
+  }
+  size_t count = slice.values.size() / fields.size();
+  if (count * fields.size() != slice.values.size()) {
+    std::cerr << __FUNCTION__ << ": Invalid slice size received" << std::endl;
+    return false;
+  }
+  slices.resize(fields.size());
+  for (size_t f = 0; f < fields.size(); f++) {
+    slices[f].dimensions = slice.dimensions;
+    slices[f].shape = slice.shape;
+    slices[f].values.assign(slice.values.begin() + f * count,
+                            slice.values.begin() + (f + 1) * count);
+  }
+  return true;
+}
+
+bool TincClient::reduceDataSlice(std::string dataPoolId, std::string field,
+                                 std::vector<std::string> sliceDimensions,
+                                 DataPool::SliceReduction &reduction,
+                                 size_t histogramBins, float histogramMin,
+                                 float histogramMax) {
+  DataPoolCommandReduce command;
+  command.set_field(field);
+  for (const auto &dim : sliceDimensions) {
+    command.add_dimension(dim);
+  }
+  command.set_histogrambins(histogramBins);
+  command.set_histogrammin(histogramMin);
+  command.set_histogrammax(histogramMax);
+
+  DataPoolCommandReduceReply reply;
+  if (!sendCommand(ObjectType::DATA_POOL, dataPoolId, &command, &reply,
+                   mCommandTimeout)) {
+    return false;
+  }
+  reduction.count = reply.count();
+  reduction.missing = reply.missing();
+  reduction.min = reply.min();
+  reduction.max = reply.max();
+  reduction.mean = reply.mean();
+  reduction.histogramMin = reply.histogrammin();
+  reduction.histogramMax = reply.histogrammax();
+  reduction.histogram.assign(reply.histogram().begin(),
+                             reply.histogram().end());
+  return true;
+}
+
+void TincClient::enableRemoteCache(ParameterSpace &ps) {
+  auto cacheManager = ps.getCacheManager();
+  if (!cacheManager) {
+    std::cerr << __FUNCTION__ << ": Cache not enabled for parameter space "
+              << ps.getId() << std::endl;
+    return;
+  }
+  std::string psId = ps.getId();
+  // The callback is owned by the cache manager, so it can't own it back
+  std::weak_ptr<CacheManager> weakCache = cacheManager;
+  cacheManager->setRemoteCache(
+      [this, psId, weakCache](const SourceInfo &sourceInfo) {
+        auto localCache = weakCache.lock();
+        if (!localCache) {
+          return std::vector<std::string>();
+        }
+        return fetchRemoteCache(psId, sourceInfo, *localCache);
+      });
+  mRemoteCaches.push_back(cacheManager);
+}
+
+void TincClient::disableRemoteCache(ParameterSpace &ps) {
+  auto cacheManager = ps.getCacheManager();
+  if (cacheManager) {
+    cacheManager->setRemoteCache(nullptr);
+  }
+}
+
+std::vector<std::string>
+TincClient::fetchRemoteCache(std::string parameterSpaceId,
+                             const SourceInfo &sourceInfo,
+                             CacheManager &cacheManager) {
+  ParameterSpaceCacheQuery query;
+  query.set_sourceinfo(CacheManager::sourceInfoToJson(sourceInfo).dump());
+  ParameterSpaceCacheQueryReply queryReply;
+  if (!sendCommand(ObjectType::PARAMETER_SPACE, parameterSpaceId, &query,
+                   &queryReply, mCommandTimeout) ||
+      !queryReply.found()) {
+    return {};
+  }
+  CacheEntry entry;
+  try {
+    entry = cacheManager.entryFromJson(nlohmann::json::parse(queryReply.entry()));
+  } catch (std::exception &e) {
+    std::cerr << __FUNCTION__ << ": Invalid cache entry from server"
+              << std::endl;
+    return {};
+  }
+
+  // Files are transferred in chunks as stored in the server's cache, so
+  // compressed files are not decompressed for transfer.
+  const uint64_t chunkSize = TINC_CACHE_MAX_READ_SIZE;
+  bool imported = cacheManager.importEntry(
+      entry, [&](size_t index, std::ostream &out) {
+        uint64_t offset = 0;
+        while (true) {
+          ParameterSpaceCacheReadFile request;
+          request.set_filename(entry.filenames[index]);
+          request.set_offset(offset);
+          request.set_size(chunkSize);
+          ParameterSpaceCacheReadFileReply reply;
+          if (!sendCommand(ObjectType::PARAMETER_SPACE, parameterSpaceId,
+                           &request, &reply, mCommandTimeout)) {
+            return false;
+          }
+          out.write(reply.data().data(), reply.data().size());
+          offset += reply.data().size();
+          if (reply.data().size() < chunkSize) {
+            return true;
+          }
+        }
+      });
+  if (imported) {
+    if (verbose()) {
+      std::cout << "Cache entry fetched from server" << std::endl;
+    }
+    return entry.filenames;
   }
+  return {};
 }
 
 bool TincClient::sendTincMessage(void *msg, al::Socket *dst,
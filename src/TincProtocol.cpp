@@ -6,6 +6,7 @@
 #include "tinc/ProcessorGraph.hpp"
 #include "tinc/TincClient.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 
@@ -13,6 +14,9 @@
 
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 
+// Default bytes of slice data per reply when slices are sent inline
+#define TINC_SLICE_CHUNK_SIZE (1 << 20)
+
 using namespace tinc;
 
 // TODO namespace these functions to avoid potential clashes
@@ -944,7 +948,10 @@ void TincProtocol::registerParameterSpace(ParameterSpace &ps, al::Socket *src) {
     }
   }
   if (!registered) {
-    mParameterSpaces.push_back(&ps);
+    {
+      std::unique_lock<std::mutex> lk(mParameterSpacesLock);
+      mParameterSpaces.push_back(&ps);
+    }
 
     // FIXME re-check callback function. something doesn't look right
     ps.onDimensionRegister = [this](ParameterSpaceDimension *changedDimension,
@@ -2091,14 +2098,14 @@ bool TincProtocol::sendCommandErrorMessage(uint64_t commandNumber,
 
   Command command;
   command.set_message_id(commandNumber);
-  auto commandId = command.id();
-  commandId.set_id(objectId);
+  command.mutable_id()->set_id(objectId);
   auto *errorPayload = command.details().New();
   CommandErrorPayload errorPayloadMsg;
   errorPayloadMsg.set_error(errorMessage);
 
   errorPayload->PackFrom(errorPayloadMsg);
   command.set_allocated_details(errorPayload);
+  msgDetails->PackFrom(command);
   msg.set_allocated_details(msgDetails);
   return sendProtobufMessage(&msg, src);
 }
@@ -2255,6 +2262,97 @@ bool TincProtocol::processCommandParameterSpace(void *any, al::Socket *src) {
     }
     sendCommandErrorMessage(commandNumber, psId,
                             "ParameterSpace not registered in server", src);
+  } else if (incomingCommand.details().Is<ParameterSpaceCacheQuery>()) {
+    ParameterSpaceCacheQuery request;
+    incomingCommand.details().UnpackTo(&request);
+    for (auto ps : mParameterSpaces) {
+      if (ps->getId() == psId) {
+        auto cacheManager = ps->getCacheManager();
+        if (!cacheManager) {
+          sendCommandErrorMessage(commandNumber, psId,
+                                  "ParameterSpace cache not enabled", src);
+          return false;
+        }
+        ParameterSpaceCacheQueryReply reply;
+        try {
+          auto sourceInfo = CacheManager::sourceInfoFromJson(
+              nlohmann::json::parse(request.sourceinfo()));
+          CacheEntry entry;
+          if (cacheManager->findEntry(sourceInfo, entry)) {
+            reply.set_found(true);
+            reply.set_entry(cacheManager->entryToJson(entry).dump());
+          } else {
+            reply.set_found(false);
+          }
+        } catch (std::exception &e) {
+          sendCommandErrorMessage(commandNumber, psId,
+                                  "Invalid source info for cache query", src);
+          return false;
+        }
+
+        TincMessage msg;
+        msg.set_messagetype(MessageType::COMMAND_REPLY);
+        msg.set_objecttype(ObjectType::PARAMETER_SPACE);
+        auto *msgDetails = msg.details().New();
+
+        Command command;
+        command.set_message_id(commandNumber);
+        command.mutable_id()->set_id(psId);
+
+        auto *commandDetails = command.details().New();
+        commandDetails->PackFrom(reply);
+        command.set_allocated_details(commandDetails);
+
+        msgDetails->PackFrom(command);
+        msg.set_allocated_details(msgDetails);
+
+        sendTincMessage(&msg, src);
+        return true;
+      }
+    }
+    sendCommandErrorMessage(commandNumber, psId,
+                            "ParameterSpace not registered in server", src);
+  } else if (incomingCommand.details().Is<ParameterSpaceCacheReadFile>()) {
+    ParameterSpaceCacheReadFile request;
+    incomingCommand.details().UnpackTo(&request);
+    for (auto ps : mParameterSpaces) {
+      if (ps->getId() == psId) {
+        auto cacheManager = ps->getCacheManager();
+        std::string data;
+        if (!cacheManager ||
+            !cacheManager->readStoredFile(request.filename(), request.offset(),
+                                          request.size(), data)) {
+          sendCommandErrorMessage(commandNumber, psId,
+                                  "Can't read cache file " +
+                                      request.filename(),
+                                  src);
+          return false;
+        }
+        ParameterSpaceCacheReadFileReply reply;
+        reply.set_data(std::move(data));
+
+        TincMessage msg;
+        msg.set_messagetype(MessageType::COMMAND_REPLY);
+        msg.set_objecttype(ObjectType::PARAMETER_SPACE);
+        auto *msgDetails = msg.details().New();
+
+        Command command;
+        command.set_message_id(commandNumber);
+        command.mutable_id()->set_id(psId);
+
+        auto *commandDetails = command.details().New();
+        commandDetails->PackFrom(reply);
+        command.set_allocated_details(commandDetails);
+
+        msgDetails->PackFrom(command);
+        msg.set_allocated_details(msgDetails);
+
+        sendTincMessage(&msg, src);
+        return true;
+      }
+    }
+    sendCommandErrorMessage(commandNumber, psId,
+                            "ParameterSpace not registered in server", src);
   } else {
     sendCommandErrorMessage(commandNumber, psId,
                             "Unsupported command reply for ParameterSpace",
@@ -2263,7 +2361,60 @@ bool TincProtocol::processCommandParameterSpace(void *any, al::Socket *src) {
   return false;
 }
 
-bool TincProtocol::processCommandDataPool(void *any, al::Socket *src) {
+bool TincProtocol::sendSliceData(uint64_t commandNumber,
+                                 std::string datapoolId,
+                                 const std::vector<std::string> &fields,
+                                 const DataPool::SliceData &slice,
+                                 size_t chunkSize, al::Socket *src) {
+  if (chunkSize == 0) {
+    chunkSize = TINC_SLICE_CHUNK_SIZE;
+  }
+  size_t valuesPerChunk = std::max((size_t)1, chunkSize / sizeof(float));
+  size_t offset = 0;
+  // Empty slices are sent as a single reply with no data
+  do {
+    size_t count = std::min(valuesPerChunk, slice.values.size() - offset);
+    TincMessage msg;
+    msg.set_messagetype(MessageType::COMMAND_REPLY);
+    msg.set_objecttype(ObjectType::DATA_POOL);
+    auto *msgDetails = msg.details().New();
+
+    Command command;
+    command.set_message_id(commandNumber);
+    command.mutable_id()->set_id(datapoolId);
+
+    auto *commandDetails = command.details().New();
+    DataPoolCommandSliceReply reply;
+    for (const auto &dim : slice.dimensions) {
+      reply.add_dimension(dim);
+    }
+    for (auto size : slice.shape) {
+      reply.add_shape(size);
+    }
+    for (const auto &field : fields) {
+      reply.add_field(field);
+    }
+    reply.set_datatype(SliceDataType::SLICE_FLOAT32);
+    reply.set_totalcount(slice.values.size());
+    reply.set_offset(offset);
+    reply.set_data(slice.values.data() + offset, count * sizeof(float));
+
+    commandDetails->PackFrom(reply);
+    command.set_allocated_details(commandDetails);
+
+    msgDetails->PackFrom(command);
+    msg.set_allocated_details(msgDetails);
+
+    if (!sendTincMessage(&msg, src)) {
+      return false;
+    }
+    offset += count;
+  } while (offset < slice.values.size());
+  return true;
+}
+
+bool TincProtocol::processCommandDataPool(void *any, al::Socket *src,
+                                          DataPool *dataPool) {
   google::protobuf::Any *details = static_cast<google::protobuf::Any *>(any);
   if (!details->Is<Command>()) {
     std::cerr << __FUNCTION__ << ": Command message contains invalid payload"
@@ -2275,6 +2426,7 @@ bool TincProtocol::processCommandDataPool(void *any, al::Socket *src) {
   details->UnpackTo(&incomingCommand);
   uint64_t commandNumber = incomingCommand.message_id();
   auto datapoolId = incomingCommand.id().id();
+  auto dataPools = dataPool ? std::vector<DataPool *>{dataPool} : mDataPools;
   if (incomingCommand.details().Is<DataPoolCommandSlice>()) {
     DataPoolCommandSlice commandSlice;
     incomingCommand.details().UnpackTo(&commandSlice);
@@ -2286,8 +2438,17 @@ bool TincProtocol::processCommandDataPool(void *any, al::Socket *src) {
       dims.push_back(commandSlice.dimension(i));
     }
 
-    for (auto dp : mDataPools) {
-      if (dp->getId() == datapoolId) {
+    for (auto dp : dataPools) {
+      if (dp->getId() == datapoolId && commandSlice.inlinedata()) {
+        DataPool::SliceData slice;
+        if (!dp->readDataSlice(field, dims, slice)) {
+          sendCommandErrorMessage(commandNumber, datapoolId,
+                                  "Can't create slice", src);
+          return false;
+        }
+        return sendSliceData(commandNumber, datapoolId, {field}, slice,
+                             commandSlice.chunksize(), src);
+      } else if (dp->getId() == datapoolId) {
         auto sliceName = dp->createDataSlice(field, dims);
 
         if (mVerbose) {
@@ -2321,11 +2482,130 @@ bool TincProtocol::processCommandDataPool(void *any, al::Socket *src) {
     }
     sendCommandErrorMessage(commandNumber, datapoolId,
                             "Datapool not registered in server", src);
+  } else if (incomingCommand.details().Is<DataPoolCommandSliceFields>()) {
+    DataPoolCommandSliceFields commandSlice;
+    incomingCommand.details().UnpackTo(&commandSlice);
+
+    std::vector<std::string> fields(commandSlice.field().begin(),
+                                    commandSlice.field().end());
+    std::vector<std::string> dims(commandSlice.dimension().begin(),
+                                  commandSlice.dimension().end());
+
+    for (auto dp : dataPools) {
+      if (dp->getId() == datapoolId && commandSlice.inlinedata()) {
+        std::vector<DataPool::SliceData> slices;
+        if (fields.size() == 0 || !dp->readDataSlices(fields, dims, slices)) {
+          sendCommandErrorMessage(commandNumber, datapoolId,
+                                  "Can't create slices", src);
+          return false;
+        }
+        // Send all fields as a single flattened slice
+        DataPool::SliceData slice;
+        slice.dimensions = slices[0].dimensions;
+        slice.shape = slices[0].shape;
+        slice.values.reserve(slices[0].values.size() * slices.size());
+        for (const auto &fieldSlice : slices) {
+          slice.values.insert(slice.values.end(), fieldSlice.values.begin(),
+                              fieldSlice.values.end());
+        }
+        return sendSliceData(commandNumber, datapoolId, fields, slice,
+                             commandSlice.chunksize(), src);
+      } else if (dp->getId() == datapoolId) {
+        auto sliceName = dp->createDataSlices(fields, dims);
+
+        if (mVerbose) {
+          std::cout << commandNumber << "::::: " << sliceName << std::endl;
+        }
+
+        TincMessage msg;
+        msg.set_messagetype(MessageType::COMMAND_REPLY);
+        msg.set_objecttype(ObjectType::DATA_POOL);
+        auto *msgDetails = msg.details().New();
+
+        Command command;
+        command.set_message_id(commandNumber);
+        command.mutable_id()->set_id(datapoolId);
+
+        auto *commandDetails = command.details().New();
+        DataPoolCommandSliceReply reply;
+        reply.set_filename(sliceName);
+        for (const auto &field : fields) {
+          reply.add_field(field);
+        }
+
+        commandDetails->PackFrom(reply);
+        command.set_allocated_details(commandDetails);
+
+        msgDetails->PackFrom(command);
+        msg.set_allocated_details(msgDetails);
+
+        sendTincMessage(&msg, src);
+        return true;
+      }
+    }
+    sendCommandErrorMessage(commandNumber, datapoolId,
+                            "Datapool not registered in server", src);
+  } else if (incomingCommand.details().Is<DataPoolCommandReduce>()) {
+    DataPoolCommandReduce commandReduce;
+    incomingCommand.details().UnpackTo(&commandReduce);
+
+    std::vector<std::string> dims;
+    dims.reserve(commandReduce.dimension_size());
+    for (size_t i = 0; i < (size_t)commandReduce.dimension_size(); i++) {
+      dims.push_back(commandReduce.dimension(i));
+    }
+
+    for (auto dp : dataPools) {
+      if (dp->getId() == datapoolId) {
+        DataPool::SliceReduction reduction;
+        if (!dp->reduceDataSlice(commandReduce.field(), dims, reduction,
+                                 commandReduce.histogrambins(),
+                                 commandReduce.histogrammin(),
+                                 commandReduce.histogrammax())) {
+          sendCommandErrorMessage(commandNumber, datapoolId,
+                                  "Can't create slice for reduction", src);
+          return false;
+        }
+
+        TincMessage msg;
+        msg.set_messagetype(MessageType::COMMAND_REPLY);
+        msg.set_objecttype(ObjectType::DATA_POOL);
+        auto *msgDetails = msg.details().New();
+
+        Command command;
+        command.set_message_id(commandNumber);
+        command.mutable_id()->set_id(datapoolId);
+
+        auto *commandDetails = command.details().New();
+        DataPoolCommandReduceReply reply;
+        reply.set_count(reduction.count);
+        reply.set_missing(reduction.missing);
+        reply.set_min(reduction.min);
+        reply.set_max(reduction.max);
+        reply.set_mean(reduction.mean);
+        reply.set_histogrammin(reduction.histogramMin);
+        reply.set_histogrammax(reduction.histogramMax);
+        for (auto bin : reduction.histogram) {
+          reply.add_histogram(bin);
+        }
+
+        commandDetails->PackFrom(reply);
+        command.set_allocated_details(commandDetails);
+
+        msgDetails->PackFrom(command);
+        msg.set_allocated_details(msgDetails);
+
+        sendTincMessage(&msg, src);
+        return true;
+      }
+    }
+    sendCommandErrorMessage(commandNumber, datapoolId,
+                            "Datapool not registered in server", src);
   } else if (incomingCommand.details().Is<DataPoolCommandCurrentFiles>()) {
     DataPoolCommandCurrentFiles commandSlice;
     incomingCommand.details().UnpackTo(&commandSlice);
 
-    for (auto dp : mDataPools) {
+    for (auto dp : dataPools) {
       if (dp->getId() == datapoolId) {
         auto filenames = dp->getCurrentFiles();
 
@@ -2384,7 +2664,9 @@ bool TincProtocol::sendProtobufMessage(void *message, al::Socket *dst) {
   if (mVerbose) {
     std::cout << __FUNCTION__ << ": Sending bytes " << size << std::endl;
   }
+  std::unique_lock<std::mutex> lk(mSendLock);
   auto bytes = dst->send(buffer, size + sizeof(size_t));
+  lk.unlock();
   if (bytes != size + sizeof(size_t)) {
     buffer[size + 1] = '\0';
     std::cerr << __FUNCTION__ << ": Error sending: " << buffer << " ("
@@ -15,11 +15,21 @@
 
 using namespace tinc;
 
-TincServer::TincServer() {
+// Default number of threads processing data pool commands
+#define TINC_SERVER_COMMAND_THREADS 4
+
+TincServer::TincServer()
+    : mCommandThreadPool(new ThreadPool(TINC_SERVER_COMMAND_THREADS)) {
   mVersion = TINC_PROTOCOL_VERSION;
   mRevision = TINC_PROTOCOL_REVISION;
 }
 
+TincServer::~TincServer() {
+  setCacheStatusInterval(0.0);
+  // Finish commands in progress while the server is still valid
+  setCommandThreadCount(0);
+}
+
 bool TincServer::processIncomingMessage(al::Message &message, al::Socket *src) {
 
   markBusy();
@@ -81,8 +91,13 @@ bool TincServer::processIncomingMessage(al::Message &message, al::Socket *src) {
         }
         break;
       case MessageType::COMMAND:
-        std::cout << "Server received Command message" << std::endl;
-        if (!readCommandMessage(objectType, (void *)&details, src)) {
+        if (verbose()) {
+          std::cout << "Server received Command message" << std::endl;
+        }
+        if (objectType == ObjectType::DATA_POOL) {
+          // Slicing can take long. Keep the network thread free.
+          processCommandAsync(objectType, (void *)&details, src);
+        } else if (!readCommandMessage(objectType, (void *)&details, src)) {
           std::cerr << __FUNCTION__ << ": Error processing Command message"
                     << std::endl;
         }
@@ -271,6 +286,74 @@ void TincServer::markAvailable() {
   TincProtocol::markAvailable();
 }
 
+void TincServer::setCacheStatusInterval(float intervalsec) {
+  {
+    std::unique_lock<std::mutex> lk(mCacheStatusLock);
+    mCacheStatusInterval = intervalsec;
+  }
+  mCacheStatusSignal.notify_all();
+  if (intervalsec <= 0.0) {
+    if (mCacheStatusThread) {
+      mCacheStatusThread->join();
+      mCacheStatusThread = nullptr;
+    }
+    return;
+  }
+  if (!mCacheStatusThread) {
+    mCacheStatusThread = std::make_unique<std::thread>([this]() {
+      std::unique_lock<std::mutex> lk(mCacheStatusLock);
+      while (mCacheStatusInterval > 0.0) {
+        lk.unlock();
+        sendCacheStatus();
+        lk.lock();
+        float interval = mCacheStatusInterval;
+        mCacheStatusSignal.wait_for(
+            lk, std::chrono::milliseconds((int64_t)(interval * 1000)),
+            [&]() { return mCacheStatusInterval != interval; });
+      }
+    });
+  }
+}
+
+void TincServer::sendCacheStatus(al::Socket *dst) {
+  // Runs on the cache status thread while the network thread registers
+  // parameter spaces
+  std::vector<ParameterSpace *> parameterSpaces;
+  {
+    std::unique_lock<std::mutex> lk(mParameterSpacesLock);
+    parameterSpaces = mParameterSpaces;
+  }
+  for (auto *ps : parameterSpaces) {
+    auto cacheManager = ps->getCacheManager();
+    if (!cacheManager) {
+      continue;
+    }
+    auto stats = cacheManager->statistics();
+    ParameterSpaceCacheStatus status;
+    status.mutable_id()->set_id(ps->getId());
+    status.set_lookups(stats.lookups);
+    status.set_hits(stats.hits);
+    status.set_remotehits(stats.remoteHits);
+    status.set_misses(stats.misses);
+    status.set_stalehits(stats.staleHits);
+    status.set_bytesrestored(stats.bytesRestored);
+    status.set_bytesstored(stats.bytesStored);
+    status.set_lookuptimetotal(stats.lookupTimeTotal);
+    status.set_lookuptimemax(stats.lookupTimeMax);
+    status.set_computetimesaved(stats.computeTimeSaved);
+    status.set_entries(stats.entries);
+    status.set_cachesize(stats.cacheSize);
+
+    TincMessage msg;
+    msg.set_messagetype(MessageType::STATUS);
+    msg.set_objecttype(ObjectType::PARAMETER_SPACE);
+    auto *statusDetails = msg.details().New();
+    statusDetails->PackFrom(status);
+    msg.set_allocated_details(statusDetails);
+    sendTincMessage(&msg, dst);
+  }
+}
+
 void TincServer::onConnection(al::Socket *newConnection) {
 
   TincMessage msg;
@@ -317,6 +400,69 @@ void TincServer::processBarrierAckLock(al::Socket *src,
   }
 }
 
+void TincServer::setCommandThreadCount(size_t threadCount) {
+  std::unique_lock<std::mutex> lk(mCommandThreadPoolLock);
+  // Destroying the pool waits for queued commands
+  mCommandThreadPool.reset();
+  if (threadCount > 0) {
+    mCommandThreadPool.reset(new ThreadPool(threadCount));
+  }
+}
+
+void TincServer::processCommandAsync(int objectType, void *details,
+                                     al::Socket *src) {
+  // Hold the connection so the socket outlives a disconnect during the
+  // command
+  std::shared_ptr<al::Socket> connection;
+  {
+    std::unique_lock<std::mutex> lk(mConnectionsLock);
+    for (auto conn : mServerConnections) {
+      if (conn.get() == src) {
+        connection = conn;
+        break;
+      }
+    }
+  }
+  // Find the data pool and copy the state of its parameter space here, so
+  // that the command doesn't read it while messages change it
+  auto *anyDetails = static_cast<google::protobuf::Any *>(details);
+  DataPool *dataPool = nullptr;
+  if (anyDetails->Is<Command>()) {
+    Command command;
+    anyDetails->UnpackTo(&command);
+    for (auto *dp : mDataPools) {
+      if (dp->getId() == command.id().id()) {
+        dataPool = dp;
+        break;
+      }
+    }
+  }
+  std::unique_lock<std::mutex> lk(mCommandThreadPoolLock);
+  if (!connection || !mCommandThreadPool || !dataPool) {
+    lk.unlock();
+    if (!readCommandMessage(objectType, details, src)) {
+      std::cerr << __FUNCTION__ << ": Error processing Command message"
+                << std::endl;
+    }
+    return;
+  }
+  auto commandDetails = std::make_shared<google::protobuf::Any>(*anyDetails);
+  std::shared_ptr<ParameterSpace> ps =
+      dataPool->getParameterSpace().snapshot();
+  markBusy();
+  mCommandThreadPool->push([this, commandDetails, connection, dataPool, ps]() {
+    {
+      DataPool::ScopedParameterSpace scope(*dataPool, *ps);
+      if (!processCommandDataPool(commandDetails.get(), connection.get(),
+                                  dataPool)) {
+        std::cerr << "processCommandAsync: Error processing Command message"
+                  << std::endl;
+      }
+    }
+    markAvailable();
+  });
+}
+
 void TincServer::disconnectClient(al::Socket *src) {
   std::unique_lock<std::mutex> lk(mConnectionsLock);
   for (auto connIt = mServerConnections.begin();
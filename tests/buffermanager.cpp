@@ -0,0 +1,127 @@
+#include "gtest/gtest.h"
+
+#include "tinc/BufferManager.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace tinc;
+
+TEST(BufferManager, TripleBuffer) {
+  BufferManager<int> buffer(2, BUFFER_TRIPLE);
+  EXPECT_EQ(buffer.mSize, 3);
+  EXPECT_EQ(buffer.getMode(), BUFFER_TRIPLE);
+  EXPECT_FALSE(buffer.newDataAvailable());
+
+  auto writable = buffer.getWritable();
+  *writable = 1;
+  buffer.doneWriting(writable);
+  EXPECT_TRUE(buffer.newDataAvailable());
+  // Peeking keeps the data marked as new
+  EXPECT_EQ(*buffer.get(false), 1);
+  EXPECT_TRUE(buffer.newDataAvailable());
+  bool isNew = false;
+  EXPECT_EQ(*buffer.get(&isNew), 1);
+  EXPECT_TRUE(isNew);
+  EXPECT_FALSE(buffer.newDataAvailable());
+
+  // Writer never blocks, even if the reader holds its buffer
+  auto held = buffer.get();
+  for (int i = 2; i < 5; i++) {
+    writable = buffer.getWritable();
+    EXPECT_NE(writable, held);
+    *writable = i;
+    buffer.doneWriting(writable);
+  }
+  EXPECT_EQ(*held, 1);
+  // Reader gets the latest data
+  EXPECT_EQ(*buffer.get(), 4);
+  EXPECT_EQ(*buffer.get(), 4);
+}
+
+TEST(BufferManager, TripleBufferThreads) {
+  BufferManager<std::vector<int>> buffer(2, BUFFER_TRIPLE);
+  const int iterations = 20000;
+  std::atomic<bool> failed(false);
+
+  std::thread writer([&]() {
+    for (int i = 1; i <= iterations; i++) {
+      auto writable = buffer.getWritable();
+      writable->assign(64, i);
+      buffer.doneWriting(writable);
+    }
+  });
+
+  int last = 0;
+  while (last < iterations && !failed) {
+    auto data = buffer.get();
+    if (data->size() == 0) {
+      continue;
+    }
+    int value = data->front();
+    // Values must never be torn and never go back in time
+    if (value < last ||
+        std::count(data->begin(), data->end(), value) != 64) {
+      failed = true;
+    }
+    last = value;
+  }
+  writer.join();
+  EXPECT_FALSE(failed);
+  EXPECT_EQ(buffer.get()->front(), iterations);
+}
+
+TEST(BufferManager, WaitForRelease) {
+  BufferManager<int> buffer(2);
+  auto writable = buffer.getWritable();
+  *writable = 1;
+  buffer.doneWriting(writable);
+  writable.reset();
+  auto first = buffer.get();
+  writable = buffer.getWritable();
+  *writable = 2;
+  buffer.doneWriting(writable);
+  writable.reset();
+  auto second = buffer.get();
+
+  // Readers hold both buffers
+  EXPECT_EQ(buffer.tryGetWritable(), nullptr);
+  EXPECT_EQ(buffer.getWritable(0.05f), nullptr);
+
+  std::thread reader([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    first.reset();
+  });
+  writable = buffer.getWritable(5.0f);
+  reader.join();
+  EXPECT_NE(writable, nullptr);
+  EXPECT_EQ(*writable, 1);
+  EXPECT_NE(writable, second);
+}
+
+TEST(BufferManager, DropOldest) {
+  BufferManager<int> buffer(2);
+  buffer.setFullPolicy(BUFFER_FULL_DROP_OLDEST);
+  auto writable = buffer.getWritable();
+  *writable = 1;
+  buffer.doneWriting(writable);
+  writable.reset();
+  auto first = buffer.get();
+  writable = buffer.getWritable();
+  *writable = 2;
+  buffer.doneWriting(writable);
+  writable.reset();
+  auto second = buffer.get();
+
+  // Oldest buffer is replaced and its reader keeps the old data
+  writable = buffer.tryGetWritable();
+  EXPECT_NE(writable, nullptr);
+  EXPECT_NE(writable, first);
+  EXPECT_NE(writable, second);
+  *writable = 3;
+  buffer.doneWriting(writable);
+  EXPECT_EQ(*first, 1);
+  EXPECT_EQ(*second, 2);
+  EXPECT_EQ(*buffer.get(), 3);
+}
@@ -0,0 +1,36 @@
+#include "gtest/gtest.h"
+
+#include "tinc/ThreadPool.hpp"
+
+#include <atomic>
+#include <vector>
+
+using namespace tinc;
+
+TEST(ThreadPool, ParallelFor) {
+  ThreadPool pool(3);
+  std::vector<int> values(1000, 0);
+  for (int i = 0; i < 10; i++) {
+    pool.parallelFor(values.size(), [&](size_t begin, size_t end) {
+      for (size_t j = begin; j < end; j++) {
+        values[j]++;
+      }
+    }, 7);
+  }
+  for (auto value : values) {
+    EXPECT_EQ(value, 10);
+  }
+}
+
+TEST(ThreadPool, NestedParallelFor) {
+  ThreadPool pool(2);
+  std::atomic<size_t> count{0};
+  // Tasks in the pool can wait on parallelFor() without deadlocking
+  pool.parallelFor(4, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      pool.parallelFor(100,
+                       [&](size_t b, size_t e) { count += e - b; });
+    }
+  }, 1);
+  EXPECT_EQ(count, 400);
+}
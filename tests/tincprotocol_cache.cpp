@@ -4,11 +4,15 @@
 #include "tinc/ParameterSpaceDimension.hpp"
 #include "tinc/ProcessorCpp.hpp"
 #include "tinc/CacheManager.hpp"
+#include "tinc/TincClient.hpp"
+#include "tinc/TincServer.hpp"
 #include "al/io/al_File.hpp"
+#include "al/system/al_Time.hpp"
 
 #include <ctime>
 #include <chrono>
 #include <fstream>
+#include <sstream>
 
 using namespace tinc;
 
@@ -202,3 +206,564 @@ TEST(Cache, ParameterSpace) {
 
   ps.runProcess(processor);
 }
+
+TEST(Cache, HitsAndEviction) {
+  if (al::File::exists("eviction_cache/eviction_cache.json")) {
+    al::File::remove("eviction_cache/eviction_cache.json");
+  }
+  CacheManager cmanage(
+      DistributedPath{"eviction_cache.json", "eviction_cache/"});
+
+  for (int i = 0; i < 4; i++) {
+    std::string filename = "entry_" + std::to_string(i) + ".txt";
+    std::ofstream f(cmanage.cacheDirectory() + filename);
+    f << std::string(100, 'x');
+    f.close();
+
+    CacheEntry entry;
+    entry.timestampStart = "2021-01-01T10:00:00";
+    entry.timestampEnd = "2021-01-01T10:00:0" + std::to_string(i);
+    entry.filenames = {filename};
+    entry.sourceInfo.type = "SourceType";
+    entry.sourceInfo.tincId = "ProcessorId";
+    SourceArgument arg;
+    arg.id = "index";
+    arg.value = (int64_t)i;
+    entry.sourceInfo.arguments.push_back(arg);
+    cmanage.appendEntry(entry);
+  }
+  EXPECT_EQ(cmanage.cacheSize(), 400);
+
+  // Access first entry, so it is the most recently used
+  SourceInfo query;
+  query.type = "SourceType";
+  query.tincId = "ProcessorId";
+  SourceArgument arg;
+  arg.id = "index";
+  arg.value = (int64_t)0;
+  query.arguments.push_back(arg);
+  auto files = cmanage.findCache(query);
+  EXPECT_EQ(files.size(), 1);
+  EXPECT_EQ(cmanage.entries()[0].cacheHits, 1);
+
+  cmanage.setEvictionPolicy(CacheManager::EVICTION_LRU);
+  cmanage.setMaxSize(250);
+
+  // Metadata is updated before files are removed, so wait for both
+  int counter = 0;
+  while ((cmanage.cacheSize() > 250 ||
+          al::File::exists(cmanage.cacheDirectory() + "entry_2.txt")) &&
+         counter++ < TINC_TESTS_TIMEOUT_MS) {
+    al::al_sleep(0.001);
+  }
+  EXPECT_LE(cmanage.cacheSize(), 250);
+  auto entries = cmanage.entries();
+  EXPECT_EQ(entries.size(), 2);
+  EXPECT_TRUE(al::File::exists(cmanage.cacheDirectory() + "entry_0.txt"));
+  EXPECT_FALSE(al::File::exists(cmanage.cacheDirectory() + "entry_1.txt"));
+  EXPECT_FALSE(al::File::exists(cmanage.cacheDirectory() + "entry_2.txt"));
+  EXPECT_TRUE(al::File::exists(cmanage.cacheDirectory() + "entry_3.txt"));
+
+  cmanage.clearCache();
+  EXPECT_EQ(cmanage.entries().size(), 0);
+  EXPECT_EQ(cmanage.cacheSize(), 0);
+  EXPECT_FALSE(al::File::exists(cmanage.cacheDirectory() + "entry_0.txt"));
+}
+
+#ifdef TINC_HAS_ZLIB
+TEST(Cache, Compression) {
+  if (al::File::exists("compressed_cache/compressed_cache.json")) {
+    al::File::remove("compressed_cache/compressed_cache.json");
+  }
+  CacheManager cmanage(
+      DistributedPath{"compressed_cache.json", "compressed_cache/"});
+  cmanage.clearCache();
+  EXPECT_TRUE(cmanage.setCompression(CacheManager::CODEC_ZLIB, 1, 9));
+
+  std::string contents;
+  for (int i = 0; i < 10000; i++) {
+    contents += std::to_string(i % 17) + ",";
+  }
+  {
+    std::ofstream f("compression_output.txt");
+    f << contents;
+  }
+
+  CacheEntry entry;
+  entry.timestampStart = "2021-01-01T10:00:00";
+  entry.timestampEnd = "2021-01-01T10:00:01";
+  entry.filenames = {"compressed.txt"};
+  entry.sourceInfo.type = "SourceType";
+  entry.sourceInfo.tincId = "ProcessorId";
+  EXPECT_TRUE(cmanage.storeFiles({"compression_output.txt"}, entry));
+  EXPECT_EQ(entry.codec, "zlib");
+  EXPECT_EQ(entry.compressionLevel, 1);
+  EXPECT_LT(entry.size, contents.size());
+  cmanage.appendEntry(entry);
+
+  EXPECT_TRUE(
+      al::File::exists(cmanage.cacheDirectory() + "compressed.txt.gz"));
+  EXPECT_FALSE(al::File::exists(cmanage.cacheDirectory() + "compressed.txt"));
+
+  SourceInfo query;
+  query.type = "SourceType";
+  query.tincId = "ProcessorId";
+  auto files = cmanage.findCache(query);
+  EXPECT_EQ(files.size(), 1);
+  EXPECT_TRUE(cmanage.restoreFile(files[0], "compression_restored.txt"));
+
+  std::ifstream f("compression_restored.txt");
+  std::stringstream ss;
+  ss << f.rdbuf();
+  EXPECT_EQ(ss.str(), contents);
+
+  // Codec is stored in metadata
+  cmanage.writeToDisk();
+  CacheManager cmanage2(
+      DistributedPath{"compressed_cache.json", "compressed_cache/"});
+  EXPECT_EQ(cmanage2.entries()[0].codec, "zlib");
+
+  cmanage.clearCache();
+  EXPECT_FALSE(
+      al::File::exists(cmanage.cacheDirectory() + "compressed.txt.gz"));
+}
+#endif
+
+TEST(Cache, DependencyHash) {
+  if (al::File::exists("hash_cache/hash_cache.json")) {
+    al::File::remove("hash_cache/hash_cache.json");
+  }
+  CacheManager cmanage(DistributedPath{"hash_cache.json", "hash_cache/"});
+
+  {
+    std::ofstream f("hash_input.txt");
+    f << "abc";
+  }
+  EXPECT_EQ(
+      cmanage.fileHash("hash_input.txt"),
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+  {
+    std::ofstream f(cmanage.cacheDirectory() + "hash_output.txt");
+    f << "output";
+  }
+  CacheEntry entry;
+  entry.timestampStart = "2021-01-01T10:00:00";
+  entry.timestampEnd = "2021-01-01T10:00:01";
+  entry.filenames = {"hash_output.txt"};
+  entry.sourceInfo.type = "SourceType";
+  entry.sourceInfo.tincId = "ProcessorId";
+  entry.sourceInfo.hash = "ScriptHash";
+  FileDependency dep;
+  dep.file = DistributedPath("hash_input.txt");
+  EXPECT_TRUE(cmanage.updateFileDependency(dep));
+  EXPECT_EQ(dep.size, 3);
+  EXPECT_NE(dep.modifiedNs, 0);
+  entry.sourceInfo.fileDependencies.push_back(dep);
+  cmanage.appendEntry(entry);
+  cmanage.writeToDisk();
+
+  // File identity is persisted so lookups after a restart skip rehashing
+  {
+    CacheManager reloaded(
+        DistributedPath{"hash_cache.json", "hash_cache/"});
+    auto reloadedDep = reloaded.entries()[0].sourceInfo.fileDependencies[0];
+    EXPECT_EQ(reloadedDep.inode, dep.inode);
+    EXPECT_EQ(reloadedDep.modifiedNs, dep.modifiedNs);
+  }
+
+  SourceInfo query;
+  query.type = "SourceType";
+  query.tincId = "ProcessorId";
+  query.hash = "ScriptHash";
+  EXPECT_EQ(cmanage.findCache(query).size(), 1);
+
+  // Different source hash does not match
+  query.hash = "ChangedScriptHash";
+  EXPECT_EQ(cmanage.findCache(query).size(), 0);
+  EXPECT_TRUE(cmanage.entries()[0].stale);
+
+  // Stale entries are skipped even without verification
+  query.hash = "ScriptHash";
+  EXPECT_EQ(cmanage.findCache(query, false).size(), 0);
+
+  // Changing the input file makes the entry stale
+  entry.timestampEnd = "2021-01-01T10:00:02";
+  cmanage.appendEntry(entry);
+  EXPECT_EQ(cmanage.findCache(query).size(), 1);
+  {
+    std::ofstream f("hash_input.txt");
+    f << "abd";
+  }
+  EXPECT_EQ(cmanage.findCache(query).size(), 0);
+  EXPECT_TRUE(cmanage.entries()[0].stale);
+
+  cmanage.clearCache();
+}
+
+TEST(Cache, ConcurrentWriters) {
+  if (al::File::exists("shared_cache/shared_cache.json")) {
+    al::File::remove("shared_cache/shared_cache.json");
+  }
+  // Two managers on the same metadata behave like two processes sharing a
+  // cache directory.
+  CacheManager writer1(DistributedPath{"shared_cache.json", "shared_cache/"});
+  CacheManager writer2(DistributedPath{"shared_cache.json", "shared_cache/"});
+
+  for (int i = 0; i < 10; i++) {
+    CacheEntry entry;
+    entry.timestampStart = "2021-01-01T10:00:00";
+    entry.timestampEnd = "2021-01-01T10:00:01";
+    entry.sourceInfo.type = "SourceType";
+    entry.sourceInfo.tincId = "ProcessorId";
+    SourceArgument arg;
+    arg.id = "index";
+    arg.value = (int64_t)i;
+    entry.sourceInfo.arguments.push_back(arg);
+    entry.filenames = {"shared_" + std::to_string(i) + ".txt"};
+    if (i % 2 == 0) {
+      writer1.appendEntry(entry);
+      writer1.writeToDisk();
+    } else {
+      writer2.appendEntry(entry);
+      writer2.writeToDisk();
+    }
+  }
+
+  CacheManager reader(DistributedPath{"shared_cache.json", "shared_cache/"});
+  EXPECT_EQ(reader.entries().size(), 10);
+
+  // Removals are not undone by other writers
+  writer1.clearCache();
+  writer2.writeToDisk();
+  reader.updateFromDisk();
+  EXPECT_EQ(reader.entries().size(), 0);
+  EXPECT_EQ(writer2.entries().size(), 0);
+}
+
+TEST(Cache, MetadataJournal) {
+  if (al::File::exists("journal_cache/journal_cache.json")) {
+    al::File::remove("journal_cache/journal_cache.json");
+  }
+  CacheManager writer(DistributedPath{"journal_cache.json", "journal_cache/"});
+  auto makeEntry = [](int i) {
+    CacheEntry entry;
+    entry.timestampStart = "2021-01-01T10:00:00";
+    entry.timestampEnd = "2021-01-01T10:00:01";
+    entry.sourceInfo.type = "SourceType";
+    entry.sourceInfo.tincId = "ProcessorId";
+    SourceArgument arg;
+    arg.id = "index";
+    arg.value = (int64_t)i;
+    entry.sourceInfo.arguments.push_back(arg);
+    entry.filenames = {"journal_" + std::to_string(i) + ".txt"};
+    return entry;
+  };
+  for (int i = 0; i < 100; i++) {
+    auto entry = makeEntry(i);
+    writer.appendEntry(entry);
+    writer.writeToDisk();
+  }
+  // Each write appends to the journal instead of replacing the metadata file
+  EXPECT_TRUE(al::File::exists("journal_cache/journal_cache.json.journal"));
+
+  CacheManager reader(DistributedPath{"journal_cache.json", "journal_cache/"});
+  EXPECT_EQ(reader.entries().size(), 100);
+
+  // New records are merged by the next write
+  auto entry = makeEntry(100);
+  writer.appendEntry(entry);
+  writer.writeToDisk();
+  reader.writeToDisk();
+  EXPECT_EQ(reader.entries().size(), 101);
+
+  // Removing all entries replaces the metadata file and empties the journal
+  writer.clearCache();
+  EXPECT_FALSE(al::File::exists("journal_cache/journal_cache.json.journal"));
+  reader.writeToDisk();
+  EXPECT_EQ(reader.entries().size(), 0);
+}
+
+TEST(Cache, MemoryTier) {
+  if (al::File::exists("memory_cache/memory_cache.json")) {
+    al::File::remove("memory_cache/memory_cache.json");
+  }
+  CacheManager cmanage(DistributedPath{"memory_cache.json", "memory_cache/"});
+  cmanage.setMemoryTierSize(1 << 20);
+
+  {
+    std::ofstream f("memory_output.txt");
+    f << "memory tier contents";
+  }
+  CacheEntry entry;
+  entry.timestampStart = "2021-01-01T10:00:00";
+  entry.timestampEnd = "2021-01-01T10:00:01";
+  entry.filenames = {"memory_output.txt"};
+  entry.sourceInfo.type = "SourceType";
+  entry.sourceInfo.tincId = "ProcessorId";
+  EXPECT_TRUE(cmanage.storeFiles({"memory_output.txt"}, entry));
+  cmanage.appendEntry(entry);
+
+  auto bytes = cmanage.getFileBytes("memory_output.txt");
+  EXPECT_NE(bytes, nullptr);
+  EXPECT_EQ(std::string(bytes->begin(), bytes->end()), "memory tier contents");
+  EXPECT_EQ(cmanage.memoryTierUsage(), 20);
+  EXPECT_NE(cmanage.getCacheFileBytes("memory_output.txt"), nullptr);
+  // Paths are only served once registered by a store or restore
+  EXPECT_EQ(cmanage.getFileBytes("memory_restored.txt"), nullptr);
+
+  // Reads for remote nodes are limited in size
+  std::string data;
+  EXPECT_TRUE(cmanage.readStoredFile("memory_output.txt", 7,
+                                     TINC_CACHE_MAX_READ_SIZE, data));
+  EXPECT_EQ(data, "tier contents");
+  EXPECT_FALSE(cmanage.readStoredFile("memory_output.txt", 0,
+                                      TINC_CACHE_MAX_READ_SIZE + 1, data));
+
+  // Restoring does not need the file in the cache directory
+  al::File::remove(cmanage.cacheDirectory() + "memory_output.txt");
+  EXPECT_TRUE(cmanage.restoreFile("memory_output.txt", "memory_restored.txt"));
+  bytes = cmanage.getFileBytes("memory_restored.txt");
+  EXPECT_NE(bytes, nullptr);
+
+  // Files changed outside the cache are not served from memory
+  {
+    std::ofstream f("memory_restored.txt");
+    f << "changed";
+  }
+  EXPECT_EQ(cmanage.getFileBytes("memory_restored.txt"), nullptr);
+
+  cmanage.setMemoryTierSize(10);
+  EXPECT_EQ(cmanage.memoryTierUsage(), 0);
+  cmanage.clearCache();
+}
+
+TEST(Cache, RemoteTier) {
+  TincServer tserver;
+  EXPECT_TRUE(tserver.start());
+
+  ParameterSpace serverPs{"remote_ps"};
+  serverPs.enableCache("remote_cache_server");
+  serverPs.getCacheManager()->clearCache();
+  tserver << serverPs;
+
+  {
+    std::ofstream f("remote_output.txt");
+    f << "remote tier contents";
+  }
+  CacheEntry entry;
+  entry.timestampStart = "2021-01-01T10:00:00";
+  entry.timestampEnd = "2021-01-01T10:00:01";
+  entry.filenames = {"remote_output.txt"};
+  entry.sourceInfo.type = "SourceType";
+  entry.sourceInfo.tincId = "ProcessorId";
+  EXPECT_TRUE(
+      serverPs.getCacheManager()->storeFiles({"remote_output.txt"}, entry));
+  serverPs.getCacheManager()->appendEntry(entry);
+
+  ParameterSpace clientPs{"remote_ps"};
+  clientPs.enableCache("remote_cache_client");
+  auto clientCache = clientPs.getCacheManager();
+  clientCache->clearCache();
+
+  TincClient tclient;
+  EXPECT_TRUE(tclient.start());
+  tclient.enableRemoteCache(clientPs);
+
+  SourceInfo query;
+  query.type = "SourceType";
+  query.tincId = "ProcessorId";
+  auto files = clientCache->findCache(query, false);
+  EXPECT_EQ(files.size(), 1);
+  EXPECT_EQ(clientCache->entries().size(), 1);
+  EXPECT_TRUE(clientCache->restoreFile("remote_output.txt",
+                                       "remote_restored.txt"));
+  std::ifstream f("remote_restored.txt");
+  std::string contents((std::istreambuf_iterator<char>(f)),
+                       std::istreambuf_iterator<char>());
+  EXPECT_EQ(contents, "remote tier contents");
+
+  // Entry is now local
+  tclient.disableRemoteCache(clientPs);
+  EXPECT_EQ(clientCache->findCache(query, false).size(), 1);
+
+  query.tincId = "OtherId";
+  tclient.enableRemoteCache(clientPs);
+  EXPECT_EQ(clientCache->findCache(query, false).size(), 0);
+
+  tclient.stop();
+  tserver.stop();
+  clientCache->clearCache();
+  serverPs.getCacheManager()->clearCache();
+}
+
+TEST(Cache, Statistics) {
+  ParameterSpace ps{"stats_ps"};
+  ps.enableCache("stats_cache");
+  auto cmanage = ps.getCacheManager();
+  cmanage->clearCache();
+  cmanage->resetStatistics();
+
+  {
+    std::ofstream f("stats_output.txt");
+    f << "statistics";
+  }
+  CacheEntry entry;
+  entry.timestampStart = "2021-01-01T10:00:00";
+  entry.timestampEnd = "2021-01-01T10:00:03";
+  entry.filenames = {"stats_output.txt"};
+  entry.sourceInfo.type = "SourceType";
+  entry.sourceInfo.tincId = "ProcessorId";
+  EXPECT_TRUE(cmanage->storeFiles({"stats_output.txt"}, entry));
+  cmanage->appendEntry(entry);
+
+  SourceInfo query;
+  query.type = "SourceType";
+  query.tincId = "ProcessorId";
+  EXPECT_EQ(cmanage->findCache(query, false).size(), 1);
+  EXPECT_TRUE(cmanage->restoreFile("stats_output.txt", "stats_restored.txt"));
+  query.tincId = "OtherId";
+  EXPECT_EQ(cmanage->findCache(query, false).size(), 0);
+
+  auto stats = cmanage->statistics();
+  EXPECT_EQ(stats.lookups, 2);
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.staleHits, 0);
+  EXPECT_EQ(stats.bytesStored, 10);
+  EXPECT_EQ(stats.bytesRestored, 10);
+  EXPECT_EQ(stats.computeTimeSaved, 3.0);
+  EXPECT_GE(stats.lookupTimeMax, 0.0);
+  EXPECT_EQ(stats.entries, 1);
+  EXPECT_EQ(stats.cacheSize, 10);
+
+  TincServer tserver;
+  EXPECT_TRUE(tserver.start());
+  tserver << ps;
+  TincClient tclient;
+  EXPECT_TRUE(tclient.start());
+  tserver.setCacheStatusInterval(0.01);
+
+  CacheStatistics serverStats;
+  int counter = 0;
+  while (!tclient.serverCacheStatistics("stats_ps", serverStats)) {
+    al::al_sleep(0.001);
+    if (counter++ == TINC_TESTS_TIMEOUT_MS) {
+      std::cerr << "Timeout" << std::endl;
+      break;
+    }
+  }
+  EXPECT_EQ(serverStats.lookups, 2);
+  EXPECT_EQ(serverStats.hits, 1);
+  EXPECT_EQ(serverStats.computeTimeSaved, 3.0);
+  EXPECT_EQ(serverStats.entries, 1);
+  EXPECT_EQ(serverStats.cacheSize, 10);
+
+  tserver.setCacheStatusInterval(0.0);
+  tclient.stop();
+  tserver.stop();
+  cmanage->clearCache();
+}
+
+TEST(Cache, ArgumentQuantization) {
+  if (al::File::exists("quantized_cache/quantized_cache.json")) {
+    al::File::remove("quantized_cache/quantized_cache.json");
+  }
+  CacheManager cmanage(
+      DistributedPath{"quantized_cache.json", "quantized_cache/"});
+
+  CacheEntry entry;
+  entry.timestampStart = "2021-01-01T10:00:00";
+  entry.timestampEnd = "2021-01-01T10:00:01";
+  entry.filenames = {"quantized_output.txt"};
+  entry.sourceInfo.type = "SourceType";
+  entry.sourceInfo.tincId = "ProcessorId";
+  entry.sourceInfo.arguments.push_back({"dim", VariantValue(0.3)});
+  entry.sourceInfo.arguments.push_back({"fdim", VariantValue(0.1f)});
+  cmanage.appendEntry(entry);
+
+  SourceInfo query;
+  query.type = "SourceType";
+  query.tincId = "ProcessorId";
+  query.arguments.push_back({"fdim", VariantValue(0.1f)});
+  query.arguments.push_back({"dim", VariantValue(0.1 + 0.2)});
+  // Float arguments match at float precision, doubles exactly
+  query.arguments[0].value.valueDouble = 0.1;
+  EXPECT_EQ(cmanage.findCache(query, false).size(), 0);
+
+  cmanage.setArgumentQuantization("dim", 0.05);
+  EXPECT_EQ(cmanage.findCache(query, false).size(), 1);
+
+  query.arguments[1].value.valueDouble = 0.35;
+  EXPECT_EQ(cmanage.findCache(query, false).size(), 0);
+
+  cmanage.setArgumentQuantization("dim", 0.0);
+  query.arguments[1].value.valueDouble = 0.3;
+  EXPECT_EQ(cmanage.findCache(query, false).size(), 1);
+
+  // Float arguments are read back as doubles after a restart, and parameter
+  // spaces send them widened to double
+  cmanage.writeToDisk();
+  CacheManager reloaded(
+      DistributedPath{"quantized_cache.json", "quantized_cache/"});
+  EXPECT_EQ(reloaded.entries()[0].sourceInfo.arguments[1].value.type,
+            VARIANT_DOUBLE);
+  query.arguments[0].value = VariantValue(0.1f);
+  EXPECT_EQ(reloaded.findCache(query, false).size(), 1);
+  query.arguments[0].value = VariantValue((double)0.1f);
+  EXPECT_EQ(reloaded.findCache(query, false).size(), 1);
+  EXPECT_EQ(cmanage.findCache(query, false).size(), 1);
+  cmanage.clearCache();
+}
+
+TEST(Cache, GarbageCollection) {
+  ParameterSpace ps{"gc_ps"};
+  ps.enableCache("gc_cache");
+  auto cmanage = ps.getCacheManager();
+  cmanage->clearCache();
+  cmanage->setGarbageCollection(std::chrono::seconds(0),
+                                std::chrono::seconds(0));
+
+  {
+    std::ofstream f("gc_output.txt");
+    f << "referenced";
+  }
+  CacheEntry entry;
+  entry.timestampStart = "2021-01-01T10:00:00";
+  entry.timestampEnd = "2021-01-01T10:00:01";
+  entry.filenames = {"gc_output.txt"};
+  entry.sourceInfo.type = "SourceType";
+  entry.sourceInfo.tincId = "ProcessorId";
+  EXPECT_TRUE(cmanage->storeFiles({"gc_output.txt"}, entry));
+  cmanage->appendEntry(entry);
+
+  CacheEntry dangling = entry;
+  dangling.filenames = {"gc_deleted.txt"};
+  dangling.sourceInfo.tincId = "OtherId";
+  EXPECT_TRUE(cmanage->storeFiles({"gc_output.txt"}, dangling));
+  cmanage->appendEntry(dangling);
+  al::File::remove(cmanage->cacheDirectory() + "gc_deleted.txt");
+
+  {
+    std::ofstream f(cmanage->cacheDirectory() + "gc_orphan.txt");
+    f << "orphan";
+    std::ofstream f2(cmanage->cacheDirectory() + "gc_partial.txt.tmp");
+    f2 << "partial";
+  }
+
+  EXPECT_EQ(cmanage->collectGarbage(), 3);
+  EXPECT_FALSE(al::File::exists(cmanage->cacheDirectory() + "gc_orphan.txt"));
+  EXPECT_FALSE(
+      al::File::exists(cmanage->cacheDirectory() + "gc_partial.txt.tmp"));
+  EXPECT_TRUE(al::File::exists(cmanage->cacheDirectory() + "gc_output.txt"));
+  EXPECT_TRUE(
+      al::File::exists(cmanage->cacheDirectory() + "tinc_cache.json"));
+
+  auto entries = cmanage->entries();
+  EXPECT_EQ(entries.size(), 2);
+  for (const auto &e : entries) {
+    EXPECT_EQ(e.stale, e.filenames[0] == "gc_deleted.txt");
+  }
+  EXPECT_EQ(cmanage->collectGarbage(), 0);
+  cmanage->clearCache();
+}
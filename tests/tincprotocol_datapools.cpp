@@ -7,8 +7,76 @@
 
 #include "al/ui/al_Parameter.hpp"
 
+#include "al/io/al_File.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
 using namespace tinc;
 
+// Adds ID dimension "dirDim" to a parameter space, with a run directory for
+// each of its values. The directories are removed on destruction, so they
+// are cleaned up also when a test fails.
+class RunDirectories {
+public:
+  RunDirectories(ParameterSpace &ps, const std::string &prefix, size_t count)
+      : mParameterSpace(ps), mPrefix(prefix) {
+    dirDim = ps.newDimension("dirDim", ParameterSpaceDimension::ID);
+    ps.setCurrentPathTemplate("%%dirDim%%");
+    addRuns(count);
+  }
+
+  ~RunDirectories() {
+    for (const auto &path : paths) {
+      al::Dir::removeRecursively(path);
+    }
+  }
+
+  // Append count values to dirDim and create their run directories
+  void addRuns(size_t count) {
+    std::vector<uint8_t> values(count);
+    for (size_t i = 0; i < count; i++) {
+      values[i] = (uint8_t)(dirDim->size() + i);
+    }
+    dirDim->appendSpaceValues(values.data(), count, mPrefix);
+    paths.clear();
+    for (const auto &path : mParameterSpace.runningPaths()) {
+      paths.push_back(al::File::conformDirectory(path));
+      al::Dir::make(paths.back());
+    }
+  }
+
+  // Write contents(run) to filename in each run directory. Runs with empty
+  // contents are skipped, as if they had not finished.
+  void writeFiles(const std::string &filename,
+                  std::function<std::string(size_t)> contents) {
+    for (size_t i = 0; i < paths.size(); i++) {
+      writeFile(i, filename, contents(i));
+    }
+  }
+
+  void writeFile(size_t run, const std::string &filename,
+                 const std::string &contents) {
+    if (contents.size() > 0) {
+      std::ofstream f(paths[run] + filename);
+      f << contents;
+    }
+  }
+
+  std::shared_ptr<ParameterSpaceDimension> dirDim;
+  // Run directories, with trailing separator
+  std::vector<std::string> paths;
+
+private:
+  ParameterSpace &mParameterSpace;
+  std::string mPrefix;
+};
+
 TEST(DataPool, Connection) {
   TincServer tserver;
   EXPECT_TRUE(tserver.start());
@@ -29,3 +97,487 @@ TEST(DataPool, Connection) {
   tclient.stop();
   tserver.stop();
 }
+
+TEST(DataPool, ReadSliceToMemory) {
+  ParameterSpace ps;
+  RunDirectories runs(ps, "datapool_slice_", 3);
+  auto innerDim = ps.newDimension("innerDim");
+  float innerValues[] = {0.0f, 0.5f};
+  innerDim->appendSpaceValues(innerValues, 2);
+
+  EXPECT_EQ(runs.paths.size(), 3);
+  runs.writeFiles("slice_data.json", [](size_t i) {
+    return "{\"value\": [" + std::to_string(i * 10) + ", " +
+           std::to_string(i * 10 + 1) + "]}";
+  });
+
+  DataPool dp(ps);
+  dp.registerDataFile("slice_data.json", "innerDim");
+
+  DataPool::SliceData slice;
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim", "innerDim"}, slice));
+  EXPECT_EQ(slice.shape, std::vector<size_t>({3, 2}));
+  EXPECT_EQ(slice.values,
+            std::vector<float>({0.0f, 1.0f, 10.0f, 11.0f, 20.0f, 21.0f}));
+
+  float buffer[3];
+  innerDim->setCurrentIndex(1);
+  EXPECT_EQ(dp.readDataSlice("value", "dirDim", buffer, 3), 3);
+  EXPECT_EQ(buffer[0], 1.0f);
+  EXPECT_EQ(buffer[2], 21.0f);
+  // Buffer too small
+  EXPECT_EQ(dp.readDataSlice("value", "dirDim", buffer, 2), 0);
+}
+
+TEST(DataPool, SliceRegeneration) {
+  ParameterSpace ps;
+  RunDirectories runs(ps, "datapool_regen_", 3);
+  // Last run has not finished
+  runs.writeFiles("regen_data.json", [](size_t i) {
+    return i < 2 ? "{\"value\": " + std::to_string(i) + "}" : "";
+  });
+
+  DataPool dp("regen_dp", ps);
+  dp.registerDataFile("regen_data.json", "");
+  auto sliceName = dp.createDataSlice("value", "dirDim");
+  EXPECT_NE(sliceName, "");
+  NetCDFFileReader reader;
+  DataFieldMap fields;
+  EXPECT_TRUE(
+      reader.readFields(dp.getCacheDirectory() + sliceName, "data", fields));
+  EXPECT_TRUE(std::isnan(fields["data"]->at(2)));
+
+  // Output of the last run appears
+  runs.writeFile(2, "regen_data.json", "{\"value\": 2}");
+  EXPECT_EQ(dp.createDataSlice("value", "dirDim"), sliceName);
+  fields.clear();
+  EXPECT_TRUE(
+      reader.readFields(dp.getCacheDirectory() + sliceName, "data", fields));
+  EXPECT_EQ(fields["data"]->at(2), 2.0f);
+
+  // Slice dimension grows
+  runs.addRuns(1);
+  EXPECT_EQ(runs.paths.size(), 4);
+  runs.writeFile(3, "regen_data.json", "{\"value\": 3}");
+  EXPECT_EQ(dp.createDataSlice("value", "dirDim"), sliceName);
+  fields.clear();
+  EXPECT_TRUE(
+      reader.readFields(dp.getCacheDirectory() + sliceName, "data", fields));
+  EXPECT_EQ(fields["data"]->size(), 4);
+  EXPECT_EQ(fields["data"]->at(3), 3.0f);
+
+  al::File::remove(dp.getCacheDirectory() + sliceName);
+}
+
+TEST(DataPool, FileReaders) {
+  ParameterSpace ps;
+  RunDirectories runs(ps, "datapool_readers_", 2);
+  auto innerDim = ps.newDimension("innerDim");
+  float innerValues[] = {0.0f, 0.5f, 1.0f};
+  innerDim->appendSpaceValues(innerValues, 3);
+
+  for (size_t i = 0; i < runs.paths.size(); i++) {
+    const auto &path = runs.paths[i];
+    std::ofstream csv(path + "table.csv");
+    csv << "label,value\n";
+    for (size_t j = 0; j < 3; j++) {
+      csv << "row" << j << "," << i * 10 + j << "\n";
+    }
+    // Interleaved records of an int32 id and a double value
+    std::ofstream bin(path + "records.dat", std::ios::binary);
+    for (int32_t j = 0; j < 3; j++) {
+      double value = i * 100.0 + j;
+      bin.write((const char *)&j, sizeof(j));
+      bin.write((const char *)&value, sizeof(value));
+    }
+  }
+
+  DataPool csvPool(ps);
+  csvPool.registerDataFile("table.csv", "innerDim");
+  DataPool::SliceData slice;
+  EXPECT_TRUE(csvPool.readDataSlice("value", {"dirDim", "innerDim"}, slice));
+  EXPECT_EQ(slice.values,
+            std::vector<float>({0.0f, 1.0f, 2.0f, 10.0f, 11.0f, 12.0f}));
+  // Text columns are not fields
+  EXPECT_TRUE(csvPool.readDataSlice("label", {"innerDim"}, slice));
+  EXPECT_TRUE(std::isnan(slice.values[0]));
+
+  DataPool binaryPool(ps);
+  auto reader = std::make_shared<BinaryFileReader>();
+  reader->addField("id", BinaryFileReader::INT32, 0, 12);
+  reader->addField("value", BinaryFileReader::FLOAT64, 4, 12);
+  binaryPool.registerFileReader("records", reader, {".dat"});
+  binaryPool.registerDataFile("records.dat", "innerDim");
+  EXPECT_TRUE(binaryPool.readDataSlice("value", {"dirDim", "innerDim"}, slice));
+  EXPECT_EQ(slice.values,
+            std::vector<float>({0.0f, 1.0f, 2.0f, 100.0f, 101.0f, 102.0f}));
+  EXPECT_TRUE(binaryPool.readDataSlice("id", {"dirDim", "innerDim"}, slice));
+  EXPECT_EQ(slice.values,
+            std::vector<float>({0.0f, 1.0f, 2.0f, 0.0f, 1.0f, 2.0f}));
+}
+
+class CountingJsonReader : public JsonFileReader {
+public:
+  bool readFields(const std::string &path, const std::string &field,
+                  DataFieldMap &fields) override {
+    reads++;
+    return JsonFileReader::readFields(path, field, fields);
+  }
+  std::atomic<int> reads{0};
+};
+
+TEST(DataPool, ParsedFileCache) {
+  ParameterSpace ps;
+  RunDirectories runs(ps, "datapool_parsed_", 1);
+  auto innerDim = ps.newDimension("innerDim");
+  float innerValues[] = {0.0f, 0.5f};
+  innerDim->appendSpaceValues(innerValues, 2);
+  runs.writeFile(0, "parsed_data.json", "{\"value\": [1, 2]}");
+
+  DataPool dp(ps);
+  auto reader = std::make_shared<CountingJsonReader>();
+  dp.registerFileReader("json", reader, {".json"});
+  dp.registerDataFile("parsed_data.json", "innerDim");
+
+  // Single cell slices, so the file is never read concurrently
+  DataPool::SliceData slice;
+  innerDim->setCurrentIndex(1);
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  EXPECT_EQ(slice.values, std::vector<float>({2.0f}));
+  EXPECT_EQ(reader->reads, 1);
+
+  // The JSON reader reads all fields, so missing fields don't parse again
+  EXPECT_TRUE(dp.readDataSlice("missing", {"dirDim"}, slice));
+  EXPECT_TRUE(std::isnan(slice.values[0]));
+  EXPECT_EQ(reader->reads, 1);
+
+  // Modified files are parsed again
+  al::al_sleep(0.05); // Make sure modification time changes
+  runs.writeFile(0, "parsed_data.json", "{\"value\": [3, 4, 5]}");
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  EXPECT_EQ(slice.values, std::vector<float>({4.0f}));
+  EXPECT_EQ(reader->reads, 2);
+}
+
+TEST(DataPool, ParsedFileBudget) {
+  ParameterSpace ps;
+  RunDirectories runs(ps, "datapool_parsed_budget_", 3);
+  // Files of the same size
+  runs.writeFiles("budget_data.json", [](size_t i) {
+    return "{\"value\": " + std::to_string(i) + "}";
+  });
+  uint64_t fileSize = std::string("{\"value\": 0}").size();
+
+  DataPool dp(ps);
+  auto reader = std::make_shared<CountingJsonReader>();
+  dp.registerFileReader("json", reader, {".json"});
+  dp.registerDataFile("budget_data.json", "");
+
+  DataPool::SliceData slice;
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  EXPECT_EQ(reader->reads, 3);
+
+  // Files larger than the budget are not kept
+  dp.setMaxParsedFileBytes(fileSize - 1);
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  EXPECT_EQ(reader->reads, 6);
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  EXPECT_EQ(reader->reads, 9);
+
+  // Only two of the files are kept, so every slice reads at least one
+  dp.setMaxParsedFileBytes(2 * fileSize);
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  int reads = reader->reads;
+  EXPECT_GT(reads, 9);
+  EXPECT_TRUE(dp.readDataSlice("value", {"dirDim"}, slice));
+  EXPECT_GT(reader->reads, reads);
+  EXPECT_EQ(slice.values, std::vector<float>({0.0f, 1.0f, 2.0f}));
+}
+
+TEST(DataPool, ReduceSlice) {
+  ParameterSpace ps("reduce_ps");
+  RunDirectories runs(ps, "datapool_reduce_", 4);
+  // Last directory has no data
+  runs.writeFiles("reduce_data.json", [](size_t i) {
+    return i < 3 ? "{\"value\": " + std::to_string(i * 2) + "}" : "";
+  });
+
+  DataPool dp("reduce_dp", ps);
+  dp.registerDataFile("reduce_data.json", "");
+
+  DataPool::SliceReduction reduction;
+  EXPECT_TRUE(dp.reduceDataSlice("value", {"dirDim"}, reduction, 2));
+  EXPECT_EQ(reduction.count, 3);
+  EXPECT_EQ(reduction.missing, 1);
+  EXPECT_EQ(reduction.min, 0.0f);
+  EXPECT_EQ(reduction.max, 4.0f);
+  EXPECT_DOUBLE_EQ(reduction.mean, 2.0);
+  EXPECT_EQ(reduction.histogram, std::vector<uint64_t>({1, 2}));
+
+  TincServer tserver;
+  EXPECT_TRUE(tserver.start());
+  tserver << ps << dp;
+
+  TincClient tclient;
+  EXPECT_TRUE(tclient.start());
+  al::al_sleep(0.5); // Give time to connect
+
+  DataPool::SliceReduction remoteReduction;
+  EXPECT_TRUE(tclient.reduceDataSlice("reduce_dp", "value", {"dirDim"},
+                                      remoteReduction, 4, 0.0f, 8.0f));
+  EXPECT_EQ(remoteReduction.count, 3);
+  EXPECT_DOUBLE_EQ(remoteReduction.mean, 2.0);
+  EXPECT_EQ(remoteReduction.histogram, std::vector<uint64_t>({1, 1, 1, 0}));
+
+  tclient.stop();
+  tserver.stop();
+}
+
+TEST(DataPool, RemoteSliceInline) {
+  ParameterSpace ps("inline_ps");
+  RunDirectories runs(ps, "datapool_inline_", 3);
+  auto innerDim = ps.newDimension("innerDim");
+  float innerValues[] = {0.0f, 0.5f};
+  innerDim->appendSpaceValues(innerValues, 2);
+  runs.writeFiles("inline_data.json", [](size_t i) {
+    return "{\"value\": [" + std::to_string(i * 10) + ", " +
+           std::to_string(i * 10 + 1) + "]}";
+  });
+
+  DataPool dp("inline_dp", ps);
+  dp.registerDataFile("inline_data.json", "innerDim");
+
+  TincServer tserver;
+  EXPECT_TRUE(tserver.start());
+  tserver << ps << dp;
+
+  TincClient tclient;
+  EXPECT_TRUE(tclient.start());
+  al::al_sleep(0.5); // Give time to connect
+
+  DataPool::SliceData slice;
+  EXPECT_TRUE(
+      tclient.readDataSlice("inline_dp", "value", {"dirDim", "innerDim"}, slice));
+  EXPECT_EQ(slice.dimensions,
+            std::vector<std::string>({"dirDim", "innerDim"}));
+  EXPECT_EQ(slice.shape, std::vector<size_t>({3, 2}));
+  EXPECT_EQ(slice.values,
+            std::vector<float>({0.0f, 1.0f, 10.0f, 11.0f, 20.0f, 21.0f}));
+
+  // Two values per message
+  DataPool::SliceData chunkedSlice;
+  EXPECT_TRUE(tclient.readDataSlice("inline_dp", "value",
+                                    {"dirDim", "innerDim"}, chunkedSlice,
+                                    2 * sizeof(float)));
+  EXPECT_EQ(chunkedSlice.values, slice.values);
+
+  EXPECT_FALSE(tclient.readDataSlice("inline_dp", "value", {"unknownDim"},
+                                     slice));
+
+  tclient.stop();
+  tserver.stop();
+}
+
+TEST(DataPool, MultiFieldSlices) {
+  ParameterSpace ps("fields_ps");
+  RunDirectories runs(ps, "datapool_fields_", 3);
+  runs.writeFiles("fields_data.json", [](size_t i) {
+    return "{\"a\": " + std::to_string(i) + ", \"b\": " +
+           std::to_string(i * 10) + "}";
+  });
+
+  DataPool dp("fields_dp", ps);
+  dp.registerDataFile("fields_data.json", "");
+
+  std::vector<DataPool::SliceData> slices;
+  EXPECT_TRUE(dp.readDataSlices({"a", "b"}, {"dirDim"}, slices));
+  EXPECT_EQ(slices.size(), 2);
+  EXPECT_EQ(slices[0].values, std::vector<float>({0.0f, 1.0f, 2.0f}));
+  EXPECT_EQ(slices[1].values, std::vector<float>({0.0f, 10.0f, 20.0f}));
+
+  auto sliceName = dp.createDataSlices({"a", "b"}, {"dirDim"});
+  EXPECT_NE(sliceName, "");
+  EXPECT_TRUE(al::File::exists(dp.getCacheDirectory() + sliceName));
+
+  // Missing values are NaN, but the slices are not complete
+  std::vector<DataPool::SliceData> missingSlices;
+  EXPECT_FALSE(dp.readDataSlices({"a", "missing"}, {"dirDim"}, missingSlices));
+  EXPECT_TRUE(std::isnan(missingSlices[1].values[0]));
+  EXPECT_EQ(dp.createDataSlices({"a", "missing"}, {"dirDim"}), "");
+
+  TincServer tserver;
+  EXPECT_TRUE(tserver.start());
+  tserver << ps << dp;
+
+  TincClient tclient;
+  EXPECT_TRUE(tclient.start());
+  al::al_sleep(0.5); // Give time to connect
+
+  std::vector<DataPool::SliceData> remoteSlices;
+  // One value per message
+  EXPECT_TRUE(tclient.readDataSlices("fields_dp", {"a", "b"}, {"dirDim"},
+                                     remoteSlices, sizeof(float)));
+  EXPECT_EQ(remoteSlices.size(), 2);
+  EXPECT_EQ(remoteSlices[0].shape, std::vector<size_t>({3}));
+  EXPECT_EQ(remoteSlices[0].values, slices[0].values);
+  EXPECT_EQ(remoteSlices[1].values, slices[1].values);
+
+  tclient.stop();
+  tserver.stop();
+
+  al::File::remove(dp.getCacheDirectory() + sliceName);
+}
+
+TEST(DataPool, ConcurrentCommands) {
+  ParameterSpace ps("concurrent_ps");
+  RunDirectories runs(ps, "datapool_concurrent_", 4);
+  runs.writeFiles("concurrent_data.json", [](size_t i) {
+    return "{\"value\": " + std::to_string(i) + "}";
+  });
+
+  DataPool dp("concurrent_dp", ps);
+  dp.registerDataFile("concurrent_data.json", "");
+
+  TincServer tserver;
+  EXPECT_TRUE(tserver.start());
+  tserver << ps << dp;
+
+  TincClient tclient;
+  EXPECT_TRUE(tclient.start());
+  al::al_sleep(0.5); // Give time to connect
+
+  // Commands are processed on the server's command threads and replies
+  // may arrive in any order
+  std::vector<std::thread> threads;
+  std::atomic<int> succeeded{0};
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&]() {
+      DataPool::SliceData slice;
+      if (tclient.readDataSlice("concurrent_dp", "value", {"dirDim"},
+                                slice) &&
+          slice.values == std::vector<float>({0.0f, 1.0f, 2.0f, 3.0f})) {
+        succeeded++;
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(succeeded, 8);
+
+  tclient.stop();
+  tserver.stop();
+}
+
+TEST(DataPool, ParameterSpaceSnapshot) {
+  ParameterSpace ps;
+  RunDirectories runs(ps, "datapool_snapshot_", 3);
+  auto innerDim = ps.newDimension("innerDim");
+  float innerValues[] = {0.0f, 0.5f};
+  innerDim->appendSpaceValues(innerValues, 2);
+  runs.writeFiles("snapshot_data.json", [](size_t i) {
+    return "{\"value\": [" + std::to_string(i * 10) + ", " +
+           std::to_string(i * 10 + 1) + "]}";
+  });
+
+  DataPool dp(ps);
+  dp.registerDataFile("snapshot_data.json", "innerDim");
+
+  auto snapshot = ps.snapshot();
+  innerDim->setCurrentIndex(1);
+  EXPECT_EQ(snapshot->getDimension("innerDim")->getCurrentIndex(), 0);
+
+  float buffer[3];
+  {
+    DataPool::ScopedParameterSpace scope(dp, *snapshot);
+    EXPECT_EQ(dp.readDataSlice("value", "dirDim", buffer, 3), 3);
+    EXPECT_EQ(buffer[0], 0.0f);
+    EXPECT_EQ(buffer[2], 20.0f);
+  }
+  EXPECT_EQ(dp.readDataSlice("value", "dirDim", buffer, 3), 3);
+  EXPECT_EQ(buffer[0], 1.0f);
+  EXPECT_EQ(buffer[2], 21.0f);
+}
+
+TEST(DataPool, LiveSlice) {
+  ParameterSpace ps;
+  RunDirectories runs(ps, "datapool_live_", 3);
+  // Last run has not finished
+  runs.writeFiles("live_data.json", [](size_t i) {
+    return i < 2 ? "{\"value\": " + std::to_string(i) + "}" : "";
+  });
+
+  DataPool dp(ps);
+  dp.registerDataFile("live_data.json", "");
+  dp.setLiveSlices(true);
+
+  float slice[3];
+  EXPECT_EQ(dp.readDataSlice("value", "dirDim", slice, 3), 3);
+  EXPECT_EQ(slice[1], 1.0f);
+  EXPECT_TRUE(std::isnan(slice[2]));
+
+  al::al_sleep(0.1); // Make sure modification times change
+  runs.writeFile(2, "live_data.json", "{\"value\": 2}");
+  runs.writeFile(0, "live_data.json", "{\"value\": 10}");
+  EXPECT_EQ(dp.readDataSlice("value", "dirDim", slice, 3), 3);
+  EXPECT_EQ(slice[0], 10.0f);
+  EXPECT_EQ(slice[1], 1.0f);
+  EXPECT_EQ(slice[2], 2.0f);
+}
+
+TEST(DataPool, Consolidate) {
+  ParameterSpace ps;
+  RunDirectories runs(ps, "datapool_consolidate_", 3);
+  auto innerDim = ps.newDimension("innerDim");
+  float innerValues[] = {0.0f, 0.5f};
+  innerDim->appendSpaceValues(innerValues, 2);
+  runs.writeFiles("consolidate_data.json", [](size_t i) {
+    return "{\"value\": [" + std::to_string(i * 10) + ", " +
+           std::to_string(i * 10 + 1) + "], \"other\": " +
+           std::to_string(i) + "}";
+  });
+
+  DataPool dp("consolidate_dp", ps);
+  dp.registerDataFile("consolidate_data.json", "innerDim");
+  EXPECT_TRUE(dp.consolidate());
+  EXPECT_TRUE(al::File::exists(dp.getConsolidatedPath()));
+
+  // Slices now come from the consolidated file. A new data pool has not
+  // parsed the data files, so no files are read.
+  DataPool consolidated("consolidate_dp", ps);
+  auto reader = std::make_shared<CountingJsonReader>();
+  consolidated.registerFileReader("json", reader, {".json"});
+  consolidated.registerDataFile("consolidate_data.json", "innerDim");
+  DataPool::SliceData slice;
+  EXPECT_TRUE(consolidated.readDataSlice("value", {"dirDim", "innerDim"},
+                                         slice));
+  EXPECT_EQ(slice.values,
+            std::vector<float>({0.0f, 1.0f, 10.0f, 11.0f, 20.0f, 21.0f}));
+  EXPECT_TRUE(consolidated.readDataSlice("other", {"dirDim"}, slice));
+  EXPECT_EQ(slice.values, std::vector<float>({0.0f, 1.0f, 2.0f}));
+  EXPECT_EQ(reader->reads, 0);
+
+  // Data files modified after consolidating are read instead
+  al::al_sleep(0.05); // Make sure modification time changes
+  runs.writeFile(1, "consolidate_data.json",
+                 "{\"value\": [-1, -1], \"other\": -1}");
+  EXPECT_TRUE(consolidated.readDataSlice("other", {"dirDim"}, slice));
+  EXPECT_EQ(slice.values, std::vector<float>({0.0f, -1.0f, 2.0f}));
+  EXPECT_GT(reader->reads, 0);
+
+  // Consolidating again picks up the change
+  EXPECT_TRUE(dp.consolidate());
+  int reads = reader->reads;
+  EXPECT_TRUE(consolidated.readDataSlice("value", {"dirDim", "innerDim"},
+                                         slice));
+  EXPECT_EQ(slice.values,
+            std::vector<float>({0.0f, 1.0f, -1.0f, -1.0f, 20.0f, 21.0f}));
+  EXPECT_EQ(reader->reads, reads);
+
+  // And from the data files when it is removed
+  al::File::remove(dp.getConsolidatedPath());
+  EXPECT_TRUE(dp.readDataSlice("other", {"dirDim"}, slice));
+  EXPECT_EQ(slice.values, std::vector<float>({0.0f, -1.0f, 2.0f}));
+}
@@ -3,7 +3,9 @@
 #include "tinc/DiskBuffer.hpp"
 #include "tinc/DiskBufferImage.hpp"
 #include "tinc/DiskBufferJson.hpp"
+#include "tinc/DiskBufferMapped.hpp"
 #include "tinc/DiskBufferNetCDF.hpp"
+#include "tinc/FileWatcher.hpp"
 #include "tinc/TincClient.hpp"
 #include "tinc/TincServer.hpp"
 
@@ -11,6 +13,15 @@
 #include "al/system/al_Time.hpp"
 #include "al/ui/al_Parameter.hpp"
 
+#include <atomic>
+#include <cstring>
+#include <fstream>
+
+#ifndef AL_WINDOWS
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
 using namespace tinc;
 
 TEST(DiskBuffer, Connection) {
@@ -68,3 +79,221 @@ TEST(DiskBuffer, Connection) {
   tclient.stop();
   tserver.stop();
 }
+
+TEST(DiskBuffer, Mapped) {
+  DiskBufferMapped buffer{"mapped", "test_mapped.bin"};
+  float values[] = {1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f};
+  EXPECT_TRUE(buffer.writeArray(values, BinaryFileReader::FLOAT32, {2, 3}));
+
+  auto array = buffer.get();
+  EXPECT_EQ(array->shape(), std::vector<size_t>({2, 3}));
+  EXPECT_EQ(array->count(), 6);
+  auto span = array->span<float>();
+  EXPECT_EQ(std::vector<float>(span.begin(), span.end()),
+            std::vector<float>(values, values + 6));
+  EXPECT_TRUE(array->span<double>().empty());
+
+  // Previous mapping stays valid while held
+  double newValues[] = {7.0, 8.0};
+  EXPECT_TRUE(buffer.writeArray(newValues, BinaryFileReader::FLOAT64, {2}));
+  EXPECT_EQ(span[5], 6.0f);
+  auto newArray = buffer.get();
+  EXPECT_EQ(newArray->span<double>()[1], 8.0);
+
+  al::File::remove("test_mapped.bin");
+}
+
+TEST(DiskBuffer, MappedMalformedHeader) {
+  // Shapes whose value count or byte size overflow. Without checks they
+  // wrap around to sizes that fit the file.
+  std::vector<std::vector<uint64_t>> shapes = {
+      {uint64_t(1) << 33, uint64_t(1) << 33}, {(uint64_t(1) << 62) + 1}};
+  for (const auto &shape : shapes) {
+    {
+      std::ofstream f("test_malformed.bin", std::ios::binary);
+      uint8_t prefix[MappedArray::HEADER_PREFIX_SIZE] = {
+          'T', 'N', 'C', 'A', MappedArray::FORMAT_VERSION,
+          BinaryFileReader::FLOAT32};
+      uint16_t dimensionCount = (uint16_t)shape.size();
+      memcpy(prefix + 6, &dimensionCount, sizeof(uint16_t));
+      f.write((const char *)prefix, sizeof(prefix));
+      f.write((const char *)shape.data(), shape.size() * sizeof(uint64_t));
+      float value = 1.0f;
+      f.write((const char *)&value, sizeof(float));
+    }
+    MappedArray array;
+    EXPECT_FALSE(array.setFile(MappedFile::open("test_malformed.bin")));
+    EXPECT_EQ(array.data(), nullptr);
+  }
+  al::File::remove("test_malformed.bin");
+}
+
+TEST(DiskBuffer, MemoryTier) {
+  auto cmanage = std::make_shared<CacheManager>(
+      DistributedPath{"db_memory_cache.json", "db_memory_cache/"});
+  cmanage->clearCache();
+  cmanage->setMemoryTierSize(1024);
+  cmanage->setRestoreToMemory(true);
+  for (int i = 0; i < 2; i++) {
+    std::string filename = "db_memory_" + std::to_string(i) + ".json";
+    {
+      std::ofstream f(filename);
+      f << "{\"value\": " << i << "}";
+    }
+    CacheEntry entry;
+    entry.timestampStart = "2021-01-01T10:00:00";
+    entry.timestampEnd = "2021-01-01T10:00:0" + std::to_string(i);
+    entry.filenames = {filename};
+    entry.sourceInfo.type = "SourceType";
+    entry.sourceInfo.tincId = "ProcessorId";
+    EXPECT_TRUE(cmanage->storeFiles({filename}, entry));
+    cmanage->appendEntry(entry);
+  }
+  {
+    std::ofstream f("db_memory_output.json");
+    f << "{\"value\": -1}";
+  }
+  DiskBufferJson buffer{"memory", "db_memory_output.json"};
+  buffer.setCacheManager(cmanage);
+
+  // Several cache files restored to the same path, as when scrubbing
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(cmanage->restoreFile("db_memory_" + std::to_string(i) + ".json",
+                                     "db_memory_output.json"));
+    EXPECT_TRUE(buffer.updateData());
+    EXPECT_EQ((*buffer.get())["value"], i);
+  }
+  // The file on disk is not written
+  {
+    std::ifstream f("db_memory_output.json");
+    std::string contents((std::istreambuf_iterator<char>(f)),
+                         std::istreambuf_iterator<char>());
+    EXPECT_EQ(contents, "{\"value\": -1}");
+  }
+
+  cmanage->clearCache();
+  for (int i = 0; i < 2; i++) {
+    al::File::remove("db_memory_" + std::to_string(i) + ".json");
+  }
+  al::File::remove("db_memory_output.json");
+}
+
+#ifndef AL_WINDOWS
+// Write file and restore its modification time, so it looks unchanged
+static void overwriteKeepingModified(const std::string &path,
+                                     const std::string &contents) {
+  struct stat s;
+  ASSERT_EQ(::stat(path.c_str(), &s), 0);
+  {
+    std::ofstream f(path);
+    f << contents;
+  }
+#ifdef AL_OSX
+  struct timespec times[2] = {s.st_atimespec, s.st_mtimespec};
+#else
+  struct timespec times[2] = {s.st_atim, s.st_mtim};
+#endif
+  ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+}
+#endif
+
+TEST(DiskBuffer, AsyncAndPrefetch) {
+  for (int i = 0; i < 3; i++) {
+    std::ofstream f("test_async_" + std::to_string(i) + ".json");
+    f << "{\"value\": " << i << "}";
+  }
+  DiskBufferJson buffer{"async", "test_async_0.json"};
+  std::atomic<int> updates(0);
+  buffer.registerUpdateCallback([&](bool ok) {
+    if (ok) {
+      updates++;
+    }
+  });
+  buffer.updateDataAsync();
+  buffer.waitForAsyncTasks();
+  EXPECT_EQ(updates, 1);
+  EXPECT_EQ((*buffer.get())["value"], 0);
+
+  buffer.prefetch({"test_async_1.json", "test_async_2.json"});
+  buffer.waitForAsyncTasks();
+#ifndef AL_WINDOWS
+  // The prefetched data is swapped in without reading the file again
+  overwriteKeepingModified("test_async_1.json", "{\"value\": 99}");
+#endif
+  EXPECT_TRUE(buffer.updateData("test_async_1.json"));
+  EXPECT_EQ((*buffer.get())["value"], 1);
+
+  // Prefetched data is not used once the file changes
+  al::al_sleep(0.05); // Make sure modification time changes
+  {
+    std::ofstream f("test_async_2.json");
+    f << "{\"value\": 20}";
+  }
+  buffer.updateDataAsync("test_async_2.json");
+  buffer.waitForAsyncTasks();
+  EXPECT_EQ((*buffer.get())["value"], 20);
+  EXPECT_EQ(updates, 3);
+
+  for (int i = 0; i < 3; i++) {
+    al::File::remove("test_async_" + std::to_string(i) + ".json");
+  }
+}
+
+TEST(DiskBuffer, AsyncUpdateBuffersHeld) {
+  {
+    std::ofstream f("test_held.json");
+    f << "{\"value\": 1}";
+  }
+  DiskBufferJson buffer{"held", "test_held.json"};
+  std::atomic<int> failures(0);
+  buffer.registerUpdateCallback([&](bool ok) {
+    if (!ok) {
+      failures++;
+    }
+  });
+  // Readers hold both buffers
+  EXPECT_TRUE(buffer.updateData(""));
+  auto first = buffer.get();
+  EXPECT_TRUE(buffer.updateData(""));
+  auto second = buffer.get();
+
+  // Asynchronous updates give up instead of waiting for the readers
+  buffer.updateDataAsync();
+  buffer.waitForAsyncTasks();
+  EXPECT_EQ(failures, 1);
+
+  first = nullptr;
+  buffer.updateDataAsync();
+  buffer.waitForAsyncTasks();
+  EXPECT_EQ(failures, 1);
+  al::File::remove("test_held.json");
+}
+
+#ifdef AL_LINUX
+TEST(DiskBuffer, FileWatcher) {
+  auto watcher = std::make_shared<FileWatcher>();
+  DiskBufferJson buffer{"watched", "test_watched.json"};
+  std::atomic<int> updates(0);
+  buffer.registerUpdateCallback([&](bool ok) {
+    if (ok) {
+      updates++;
+    }
+  });
+  buffer.setFileWatcher(watcher);
+
+  // Written by another process
+  {
+    std::ofstream f("test_watched.json");
+    f << "{\"value\": 1}";
+  }
+  for (int i = 0; i < TINC_TESTS_TIMEOUT_MS && updates == 0; i++) {
+    al::al_sleep(0.001);
+  }
+  al::al_sleep(0.1);
+  EXPECT_EQ(updates, 1);
+  EXPECT_EQ((*buffer.get())["value"], 1);
+
+  buffer.setFileWatcher(nullptr);
+  al::File::remove("test_watched.json");
+}
+#endif